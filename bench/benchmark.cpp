@@ -0,0 +1,765 @@
+// Benchmark suite: renders a set of canonical scenes several times and reports the median of every
+// stage, with ray counts and throughput by ray type. images are only written with --write, so the
+// output stage is measured separately from rendering.
+//
+//   Raytracer_bench [--runs N] [--scenes a,b,...] [--threads N] [--tile N] [--packet N]
+//                   [--simd scalar|sse|avx2] [--size WxH] [--samples N] [--adaptive X] [--max-samples N]
+//                   [--light-samples N] [--no-wavefront] [--write] [--json FILE]
+//                   [--check DIR | --update-golden DIR] [--tolerance N] [--bad-pixels X] [--margin X] [--no-perf]
+//
+// scenes: assignment (the six parts), many-spheres, many-mirrors (the same spheres, all mirrors),
+// mirror-box, many-lights, interactive (a render session moving a sphere of the assignment scene),
+// mesh, instances, textures. throughput of a ray type is its count divided by the wall time of the pass,
+// so the numbers of one pass add up to its total.
+//
+// regression check (the golden test of ctest): --check DIR renders the assignment scene (the six
+// parts of Raytracer_bin) on one thread and compares every part per pixel with DIR/<part>.ppm. a
+// pixel is off if a channel differs by more than --tolerance (default 2); a part fails if more than
+// --bad-pixels (default 0.0005) of its pixels are off. the rays per second over all parts (fastest
+// runs) are measured relative to a calibration loop that shares no code with the renderer, so the
+// number carries over between machines; it must stay within --margin (default 0.2) of the one in
+// DIR/baseline.txt. --no-perf skips that gate, e.g. for unoptimized builds. the exit status is 1 on
+// any failure, and --write adds a difference image check_<part>_diff for every failed part.
+// --update-golden DIR renders the references and the baseline instead, for the settings given
+
+#define _USE_MATH_DEFINES
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/vec3.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "image.h"
+#include "packet.h"
+#include "render.h"
+#include "scene.h"
+#include "sceneio.h"
+#include "session.h"
+#include "trianglemesh.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double msSince(Clock::time_point t) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - t).count();
+}
+
+double median(std::vector<double> v) {
+    if (v.empty()) return 0.0;
+    std::sort(v.begin(), v.end());
+    size_t n = v.size();
+    return n % 2 ? v[n / 2] : 0.5 * (v[n / 2 - 1] + v[n / 2]);
+}
+
+// ---- canonical scenes, built in code so the suite has no file dependencies ----
+
+// 10000 small spheres in front of the assignment planes, the given fraction of them mirrors
+void manySpheres(Scene& scene, float mirrors) {
+    addAssignmentPlanes(scene);
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> x(-2.8f, 1.8f), y(-0.9f, 2.3f), z(-9.5f, -2.5f);
+    std::uniform_real_distribution<float> radius(0.03f, 0.08f), channel(0.1f, 1.0f), coin(0.0f, 1.0f);
+    for (int i = 0; i < 10000; ++i) {
+        glm::vec3 color(channel(rng), channel(rng), channel(rng));
+        scene.add(Sphere(color, radius(rng), glm::vec3(x(rng), y(rng), z(rng)), coin(rng) < mirrors));
+    }
+    scene.commit();
+}
+
+// the assignment spheres in a box of mirrors: long reflection chains
+void mirrorBox(Scene& scene) {
+    scene.add(Sphere(glm::vec3(1.0, 0.5, 0.0), 0.75, glm::vec3(0.0, 0.0, -5.0), true));
+    scene.add(Sphere(glm::vec3(0.0, 1.0, 0.5), 0.5, glm::vec3(1.0, 0.0, -5.5), true));
+    scene.add(Sphere(glm::vec3(0.0, 0.5, 1.0), 0.2, glm::vec3(-1.0, 0.5, -3.0), false));
+    scene.add(Sphere(glm::vec3(1.0, 0.5, 0.5), 0.2, glm::vec3(-0.5, -0.5, -2.5), false));
+    glm::vec3 grey(0.75, 0.75, 0.75);
+    scene.add(Plane(grey, glm::vec3(0.0, 1.0, 0.0), glm::vec3(0.0, -1.0, 0.0), true));
+    scene.add(Plane(grey, glm::vec3(-1.0, 0.0, 0.0), glm::vec3(2.0, 0.0, 0.0), true));
+    scene.add(Plane(grey, glm::vec3(0.0, 0.0, 1.0), glm::vec3(0.0, 0.0, -10.0), true));
+    scene.add(Plane(grey, glm::vec3(1.0, 0.0, 0.0), glm::vec3(-3.0, 0.0, 0.0), true));
+    scene.add(Plane(grey, glm::vec3(0.0, -1.0, 0.0), glm::vec3(0.0, 2.5, 0.0), false));
+    scene.add(Plane(grey, glm::vec3(0.0, 0.0, -1.0), glm::vec3(0.0, 0.0, 2.0), true));
+    scene.commit();
+}
+
+// the assignment scene lit by a grid of 1024 dim point lights under the ceiling plus four area
+// lights on the walls instead of the single assignment light
+void manyLights(SceneDescription& desc) {
+    addAssignmentSpheres(desc.scene);
+    addAssignmentPlanes(desc.scene);
+    desc.lights.clear();
+    for (int x = 0; x < 32; ++x) {
+        for (int z = 0; z < 32; ++z) {
+            glm::vec3 position(-2.9f + 4.8f * float(x) / 31.0f, 2.3f, -9.8f + 11.6f * float(z) / 31.0f);
+            glm::vec3 tint(0.5f + 0.5f * float(x) / 31.0f, 0.75f, 1.0f - 0.5f * float(z) / 31.0f);
+            desc.lights.addPoint(position, 0.03f * tint, 1.5f);
+        }
+    }
+    for (int i = 0; i < 4; ++i) {
+        float z = -9.0f + 2.5f * float(i);
+        desc.lights.addArea(glm::vec3(-2.95f, 0.5f, z), glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 1.0f, 0.0f),
+                            glm::vec3(0.6f, 0.5f, 0.4f), 2.0f);
+    }
+    desc.lights.commit();
+}
+
+// the assignment scene with a finely tessellated, smooth shaded sphere mesh (about 100k triangles)
+void meshScene(Scene& scene) {
+    addAssignmentSpheres(scene);
+    const int rings = 160, segments = 320;
+    const glm::vec3 center(1.0f, -0.5f, -3.8f);
+    const float radius = 0.45f;
+    TriangleMesh mesh(glm::vec3(1.0f, 0.8f, 0.2f), false, 0.2f, 20.0f);
+    for (int r = 0; r <= rings; ++r) {
+        float theta = float(M_PI) * float(r) / float(rings);
+        for (int s = 0; s < segments; ++s) {
+            float phi = 2.0f * float(M_PI) * float(s) / float(segments);
+            glm::vec3 n(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+            mesh.addVertex(center + radius * n, n);
+        }
+    }
+    for (int r = 0; r < rings; ++r) {
+        for (int s = 0; s < segments; ++s) {
+            uint32_t a = uint32_t(r * segments + s), b = uint32_t(r * segments + (s + 1) % segments);
+            mesh.addTriangle(a, a + segments, b + segments);
+            mesh.addTriangle(a, b + segments, b);
+        }
+    }
+    scene.add(mesh);
+    addAssignmentPlanes(scene);
+}
+
+// 1000 instances of one prototype, a smooth sphere mesh of 6400 triangles ringed by eight small
+// spheres, in front of the assignment planes: 6.4 million triangles in the picture, one copy in
+// memory
+void instancedScene(Scene& scene) {
+    addAssignmentPlanes(scene);
+    scene.beginPrototype();
+    const int rings = 40, segments = 80;
+    TriangleMesh mesh(glm::vec3(1.0f, 0.8f, 0.2f), false, 0.2f, 20.0f);
+    for (int r = 0; r <= rings; ++r) {
+        float theta = float(M_PI) * float(r) / float(rings);
+        for (int s = 0; s < segments; ++s) {
+            float phi = 2.0f * float(M_PI) * float(s) / float(segments);
+            glm::vec3 n(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+            mesh.addVertex(n, n);
+        }
+    }
+    for (int r = 0; r < rings; ++r) {
+        for (int s = 0; s < segments; ++s) {
+            uint32_t a = uint32_t(r * segments + s), b = uint32_t(r * segments + (s + 1) % segments);
+            // wound counterclockwise seen from outside, like the vertex normals
+            mesh.addTriangle(a, b + segments, a + segments);
+            mesh.addTriangle(a, b, b + segments);
+        }
+    }
+    scene.add(mesh);
+    for (int i = 0; i < 8; ++i) {
+        float phi = 2.0f * float(M_PI) * float(i) / 8.0f;
+        scene.add(Sphere(glm::vec3(0.0f, 0.5f, 1.0f), 0.25f, glm::vec3(1.4f * std::cos(phi), 0.0f, 1.4f * std::sin(phi)), i % 2 == 0));
+    }
+    scene.endPrototype();
+
+    // every tenth instance all mirror
+    uint32_t mirror = scene.addMaterial(Material(glm::vec3(0.9f, 0.9f, 0.9f), true));
+    std::mt19937 rng(11);
+    std::uniform_real_distribution<float> x(-2.8f, 1.8f), y(-0.9f, 2.3f), z(-9.5f, -2.5f);
+    std::uniform_real_distribution<float> size(0.05f, 0.12f), angle(0.0f, 6.2831853f), coin(0.0f, 1.0f);
+    for (int i = 0; i < 1000; ++i) {
+        glm::mat4 transform = glm::translate(glm::mat4(1.0f), glm::vec3(x(rng), y(rng), z(rng))) *
+                              glm::rotate(glm::mat4(1.0f), angle(rng), glm::vec3(coin(rng), 1.0f, coin(rng))) *
+                              glm::scale(glm::mat4(1.0f), glm::vec3(size(rng)));
+        scene.addInstance(0, transform, i % 10 == 0 ? mirror : NoMaterial);
+    }
+    scene.commit();
+}
+
+// count image textures of size x size in the temp directory, written on first use: smooth color
+// bands under a grid of lines, a different pattern for every image. returns their paths
+std::vector<std::string> benchTextureImages(int count, int size) {
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "raytracer_bench_textures";
+    std::filesystem::create_directories(dir);
+    std::vector<std::string> paths;
+    for (int t = 0; t < count; ++t) {
+        std::string base = (dir / ("texture" + std::to_string(t) + "_" + std::to_string(size))).string();
+        paths.push_back(base + ".ppm");
+        if (std::filesystem::exists(paths.back())) continue;
+        std::vector<glm::u8vec3> img(size_t(size) * size);
+        for (int y = 0; y < size; ++y) {
+            for (int x = 0; x < size; ++x) {
+                float u = float(x) / float(size), v = float(y) / float(size);
+                glm::vec3 c(0.5f + 0.5f * std::sin(6.2831853f * (u * float(t + 1) + v)),
+                            0.5f + 0.5f * std::sin(6.2831853f * (v * float(t % 3 + 1) - u)),
+                            0.5f + 0.5f * std::cos(6.2831853f * (u + v) * float(t % 4 + 1)));
+                if (x % 64 < 3 || y % 64 < 3) c *= 0.2f;
+                img[size_t(y) * size + x] = glm::u8vec3(c * 255.0f);
+            }
+        }
+        writeP6PPM(unsigned(size), unsigned(size), img, base);
+    }
+    return paths;
+}
+
+// 400 spheres wearing eight 1024x1024 image textures, a tenth of them mirrors, in the assignment box
+// with a checker floor and an image on the back wall. the images have about 45 MB of tiles and the
+// texture cache is held to 16 MB, so the passes evict tiles and read them back
+void texturedScene(Scene& scene) {
+    static const std::vector<std::string> images = benchTextureImages(8, 1024);
+    textureCache().setBudget(size_t(16) << 20);
+    std::vector<uint32_t> textures;
+    for (const std::string& image : images) textures.push_back(scene.addImageTexture(image));
+
+    Texture checker;
+    checker.colorA = glm::vec3(1.0f, 1.0f, 1.0f);
+    checker.colorB = glm::vec3(0.2f, 0.2f, 0.25f);
+    checker.scale = 2.0f;
+    Material floor(glm::vec3(0.75f, 0.75f, 0.75f));
+    floor.texture = scene.addTexture(checker);
+    Material back(glm::vec3(0.75f, 0.75f, 0.75f));
+    back.texture = scene.addImageTexture(images[0], 0.25f);
+    uint32_t wall = scene.addMaterial(Material(glm::vec3(0.75f, 0.75f, 0.75f)));
+    scene.addPlane(glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f), scene.addMaterial(floor));
+    scene.addPlane(glm::vec3(-1.0f, 0.0f, 0.0f), glm::vec3(2.0f, 0.0f, 0.0f), wall);
+    scene.addPlane(glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 0.0f, -10.0f), scene.addMaterial(back));
+    scene.addPlane(glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(-3.0f, 0.0f, 0.0f), wall);
+    scene.addPlane(glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, 2.5f, 0.0f), wall);
+    scene.addPlane(glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 0.0f, 2.0f), wall);
+
+    std::vector<uint32_t> materials;
+    for (uint32_t t : textures) {
+        Material mat(glm::vec3(1.0f, 1.0f, 1.0f));
+        mat.texture = t;
+        materials.push_back(scene.addMaterial(mat));
+    }
+    uint32_t mirror = scene.addMaterial(Material(glm::vec3(0.9f, 0.9f, 0.9f), true));
+    std::mt19937 rng(13);
+    std::uniform_real_distribution<float> x(-2.8f, 1.8f), y(-0.9f, 2.3f), z(-9.5f, -2.5f), radius(0.06f, 0.2f);
+    for (int i = 0; i < 400; ++i) {
+        uint32_t mat = i % 10 == 0 ? mirror : materials[size_t(i) % materials.size()];
+        scene.addSphere(glm::vec3(x(rng), y(rng), z(rng)), radius(rng), mat);
+    }
+    scene.commit();
+}
+
+// ---- measurement ----
+
+// every run of one stage
+struct StageResult {
+    std::string label;
+    bool isBuild = false;
+    std::vector<PassStats> runs;
+};
+
+class Bench {
+public:
+    // captureImages keeps the image of every pass in memory (see Image()) instead of writing it
+    Bench(const std::string& scene, const RenderSettings& renderSettings, int dimx, int dimy, bool writeImages,
+          bool captureImages = false)
+        : sceneName(scene), settings(renderSettings), width(dimx), height(dimy), write(writeImages), capture(captureImages) {}
+
+    // one run of a scene: a fresh description and renderer, stages are appended in order
+    void begin() {
+        desc = SceneDescription();
+        desc.width = width;
+        desc.height = height;
+        renderer.reset(new Renderer(width, height, desc.camera, settings));
+        stage = 0;
+    };
+
+    void build(const std::string& label, const std::function<void(Scene&)>& fn) {
+        auto start = Clock::now();
+        fn(desc.scene);
+        PassStats s;
+        s.label = label;
+        s.wallMs = msSince(start);
+        record(s, true);
+    };
+
+    // build steps that need the whole description (lights)
+    void buildDescription(const std::string& label, const std::function<void(SceneDescription&)>& fn) {
+        auto start = Clock::now();
+        fn(desc);
+        PassStats s;
+        s.label = label;
+        s.wallMs = msSince(start);
+        record(s, true);
+    };
+
+    void rayDirections() { record(renderer->rayDirections("ray_directions", sink("ray_directions").get()), false); };
+
+    void pass(const std::string& label, ShadeMode mode) {
+        record(renderer->render(desc, mode, label, sink(label).get()), false);
+    };
+
+    // an interactive session on the description: a full first frame, then a frame per move of the
+    // sphere, each rendering only the pixels the move can have changed
+    void session(ShadeMode mode, uint32_t sphere, const std::vector<glm::vec3>& centers, float radius) {
+        RenderSession session(desc, mode, settings);
+        record(session.render("session_first", sink("session_first").get()), false);
+        for (size_t f = 0; f < centers.size(); ++f) {
+            std::string label = "session_move" + std::to_string(f + 1);
+            session.moveSphere(sphere, centers[f], radius);
+            record(session.render(label, sink(label).get()), false);
+        }
+    };
+
+    const std::vector<StageResult>& Results() const { return results; };
+    // last image of a pass, with captureImages
+    const std::vector<glm::u8vec3>& Image(const std::string& label) { return images[label]; };
+
+private:
+    std::unique_ptr<ImageSink> sink(const std::string& label) {
+        if (capture) {
+            std::vector<glm::u8vec3>& image = images[label];
+            image.assign(size_t(width) * height, glm::u8vec3(0, 0, 0));
+            return std::unique_ptr<ImageSink>(new BufferSink(reinterpret_cast<uint8_t*>(image.data()), size_t(width) * 3,
+                                                             Tile{0, 0, 0, width, height}));
+        }
+        if (!write) return nullptr;
+        return makeImageSink("ppm", "bench_" + sceneName + "_" + label);
+    };
+
+    void record(const PassStats& s, bool isBuild) {
+        if (stage == results.size()) {
+            results.push_back(StageResult());
+            results.back().label = s.label;
+            results.back().isBuild = isBuild;
+        }
+        results[stage++].runs.push_back(s);
+    };
+
+    std::string sceneName;
+    RenderSettings settings;
+    int width;
+    int height;
+    bool write;
+    bool capture;
+    std::map<std::string, std::vector<glm::u8vec3>> images;
+    SceneDescription desc;
+    std::unique_ptr<Renderer> renderer;
+    std::vector<StageResult> results;
+    size_t stage = 0;
+};
+
+struct BenchScene {
+    std::string name;
+    std::function<void(Bench&)> run;
+};
+
+std::vector<BenchScene> canonicalScenes() {
+    return {
+        {"assignment", [](Bench& b) {
+            b.rayDirections();
+            b.build("build_spheres", addAssignmentSpheres);
+            b.pass("part2_spheres", ShadeMode::Flat);
+            b.pass("part3_shading", ShadeMode::Phong);
+            b.pass("part4_shadows", ShadeMode::Shadows);
+            b.build("build_planes", addAssignmentPlanes);
+            b.pass("part5_planes", ShadeMode::Shadows);
+            b.pass("part6_reflections", ShadeMode::Reflections);
+        }},
+        {"many-spheres", [](Bench& b) {
+            b.build("build", [](Scene& scene) { manySpheres(scene, 0.1f); });
+            b.pass("shadows", ShadeMode::Shadows);
+            b.pass("reflections", ShadeMode::Reflections);
+        }},
+        {"many-mirrors", [](Bench& b) {
+            b.build("build", [](Scene& scene) { manySpheres(scene, 1.0f); });
+            b.pass("reflections", ShadeMode::Reflections);
+        }},
+        {"mirror-box", [](Bench& b) {
+            b.build("build", mirrorBox);
+            b.pass("reflections", ShadeMode::Reflections);
+        }},
+        {"many-lights", [](Bench& b) {
+            b.buildDescription("build", manyLights);
+            b.pass("shadows", ShadeMode::Shadows);
+            b.pass("reflections", ShadeMode::Reflections);
+        }},
+        {"interactive", [](Bench& b) {
+            b.build("build", [](Scene& scene) {
+                addAssignmentSpheres(scene);
+                addAssignmentPlanes(scene);
+            });
+            b.session(ShadeMode::Reflections, 1, {glm::vec3(0.3f, -0.2f, -4.0f), glm::vec3(-1.2f, 0.8f, -3.5f),
+                                                  glm::vec3(1.0f, 0.0f, -5.5f)}, 0.5f);
+        }},
+        {"mesh", [](Bench& b) {
+            b.build("build", meshScene);
+            b.pass("shadows", ShadeMode::Shadows);
+            b.pass("reflections", ShadeMode::Reflections);
+        }},
+        {"instances", [](Bench& b) {
+            b.build("build", instancedScene);
+            b.pass("shadows", ShadeMode::Shadows);
+            b.pass("reflections", ShadeMode::Reflections);
+        }},
+        {"textures", [](Bench& b) {
+            b.build("build", texturedScene);
+            b.pass("shadows", ShadeMode::Shadows);
+            b.pass("reflections", ShadeMode::Reflections);
+        }},
+    };
+}
+
+// medians of one stage over all runs
+struct StageSummary {
+    double wallMs, traceMs, shadeMs, outputMs;
+    RayCounts rays; // identical in every run
+};
+
+StageSummary summarize(const StageResult& r) {
+    std::vector<double> wall, trace, shade, output;
+    for (const PassStats& s : r.runs) {
+        wall.push_back(s.wallMs);
+        trace.push_back(s.traceMs);
+        shade.push_back(s.shadeMs);
+        output.push_back(s.outputMs);
+    }
+    return {median(wall), median(trace), median(shade), median(output), r.runs.front().rays};
+}
+
+double mraysPerS(uint64_t rays, double ms) { return ms > 0.0 ? double(rays) / ms / 1000.0 : 0.0; }
+
+void printTable(std::ostream& os, const std::string& scene, const std::vector<StageResult>& results, int runs) {
+    os << scene << " (median of " << runs << " runs)" << std::endl;
+    char line[256];
+    std::snprintf(line, sizeof(line), "  %-20s %9s %9s %9s %9s %10s %10s %10s %10s\n", "stage", "wall ms", "trace ms",
+                  "shade ms", "output ms", "prim Mr/s", "shad Mr/s", "refl Mr/s", "all Mr/s");
+    os << line;
+    for (const StageResult& r : results) {
+        StageSummary s = summarize(r);
+        if (r.isBuild) {
+            std::snprintf(line, sizeof(line), "  %-20s %9.2f\n", r.label.c_str(), s.wallMs);
+        } else {
+            std::snprintf(line, sizeof(line), "  %-20s %9.2f %9.2f %9.2f %9.2f %10.2f %10.2f %10.2f %10.2f\n",
+                          r.label.c_str(), s.wallMs, s.traceMs, s.shadeMs, s.outputMs,
+                          mraysPerS(s.rays.primary, s.wallMs), mraysPerS(s.rays.shadow, s.wallMs),
+                          mraysPerS(s.rays.reflection, s.wallMs), mraysPerS(s.rays.total(), s.wallMs));
+        }
+        os << line;
+    }
+}
+
+std::string jsonString(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+void writeJson(std::ostream& os, const RenderSettings& settings, int dimx, int dimy, int runs,
+               const std::vector<std::pair<std::string, std::vector<StageResult>>>& scenes) {
+    os << "{\n";
+    os << "  \"settings\": {\"width\": " << dimx << ", \"height\": " << dimy << ", \"runs\": " << runs
+       << ", \"threads\": " << settings.threadCount << ", \"tile\": " << settings.tileSize
+       << ", \"packet\": " << settings.packetSize << ", \"simd\": " << jsonString(simdName(simdLevel()))
+       << ", \"max_depth\": " << settings.reflection.maxDepth << ", \"samples\": " << settings.samples
+       << ", \"adaptive\": " << settings.adaptiveThreshold << ", \"max_samples\": " << settings.maxSamples
+       << ", \"light_samples\": " << settings.lightSamples << "},\n";
+    os << "  \"scenes\": [\n";
+    for (size_t i = 0; i < scenes.size(); ++i) {
+        os << "    {\"name\": " << jsonString(scenes[i].first) << ", \"stages\": [\n";
+        const std::vector<StageResult>& results = scenes[i].second;
+        for (size_t j = 0; j < results.size(); ++j) {
+            StageSummary s = summarize(results[j]);
+            os << "      {\"label\": " << jsonString(results[j].label) << ", \"kind\": "
+               << (results[j].isBuild ? "\"build\"" : "\"render\"") << ", \"wall_ms\": " << s.wallMs;
+            if (!results[j].isBuild) {
+                os << ", \"trace_ms\": " << s.traceMs << ", \"shade_ms\": " << s.shadeMs
+                   << ", \"output_ms\": " << s.outputMs
+                   << ", \"rays\": {\"primary\": " << s.rays.primary << ", \"shadow\": " << s.rays.shadow
+                   << ", \"reflection\": " << s.rays.reflection << "}"
+                   << ", \"mrays_per_s\": {\"primary\": " << mraysPerS(s.rays.primary, s.wallMs)
+                   << ", \"shadow\": " << mraysPerS(s.rays.shadow, s.wallMs)
+                   << ", \"reflection\": " << mraysPerS(s.rays.reflection, s.wallMs)
+                   << ", \"total\": " << mraysPerS(s.rays.total(), s.wallMs) << "}";
+            }
+            os << "}" << (j + 1 < results.size() ? "," : "") << "\n";
+        }
+        os << "    ]}" << (i + 1 < scenes.size() ? "," : "") << "\n";
+    }
+    os << "  ]\n}\n";
+}
+
+struct CheckSettings {
+    std::string dir;
+    bool update = false;     // write the references instead of checking against them
+    int tolerance = 2;       // per channel
+    double badPixels = 0.0005;
+    double margin = 0.2;     // of the baseline relative throughput
+    bool perf = true;
+};
+
+// machine speed for the performance gate: millions of rays per second through a fixed scalar loop
+// that intersects 64 spheres by brute force, fastest of 3 runs. it shares no code with the
+// renderer, so a change to the renderer does not move it while a faster machine moves both
+double calibrationMraysPerS() {
+    float cx[64], cy[64], cz[64], c[64];
+    for (int i = 0; i < 64; ++i) {
+        cx[i] = float(i % 8) - 3.5f;
+        cy[i] = float(i / 8) - 3.5f;
+        cz[i] = -10.0f - float(i % 5);
+        c[i] = cx[i]*cx[i] + cy[i]*cy[i] + cz[i]*cz[i] - 0.16f;
+    }
+    const int rays = 250000;
+    std::vector<double> times;
+    volatile uint32_t sink = 0;
+    for (int run = 0; run < 3; ++run) {
+        auto start = Clock::now();
+        uint32_t hits = 0;
+        for (int k = 0; k < rays; ++k) {
+            float dx = float(k % 500 - 250) / 400.0f;
+            float dy = float(k / 500 - 250) / 400.0f;
+            float inv = 1.0f / std::sqrt(dx*dx + dy*dy + 1.0f);
+            dx *= inv;
+            dy *= inv;
+            float dz = -inv;
+            float closest = FLT_MAX;
+            for (int i = 0; i < 64; ++i) {
+                float b = dx*cx[i] + dy*cy[i] + dz*cz[i];
+                float disc = b*b - c[i];
+                if (disc < 0.0f) continue;
+                float t = b - std::sqrt(disc);
+                if (t > 0.0f && t < closest) closest = t;
+            }
+            hits += closest < FLT_MAX ? 1 : 0;
+        }
+        times.push_back(msSince(start));
+        sink = sink + hits;
+    }
+    return mraysPerS(rays, *std::min_element(times.begin(), times.end()));
+}
+
+// the reference file of a stage of the assignment scene, named like the output of Raytracer_bin
+std::string goldenName(const std::string& label) {
+    return label == "ray_directions" ? "part1_clamped" : label;
+}
+
+// "<label> <Mrays/s>" per line, '#' starts a comment
+std::map<std::string, double> readBaseline(const std::string& path) {
+    std::map<std::string, double> baseline;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t hash = line.find('#');
+        if (hash != std::string::npos) line.erase(hash);
+        std::istringstream ls(line);
+        std::string label;
+        double value;
+        if (ls >> label >> value) baseline[label] = value;
+    }
+    return baseline;
+}
+
+// golden image and performance gate over the assignment scene, see the top of the file; returns
+// the exit status
+int runCheck(RenderSettings settings, int dimx, int dimy, int runs, bool write, const CheckSettings& check) {
+    // one thread: a throughput relative to one core compares across machines
+    settings.threadCount = 1;
+    BenchScene scene = canonicalScenes().front();
+    Bench bench(scene.name, settings, dimx, dimy, false, true);
+    // the calibration runs between the renders, so both see the same state of the machine
+    double calibration = 0.0;
+    for (int r = 0; r < runs; ++r) {
+        if (check.perf || check.update) calibration = std::max(calibration, calibrationMraysPerS());
+        bench.begin();
+        scene.run(bench);
+    }
+    printTable(std::cout, scene.name, bench.Results(), runs);
+
+    // rays per second of every pass and over all of them, relative to the calibration loop. both
+    // take the fastest run, which is the one least disturbed by the rest of the machine
+    std::vector<std::pair<std::string, double>> throughput;
+    uint64_t rays = 0;
+    double ms = 0.0;
+    for (const StageResult& r : bench.Results()) {
+        if (r.isBuild || r.runs.front().rays.total() == 0) continue;
+        double fastest = r.runs.front().wallMs;
+        for (const PassStats& s : r.runs) fastest = std::min(fastest, s.wallMs);
+        throughput.push_back({r.label, mraysPerS(r.runs.front().rays.total(), fastest) / calibration});
+        rays += r.runs.front().rays.total();
+        ms += fastest;
+    }
+    throughput.push_back({"total", mraysPerS(rays, ms) / calibration});
+
+    std::string baselinePath = (std::filesystem::path(check.dir) / "baseline.txt").string();
+    if (check.update) {
+        std::filesystem::create_directories(check.dir);
+        bool ok = true;
+        for (const StageResult& r : bench.Results()) {
+            if (r.isBuild) continue;
+            std::string base = (std::filesystem::path(check.dir) / goldenName(r.label)).string();
+            ok = writeP6PPM(unsigned(dimx), unsigned(dimy), bench.Image(r.label), base) && ok;
+        }
+        std::ofstream ofs(baselinePath);
+        ofs << "# Raytracer_bench --check baseline: all rays per second of every pass on one thread, fastest of "
+            << runs << " runs at " << dimx << "x" << dimy << ", " << simdName(simdLevel()) << ",\n"
+            << "# divided by the rays per second of the calibration loop (" << calibration << " Mrays/s here)\n";
+        for (const auto& t : throughput) ofs << t.first << " " << t.second << "\n";
+        if (!ok || ofs.fail()) {
+            std::cerr << "cannot write the references to " << check.dir << std::endl;
+            return 1;
+        }
+        std::cout << "references written to " << check.dir << std::endl;
+        return 0;
+    }
+
+    bool ok = true;
+    for (const StageResult& r : bench.Results()) {
+        if (r.isBuild) continue;
+        std::string name = goldenName(r.label);
+        unsigned w = 0, h = 0;
+        std::vector<glm::u8vec3> golden;
+        if (!readP6PPM((std::filesystem::path(check.dir) / (name + ".ppm")).string(), w, h, golden) ||
+            int(w) != dimx || int(h) != dimy) {
+            std::cout << "  " << name << ": no " << dimx << "x" << dimy << " reference in " << check.dir << ", FAILED" << std::endl;
+            ok = false;
+            continue;
+        }
+        const std::vector<glm::u8vec3>& image = bench.Image(r.label);
+        std::vector<glm::u8vec3> diff(image.size());
+        int maxDiff = 0;
+        size_t off = 0;
+        for (size_t i = 0; i < image.size(); ++i) {
+            int d = 0;
+            for (int c = 0; c < 3; ++c) d = std::max(d, std::abs(int(image[i][c]) - int(golden[i][c])));
+            maxDiff = std::max(maxDiff, d);
+            if (d > check.tolerance) off++;
+            diff[i] = glm::u8vec3(uint8_t(std::min(255, d * 16)));
+        }
+        bool passed = double(off) <= check.badPixels * double(image.size());
+        std::cout << "  " << name << ": largest difference " << maxDiff << ", " << off << " pixels off by more than "
+                  << check.tolerance << (passed ? ", ok" : ", FAILED") << std::endl;
+        if (!passed && write) writeP6PPM(unsigned(dimx), unsigned(dimy), diff, "check_" + name + "_diff");
+        ok = ok && passed;
+    }
+
+    std::map<std::string, double> baseline = readBaseline(baselinePath);
+    if (!check.perf) {
+        std::cout << "  performance not checked (--no-perf)" << std::endl;
+    } else if (baseline.count("total") == 0) {
+        std::cout << "  no baseline in " << baselinePath << " (write one with --update-golden), FAILED" << std::endl;
+        ok = false;
+    } else {
+        std::cout << "  calibration loop: " << calibration << " Mrays/s" << std::endl;
+        for (const auto& t : throughput) {
+            auto b = baseline.find(t.first);
+            if (b == baseline.end() || b->second <= 0.0) continue;
+            double ratio = t.second / b->second;
+            bool isTotal = t.first == "total";
+            bool passed = !isTotal || ratio >= 1.0 - check.margin;
+            char line[160];
+            std::snprintf(line, sizeof(line), "  %s: %.3f of the calibration, %.0f%% of the baseline %.3f%s", t.first.c_str(),
+                          t.second, 100.0 * ratio, b->second, isTotal ? (passed ? ", ok" : ", FAILED") : "");
+            std::cout << line << std::endl;
+            ok = ok && passed;
+        }
+    }
+    std::cout << (ok ? "check passed" : "check FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    RenderSettings settings;
+    int runs = 5;
+    int dimx = 800;
+    int dimy = 600;
+    bool write = false;
+    std::string jsonPath;
+    std::vector<std::string> selected;
+    CheckSettings check;
+    for (int a = 1; a < argc; ++a) {
+        std::string arg = argv[a];
+        if (arg == "--runs" && a + 1 < argc) runs = std::max(1, std::atoi(argv[++a]));
+        else if (arg == "--threads" && a + 1 < argc) settings.threadCount = std::atoi(argv[++a]);
+        else if (arg == "--tile" && a + 1 < argc) settings.tileSize = std::atoi(argv[++a]);
+        else if (arg == "--packet" && a + 1 < argc) settings.packetSize = glm::clamp(std::atoi(argv[++a]), 1, MaxPacketSize);
+        else if (arg == "--simd" && a + 1 < argc) {
+            std::string name = argv[++a];
+            SimdLevel level = name == "avx2" ? SimdLevel::AVX2 : (name == "sse" ? SimdLevel::SSE : SimdLevel::Scalar);
+            if (level < simdLevel()) simdLevel() = level;
+        }
+        else if (arg == "--light-samples" && a + 1 < argc) settings.lightSamples = glm::clamp(std::atoi(argv[++a]), 1, MaxLightSamples);
+        else if (arg == "--no-wavefront") settings.wavefront = false;
+        else if (arg == "--samples" && a + 1 < argc) settings.samples = std::max(1, std::atoi(argv[++a]));
+        else if (arg == "--adaptive" && a + 1 < argc) settings.adaptiveThreshold = float(std::atof(argv[++a]));
+        else if (arg == "--max-samples" && a + 1 < argc) settings.maxSamples = std::max(1, std::atoi(argv[++a]));
+        else if (arg == "--size" && a + 1 < argc && std::sscanf(argv[++a], "%dx%d", &dimx, &dimy) == 2 && dimx > 1 && dimy > 1) continue;
+        else if (arg == "--write") write = true;
+        else if (arg == "--json" && a + 1 < argc) jsonPath = argv[++a];
+        else if (arg == "--check" && a + 1 < argc) check.dir = argv[++a];
+        else if (arg == "--update-golden" && a + 1 < argc) {
+            check.dir = argv[++a];
+            check.update = true;
+        }
+        else if (arg == "--tolerance" && a + 1 < argc) check.tolerance = std::max(0, std::atoi(argv[++a]));
+        else if (arg == "--bad-pixels" && a + 1 < argc) check.badPixels = std::max(0.0, std::atof(argv[++a]));
+        else if (arg == "--margin" && a + 1 < argc) check.margin = std::atof(argv[++a]);
+        else if (arg == "--no-perf") check.perf = false;
+        else if (arg == "--scenes" && a + 1 < argc) {
+            std::stringstream list(argv[++a]);
+            std::string name;
+            while (std::getline(list, name, ',')) selected.push_back(name);
+        }
+        else {
+            std::cerr << "usage: " << argv[0] << " [--runs N] [--scenes a,b,...] [--threads N] [--tile N] [--packet N]"
+                      << " [--simd scalar|sse|avx2] [--size WxH] [--samples N] [--adaptive X] [--max-samples N]"
+                      << " [--light-samples N] [--no-wavefront] [--write] [--json FILE]"
+                      << " [--check DIR | --update-golden DIR] [--tolerance N] [--bad-pixels X] [--margin X] [--no-perf]"
+                      << std::endl;
+            return 1;
+        }
+    }
+    if (!check.dir.empty()) return runCheck(settings, dimx, dimy, runs, write, check);
+
+    std::vector<std::pair<std::string, std::vector<StageResult>>> all;
+    for (const BenchScene& scene : canonicalScenes()) {
+        if (!selected.empty() && std::find(selected.begin(), selected.end(), scene.name) == selected.end()) continue;
+        Bench bench(scene.name, settings, dimx, dimy, write);
+        for (int r = 0; r < runs; ++r) {
+            bench.begin();
+            scene.run(bench);
+        }
+        printTable(std::cout, scene.name, bench.Results(), runs);
+        all.push_back({scene.name, bench.Results()});
+    }
+    if (all.empty()) {
+        std::cerr << "no scene selected" << std::endl;
+        return 1;
+    }
+
+    if (!jsonPath.empty()) {
+        if (jsonPath == "-") {
+            writeJson(std::cout, settings, dimx, dimy, runs, all);
+        } else {
+            std::ofstream ofs(jsonPath);
+            writeJson(ofs, settings, dimx, dimy, runs, all);
+            if (ofs.fail()) {
+                std::cerr << "cannot write " << jsonPath << std::endl;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef AABB_H_
+#define AABB_H_
+
+#include <glm/glm.hpp>
+#include <glm/vec3.hpp>
+#include <cfloat>
+#include <utility>
+
+// axis-aligned bounding box, empty (inverted) by default
+struct AABB {
+    glm::vec3 bmin = glm::vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+    glm::vec3 bmax = glm::vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+    AABB() {}
+    AABB(const glm::vec3& lo, const glm::vec3& hi) : bmin(lo), bmax(hi) {}
+
+    void grow(const glm::vec3& p) {
+        bmin = glm::min(bmin, p);
+        bmax = glm::max(bmax, p);
+    };
+    void grow(const AABB& b) {
+        bmin = glm::min(bmin, b.bmin);
+        bmax = glm::max(bmax, b.bmax);
+    };
+
+    bool empty() const { return bmin.x > bmax.x; };
+    bool overlaps(const AABB& b) const {
+        return bmin.x <= b.bmax.x && b.bmin.x <= bmax.x && bmin.y <= b.bmax.y && b.bmin.y <= bmax.y &&
+               bmin.z <= b.bmax.z && b.bmin.z <= bmax.z;
+    };
+    // does the segment origin + t*dir, tMin <= t <= tMax, pass through the box
+    bool intersects(const glm::vec3& origin, const glm::vec3& dir, float tMin, float tMax) const {
+        for (int a = 0; a < 3; ++a) {
+            if (dir[a] == 0.0f) {
+                if (origin[a] < bmin[a] || origin[a] > bmax[a]) return false;
+                continue;
+            }
+            float t0 = (bmin[a] - origin[a]) / dir[a];
+            float t1 = (bmax[a] - origin[a]) / dir[a];
+            if (t0 > t1) std::swap(t0, t1);
+            tMin = glm::max(tMin, t0);
+            tMax = glm::min(tMax, t1);
+            if (tMin > tMax) return false;
+        }
+        return true;
+    };
+    glm::vec3 centroid() const { return (bmin + bmax) * 0.5f; };
+
+    // half surface area, which is all the SAH needs
+    float area() const {
+        if (empty()) return 0.0f;
+        glm::vec3 d = bmax - bmin;
+        return d.x * d.y + d.y * d.z + d.z * d.x;
+    };
+};
+
+#endif
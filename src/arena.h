@@ -0,0 +1,112 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// bump allocator for short-lived scratch memory (ray and hit rows, sample buffers of a tile).
+// allocations are carved out of large blocks and never freed one by one: a Scope rewinds the arena
+// to where it was when the scope began, reset() rewinds it completely. the blocks are kept, so once
+// the arena has grown to the largest tile it is asked for, rendering allocates nothing from the heap.
+// if a run needed more than one block, reset() merges them into a single block of the total size.
+class ScratchArena {
+public:
+    explicit ScratchArena(size_t blockBytes = size_t(1) << 18) : blockSize(blockBytes) {}
+    ScratchArena(ScratchArena&&) = default;
+    ScratchArena& operator=(ScratchArena&&) = default;
+    ScratchArena(const ScratchArena&) = delete;
+    ScratchArena& operator=(const ScratchArena&) = delete;
+
+    // count default-initialized elements, valid until the arena is rewound past them
+    template<typename T>
+    T* alloc(size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value, "arena memory is released without running destructors");
+        T* p = static_cast<T*>(allocBytes(count * sizeof(T), alignof(T)));
+        for (size_t i = 0; i < count; ++i) new (p + i) T;
+        return p;
+    };
+
+    // restores the arena to its state at construction when it goes out of scope
+    class Scope {
+    public:
+        explicit Scope(ScratchArena& a) : arena(a), block(a.current), offset(a.offset) {}
+        ~Scope() {
+            arena.current = block;
+            arena.offset = offset;
+        }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        ScratchArena& arena;
+        size_t block;
+        size_t offset;
+    };
+
+    void reset() {
+        if (blocks.size() > 1) {
+            size_t total = 0;
+            for (const Block& b : blocks) total += b.size;
+            blocks.clear();
+            addBlock(total);
+        }
+        current = 0;
+        offset = 0;
+    };
+
+    // bytes reserved from the heap
+    size_t Capacity() const {
+        size_t total = 0;
+        for (const Block& b : blocks) total += b.size;
+        return total;
+    };
+
+private:
+    struct Block {
+        std::unique_ptr<uint8_t[]> storage;
+        uint8_t* data; // storage aligned to MaxAlign
+        size_t size;
+    };
+
+    // blocks are aligned to this; larger alignments are not supported
+    static const size_t MaxAlign = 64;
+
+    void* allocBytes(size_t bytes, size_t align) {
+        while (true) {
+            if (current < blocks.size()) {
+                size_t start = (offset + align - 1) & ~(align - 1);
+                if (start + bytes <= blocks[current].size) {
+                    offset = start + bytes;
+                    return blocks[current].data + start;
+                }
+                // the rest of this block is skipped; move on to the next one that fits
+                current++;
+                offset = 0;
+                continue;
+            }
+            addBlock(std::max(blockSize, bytes));
+        }
+    };
+
+    void addBlock(size_t bytes) {
+        bytes = (bytes + MaxAlign - 1) & ~(MaxAlign - 1);
+        Block b;
+        b.storage.reset(new uint8_t[bytes + MaxAlign]);
+        uintptr_t address = reinterpret_cast<uintptr_t>(b.storage.get());
+        b.data = b.storage.get() + ((MaxAlign - address % MaxAlign) % MaxAlign);
+        b.size = bytes;
+        blocks.push_back(std::move(b));
+    };
+
+    size_t blockSize;
+    std::vector<Block> blocks;
+    size_t current = 0; // block allocations are taken from
+    size_t offset = 0;  // first free byte in the current block
+};
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef ARRAY_H_
+#define ARRAY_H_
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// contiguous array that either owns its elements or is a read-only view of external memory, e.g. a
+// memory-mapped scene cache (keepAlive holds the mapping). the first modification of a view copies
+// the elements into owned storage.
+template<typename T>
+class Array {
+public:
+    typedef T value_type;
+
+    Array() {}
+    Array(const Array& other) { *this = other; }
+    Array& operator=(const Array& other) {
+        if (this == &other) return *this;
+        owned = other.owned;
+        keepAlive = other.keepAlive;
+        external = other.external;
+        ptr = external ? other.ptr : owned.data();
+        n = other.n;
+        return *this;
+    };
+    Array(Array&& other) noexcept { *this = std::move(other); }
+    Array& operator=(Array&& other) noexcept {
+        owned = std::move(other.owned);
+        keepAlive = std::move(other.keepAlive);
+        external = other.external;
+        ptr = external ? other.ptr : owned.data();
+        n = other.n;
+        other.reset();
+        return *this;
+    };
+
+    void view(const T* data, size_t count, std::shared_ptr<const void> owner) {
+        owned.clear();
+        owned.shrink_to_fit();
+        keepAlive = std::move(owner);
+        external = true;
+        ptr = data;
+        n = count;
+    };
+    void assign(std::vector<T>&& v) {
+        reset();
+        owned = std::move(v);
+        sync();
+    };
+
+    void push_back(const T& v) {
+        detach();
+        owned.push_back(v);
+        sync();
+    };
+    void set(size_t i, const T& v) {
+        detach();
+        owned[i] = v;
+    };
+    void reserve(size_t count) {
+        detach();
+        owned.reserve(count);
+        sync();
+    };
+    void clear() { reset(); };
+
+    size_t size() const { return n; };
+    bool empty() const { return n == 0; };
+    bool isView() const { return external; };
+    const T* data() const { return ptr; };
+    const T& operator[](size_t i) const { return ptr[i]; };
+    const T* begin() const { return ptr; };
+    const T* end() const { return ptr + n; };
+
+private:
+    void detach() {
+        if (!external) return;
+        std::vector<T> copy(ptr, ptr + n);
+        reset();
+        owned = std::move(copy);
+        sync();
+    };
+    void reset() {
+        owned.clear();
+        keepAlive.reset();
+        external = false;
+        ptr = nullptr;
+        n = 0;
+    };
+    void sync() {
+        ptr = owned.data();
+        n = owned.size();
+    };
+
+    std::vector<T> owned;
+    std::shared_ptr<const void> keepAlive;
+    bool external = false;
+    const T* ptr = nullptr;
+    size_t n = 0;
+};
+
+#endif
@@ -0,0 +1,432 @@
+#ifndef BVH_H_
+#define BVH_H_
+
+#include <glm/glm.hpp>
+#include <glm/vec3.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "aabb.h"
+#include "array.h"
+#include "packet.h"
+#include "stats.h"
+
+// bounding volume hierarchy over primitive ids, built with the binned surface area heuristic and
+// flattened into a depth-first node array: the left child of an inner node directly follows it,
+// so only the right child index has to be stored.
+// the tree knows nothing about the primitives themselves: traversal hands the ids stored in the
+// leaves that a ray reaches to a callback, which intersects them and shrinks the ray's tMax.
+// a BVH can also hold a forest of independent trees in the same arrays (one per instanced
+// prototype), traversed from the root of one of them.
+class BVH {
+public:
+    BVH() {}
+
+    // boxes[i] bounds the primitive ids[i]
+    void build(const std::vector<AABB>& boxes, const std::vector<uint32_t>& ids) {
+        build(boxes, ids, std::vector<uint32_t>(1, uint32_t(boxes.size())));
+    };
+
+    // a forest: tree g holds the primitives from groupEnds[g - 1] (0 for the first) to groupEnds[g],
+    // its root is Root(g). empty groups get no tree
+    void build(const std::vector<AABB>& boxes, const std::vector<uint32_t>& ids, const std::vector<uint32_t>& groupEnds) {
+        nodes.clear();
+        prims.clear();
+        roots.clear();
+
+        std::vector<BuildPrim> build(boxes.size());
+        for (size_t i = 0; i < boxes.size(); ++i) {
+            build[i].box = boxes[i];
+            build[i].centroid = boxes[i].centroid();
+            build[i].id = ids[i];
+        }
+
+        std::vector<Node> tree;
+        tree.reserve(2 * build.size());
+        std::vector<uint32_t> rootNodes;
+        size_t begin = 0;
+        for (uint32_t end : groupEnds) {
+            rootNodes.push_back(end > begin ? buildNode(tree, build, begin, end, 0) : NoTree);
+            begin = end;
+        }
+        nodes.assign(std::move(tree));
+        roots.assign(std::move(rootNodes));
+
+        std::vector<uint32_t> order(build.size());
+        for (size_t i = 0; i < build.size(); ++i) order[i] = build[i].id;
+        prims.assign(std::move(order));
+        slots.clear();
+        if (groupEnds.size() == 1) indexSlots();
+    };
+
+    // the flat node, primitive and root arrays, in a fixed order (used by the scene cache)
+    template<typename Visitor>
+    void visitArrays(Visitor&& visit) {
+        visit(nodes);
+        visit(prims);
+        visit(roots);
+    };
+
+    // the arrays form trees count trees can traverse safely (they may come from a corrupt scene
+    // cache): every subtree is a contiguous node range, no leaf is deeper than MaxDepth, leaves
+    // stay inside the primitive array and validPrim(id) holds for every id in it
+    template<typename ValidPrim>
+    bool valid(size_t count, ValidPrim&& validPrim) const {
+        if (roots.size() != count) return false;
+        for (uint32_t id : prims) {
+            if (!validPrim(id)) return false;
+        }
+        // the trees follow each other in the node array, in the order of their roots
+        std::vector<uint32_t> starts;
+        for (uint32_t root : roots) {
+            if (root != NoTree) starts.push_back(root);
+        }
+        if (starts.empty() ? !nodes.empty() : starts[0] != 0) return false;
+        struct Range {
+            uint32_t index, end;
+            int depth;
+        };
+        std::vector<Range> pending;
+        for (size_t t = 0; t < starts.size(); ++t) {
+            uint32_t end = t + 1 < starts.size() ? starts[t + 1] : uint32_t(nodes.size());
+            if (starts[t] >= end || end > nodes.size()) return false;
+            pending.push_back({starts[t], end, 0});
+        }
+        while (!pending.empty()) {
+            Range r = pending.back();
+            pending.pop_back();
+            const Node& node = nodes[r.index];
+            if (r.depth > MaxDepth) return false;
+            if (node.count > 0) {
+                if (r.end != r.index + 1 || uint64_t(node.leftOrFirst) + node.count > prims.size()) return false;
+                continue;
+            }
+            uint32_t right = node.leftOrFirst;
+            if (right <= r.index + 1 || right >= r.end || node.axis > 2) return false;
+            pending.push_back({r.index + 1, right, r.depth + 1});
+            pending.push_back({right, r.end, r.depth + 1});
+        }
+        return true;
+    };
+
+    bool empty() const { return nodes.empty(); };
+    size_t NodeCount() const { return nodes.size(); };
+    // root node of tree g of a forest, NoTree for an empty group; a single tree has its root at 0
+    uint32_t Root(uint32_t g) const { return roots[g]; };
+
+    static const uint32_t NoTree = 0xffffffffu;
+
+    // closest hit: visits every primitive whose leaf box overlaps [tMin, tMax]; hitPrim(id) intersects
+    // the primitive and lowers tMax on a closer hit, which culls the remaining nodes
+    template<typename HitPrim>
+    void closest(const glm::vec3& origin, const glm::vec3& dir, float tMin, const float& tMax, HitPrim&& hitPrim,
+                 uint32_t root = 0) const {
+        if (nodes.empty() || root == NoTree) return;
+        glm::vec3 invDir = 1.0f / dir;
+        uint32_t stack[StackSize];
+        int sp = 0;
+        stack[sp++] = root;
+        uint64_t visited = 0;
+        while (sp > 0) {
+            const Node& node = nodes[stack[--sp]];
+            visited++;
+            if (!hitBox(node, origin, invDir, tMin, tMax)) continue;
+            if (node.count > 0) {
+                for (uint32_t i = node.leftOrFirst; i < node.leftOrFirst + node.count; ++i) hitPrim(prims[i]);
+            } else {
+                // push the far child first so the near one is visited first and shrinks tMax early
+                uint32_t nearChild = uint32_t(&node - nodes.data()) + 1;
+                uint32_t farChild = node.leftOrFirst;
+                if (dir[node.axis] < 0.0f) std::swap(nearChild, farChild);
+                stack[sp++] = farChild;
+                stack[sp++] = nearChild;
+            }
+        }
+        profileCount(&ProfileCounts::nodeVisits, visited);
+    };
+
+    // packet version: a node is entered if any lane overlaps its box, the first lane decides the child order
+    template<typename HitPrim>
+    void closest(const RayPacket& packet, float tMin, const float* tMax, HitPrim&& hitPrim) const {
+        if (nodes.empty()) return;
+        glm::vec3 invDir[MaxPacketSize];
+        for (int l = 0; l < packet.size; ++l) invDir[l] = 1.0f / packet.direction(l);
+        auto hitAny = [&](const Node& node) {
+            for (int l = 0; l < packet.size; ++l) {
+                if (hitBox(node, packet.origin(l), invDir[l], tMin, tMax[l])) return true;
+            }
+            return false;
+        };
+
+        uint32_t stack[StackSize];
+        int sp = 0;
+        stack[sp++] = 0;
+        uint64_t visited = 0;
+        while (sp > 0) {
+            const Node& node = nodes[stack[--sp]];
+            visited++;
+            if (!hitAny(node)) continue;
+            if (node.count > 0) {
+                for (uint32_t i = node.leftOrFirst; i < node.leftOrFirst + node.count; ++i) hitPrim(prims[i]);
+            } else {
+                uint32_t nearChild = uint32_t(&node - nodes.data()) + 1;
+                uint32_t farChild = node.leftOrFirst;
+                if (packet.direction(0)[node.axis] < 0.0f) std::swap(nearChild, farChild);
+                stack[sp++] = farChild;
+                stack[sp++] = nearChild;
+            }
+        }
+        profileCount(&ProfileCounts::nodeVisits, visited);
+    };
+
+    // any hit: stops as soon as occludes(id) reports a hit inside [0, tMax]
+    template<typename Occludes>
+    bool any(const glm::vec3& origin, const glm::vec3& dir, float tMax, Occludes&& occludes, uint32_t root = 0) const {
+        if (nodes.empty() || root == NoTree) return false;
+        glm::vec3 invDir = 1.0f / dir;
+        uint32_t stack[StackSize];
+        int sp = 0;
+        stack[sp++] = root;
+        uint64_t visited = 0;
+        while (sp > 0) {
+            const Node& node = nodes[stack[--sp]];
+            visited++;
+            if (!hitBox(node, origin, invDir, 0.0f, tMax)) continue;
+            if (node.count > 0) {
+                for (uint32_t i = node.leftOrFirst; i < node.leftOrFirst + node.count; ++i) {
+                    if (occludes(prims[i])) {
+                        profileCount(&ProfileCounts::nodeVisits, visited);
+                        return true;
+                    }
+                }
+            } else {
+                stack[sp++] = node.leftOrFirst;
+                stack[sp++] = uint32_t(&node - nodes.data()) + 1;
+            }
+        }
+        profileCount(&ProfileCounts::nodeVisits, visited);
+        return false;
+    };
+
+    // the primitive id has changed its bounds: recompute the boxes of its leaf and of the inner nodes
+    // above it, bounds(id) giving the box of any primitive. the topology is kept, so a tree refitted
+    // after large moves traverses slower than a rebuilt one. returns false if id is not in the tree
+    // (single trees only). the leaf is found in O(depth)
+    template<typename PrimBounds>
+    bool refit(uint32_t id, PrimBounds&& bounds) {
+        // a tree mapped from the scene cache comes without the index
+        if (slots.size() != prims.size()) indexSlots();
+        auto found = slots.find(id);
+        if (found == slots.end()) return false;
+        uint32_t slot = found->second;
+
+        // the subtree of a node covers a contiguous range of prims, left before right, so the path
+        // from the root to the leaf holding slot is found by following the child whose range has it
+        uint32_t path[StackSize];
+        int depth = 0;
+        uint32_t index = 0;
+        while (nodes[index].count == 0) {
+            path[depth++] = index;
+            uint32_t right = nodes[index].leftOrFirst;
+            index = slot < firstPrim(right) ? index + 1 : right;
+        }
+
+        Node leaf = nodes[index];
+        AABB box;
+        for (uint32_t i = leaf.leftOrFirst; i < leaf.leftOrFirst + leaf.count; ++i) box.grow(bounds(prims[i]));
+        setBox(index, box);
+        while (depth > 0) {
+            uint32_t parent = path[--depth];
+            const Node& left = nodes[parent + 1];
+            const Node& right = nodes[nodes[parent].leftOrFirst];
+            setBox(parent, AABB(glm::min(left.bmin, right.bmin), glm::max(left.bmax, right.bmax)));
+        }
+        return true;
+    };
+
+private:
+    // 32 bytes, two nodes per cache line
+    struct Node {
+        glm::vec3 bmin;
+        uint32_t leftOrFirst; // inner node: index of the right child, leaf: first primitive
+        glm::vec3 bmax;
+        uint16_t count;       // number of primitives, 0 for inner nodes
+        uint16_t axis;        // split axis of inner nodes, used for front-to-back traversal
+    };
+
+    struct BuildPrim {
+        AABB box;
+        glm::vec3 centroid;
+        uint32_t id;
+    };
+
+    static const int StackSize = 64;
+    // deepest level of a leaf: traversal holds at most one node per level plus one on its stack
+    static const int MaxDepth = StackSize - 1;
+    static const int BinCount = 16;
+    static const size_t MaxLeafSize = 4;
+    // bound on the relative error of three rounded float operations
+    static constexpr float Gamma3 = 3.0f * 0.5f * FLT_EPSILON / (1.0f - 3.0f * 0.5f * FLT_EPSILON);
+
+    static bool hitBox(const Node& node, const glm::vec3& origin, const glm::vec3& invDir, float tMin, float tMax) {
+        glm::vec3 t0 = (node.bmin - origin) * invDir;
+        glm::vec3 t1 = (node.bmax - origin) * invDir;
+        glm::vec3 tNear = glm::min(t0, t1);
+        // the far distances are scaled up by the bound on their rounding error (Ize 2013), so rays
+        // that graze a box, e.g. exactly through a mesh vertex on its boundary, are not culled
+        glm::vec3 tFar = glm::max(t0, t1) * (1.0f + 2.0f * Gamma3);
+        // 0 * inf gives NaN for a ray lying in a slab plane; glm::min/max return their first argument
+        // when the second is NaN, so such an axis does not restrict the interval
+        float enter = glm::max(glm::max(glm::max(tMin, tNear.x), tNear.y), tNear.z);
+        float exit = glm::min(glm::min(glm::min(tMax, tFar.x), tFar.y), tFar.z);
+        return enter <= exit;
+    };
+
+    // most primitives a subtree with levels below its root can hold, with median splits down to full leaves
+    static size_t capacity(int levels) { return levels >= 32 ? SIZE_MAX : size_t(0xffff) << levels; };
+
+    // fills slots from prims
+    void indexSlots() {
+        slots.clear();
+        slots.reserve(prims.size());
+        for (uint32_t i = 0; i < prims.size(); ++i) slots.emplace(prims[i], i);
+    };
+
+    // the subtree of build[begin, end) at depth; its count fits capacity(MaxDepth - depth)
+    static uint32_t buildNode(std::vector<Node>& nodes, std::vector<BuildPrim>& build, size_t begin, size_t end, int depth) {
+        assert(depth <= MaxDepth && end - begin <= capacity(MaxDepth - depth));
+        uint32_t index = uint32_t(nodes.size());
+        nodes.push_back(Node());
+
+        AABB box;
+        AABB centroidBox;
+        for (size_t i = begin; i < end; ++i) {
+            box.grow(build[i].box);
+            centroidBox.grow(build[i].centroid);
+        }
+        nodes[index].bmin = box.bmin;
+        nodes[index].bmax = box.bmax;
+
+        size_t count = end - begin;
+        int axis = -1;
+        int split = 0;
+        float splitCost = FLT_MAX;
+        if (count > 1) findSplit(build, begin, end, centroidBox, axis, split, splitCost);
+
+        // SAH: traversal step costs about one intersection test
+        float leafCost = float(count) * box.area();
+        bool makeLeaf = axis < 0 || (count <= MaxLeafSize && box.area() + splitCost >= leafCost);
+        size_t mid = begin;
+        if (!makeLeaf) {
+            float lo = centroidBox.bmin[axis];
+            float scale = BinCount / (centroidBox.bmax[axis] - lo);
+            auto it = std::partition(build.begin() + begin, build.begin() + end, [&](const BuildPrim& p) {
+                return binIndex(p.centroid[axis], lo, scale) < split;
+            });
+            mid = size_t(it - build.begin());
+            makeLeaf = mid == begin || mid == end;
+        }
+        if (makeLeaf && count > 0xffff) {
+            // degenerate distribution (all centroids equal): fall back to an object median split
+            mid = begin + count / 2;
+            axis = 0;
+            makeLeaf = false;
+        }
+        if (depth == MaxDepth) {
+            makeLeaf = true;
+        } else if (!makeLeaf && std::max(mid - begin, end - mid) > capacity(MaxDepth - depth - 1)) {
+            // a skewed SAH split would nest too deep for the traversal stack: split at the median of
+            // the widest centroid axis instead, which halves the count and so always fits
+            glm::vec3 extent = centroidBox.bmax - centroidBox.bmin;
+            axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+            mid = begin + count / 2;
+            std::nth_element(build.begin() + begin, build.begin() + mid, build.begin() + end,
+                             [&](const BuildPrim& a, const BuildPrim& b) { return a.centroid[axis] < b.centroid[axis]; });
+        }
+
+        if (makeLeaf) {
+            nodes[index].leftOrFirst = uint32_t(begin);
+            nodes[index].count = uint16_t(count);
+            nodes[index].axis = 0;
+            return index;
+        }
+
+        buildNode(nodes, build, begin, mid, depth + 1);
+        uint32_t right = buildNode(nodes, build, mid, end, depth + 1);
+        nodes[index].leftOrFirst = right;
+        nodes[index].count = 0;
+        nodes[index].axis = uint16_t(axis);
+        return index;
+    };
+
+    // first primitive slot of the subtree at index: its leftmost leaf
+    uint32_t firstPrim(uint32_t index) const {
+        while (nodes[index].count == 0) index++;
+        return nodes[index].leftOrFirst;
+    };
+
+    void setBox(uint32_t index, const AABB& box) {
+        Node node = nodes[index];
+        node.bmin = box.bmin;
+        node.bmax = box.bmax;
+        nodes.set(index, node);
+    };
+
+    static int binIndex(float c, float lo, float scale) {
+        return std::min(BinCount - 1, int((c - lo) * scale));
+    };
+
+    // binned SAH sweep over all three axes, split is the first bin of the right child
+    static void findSplit(const std::vector<BuildPrim>& build, size_t begin, size_t end, const AABB& centroidBox,
+                          int& axis, int& split, float& cost) {
+        for (int a = 0; a < 3; ++a) {
+            float lo = centroidBox.bmin[a];
+            float extent = centroidBox.bmax[a] - lo;
+            if (extent <= 0.0f) continue;
+            float scale = BinCount / extent;
+
+            AABB binBox[BinCount];
+            int binCount[BinCount] = {0};
+            for (size_t i = begin; i < end; ++i) {
+                int b = binIndex(build[i].centroid[a], lo, scale);
+                binBox[b].grow(build[i].box);
+                binCount[b]++;
+            }
+
+            // sweep from the right to get the cost of every right partition, then from the left
+            float rightArea[BinCount];
+            int rightCount[BinCount];
+            AABB acc;
+            int n = 0;
+            for (int b = BinCount - 1; b > 0; --b) {
+                acc.grow(binBox[b]);
+                n += binCount[b];
+                rightArea[b] = acc.area();
+                rightCount[b] = n;
+            }
+            acc = AABB();
+            n = 0;
+            for (int b = 1; b < BinCount; ++b) {
+                acc.grow(binBox[b - 1]);
+                n += binCount[b - 1];
+                if (n == 0 || rightCount[b] == 0) continue;
+                float c = acc.area() * float(n) + rightArea[b] * float(rightCount[b]);
+                if (c < cost) {
+                    cost = c;
+                    axis = a;
+                    split = b;
+                }
+            }
+        }
+    };
+
+    Array<Node> nodes;
+    Array<uint32_t> prims; // primitive ids in leaf order
+    Array<uint32_t> roots; // root node of every tree
+    std::unordered_map<uint32_t, uint32_t> slots; // position in prims of every id, for refit()
+};
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef CAMERA_H_
+#define CAMERA_H_
+
+#include <glm/glm.hpp>
+#include <glm/vec3.hpp>
+#include <cmath>
+#include <cstdint>
+#include "ray.h"
+
+// camera as set up in the assignment: eye position, up direction and view direction w
+// (the camera looks along -w), horizontal field of view in degrees and focal length.
+// aperture > 0 turns the pinhole into a thin lens of that radius, focused at focusDistance along -w
+struct CameraDesc {
+    glm::vec3 eye = glm::vec3(0.0f, 0.0f, 0.0f);
+    glm::vec3 up = glm::vec3(0.0f, 1.0f, 0.0f);
+    glm::vec3 w = glm::vec3(0.0f, 0.0f, 1.0f);
+    float fov = 45.0f;
+    float focal = 1.0f;
+    float aperture = 0.0f;
+    float focusDistance = 1.0f;
+};
+
+// element index of the base-b radical inverse (Halton) sequence, in [0, 1)
+inline float radicalInverse(uint32_t index, uint32_t base) {
+    float inv = 1.0f / float(base);
+    float scale = inv;
+    float result = 0.0f;
+    while (index > 0) {
+        result += float(index % base) * scale;
+        index /= base;
+        scale *= inv;
+    }
+    return result;
+}
+
+// primary rays computed on demand, so the render loop needs no frame sized ray buffer.
+// pixel (i, j) counts columns from the left and rows from the bottom; sample 0 is the ray through
+// the pixel's grid point (and the lens center), further samples are spread over the pixel area and
+// the lens with Halton sequences
+class Camera {
+public:
+    Camera(const CameraDesc& camera, int dimx, int dimy) : width(dimx), height(dimy) {
+        float focal_length = camera.focal;
+        float viewport_width = 2.0f * tan(glm::radians(camera.fov / 2.0f));
+        float viewport_height = viewport_width * (float(height) / float(width));
+
+        e = camera.eye; // camera position
+        v = camera.up; // camera up direction
+        w = camera.w; // camera view direction
+        u = glm::cross(v,w); // camera right direction
+
+        horizontal = viewport_width * u;
+        vertical = viewport_height * v;
+        lower_left_corner = e - horizontal/2.0f - vertical/2.0f - w*focal_length;
+
+        aperture = camera.aperture;
+        focusDistance = camera.focusDistance;
+        spread = viewport_width / (focal_length * float(width - 1));
+    };
+
+    Ray generateRay(int i, int j, uint32_t sample = 0) const {
+        if (sample == 0) {
+            glm::vec3 direction = glm::normalize(lower_left_corner + float(i)/float(width-1)*horizontal
+                                                 + float(j)/float(height-1)*vertical - e);
+            return Ray(e, direction);
+        }
+
+        // pixel footprint around the grid point
+        float x = float(i) + radicalInverse(sample, 2) - 0.5f;
+        float y = float(j) + radicalInverse(sample, 3) - 0.5f;
+        glm::vec3 direction = glm::normalize(lower_left_corner + x/float(width-1)*horizontal
+                                             + y/float(height-1)*vertical - e);
+        if (aperture <= 0.0f) return Ray(e, direction);
+
+        // thin lens: rays through any point of the lens disk meet on the plane of focus
+        glm::vec3 focus = e + direction * (focusDistance / glm::dot(direction, -w));
+        float r = aperture * std::sqrt(radicalInverse(sample, 5));
+        float phi = 2.0f * 3.14159265f * radicalInverse(sample, 7);
+        glm::vec3 origin = e + u * (r * std::cos(phi)) + v * (r * std::sin(phi));
+        return Ray(origin, glm::normalize(focus - origin));
+    };
+
+    // angle between the rays of neighboring pixels: the width of a pixel's ray cone per unit of distance
+    float PixelSpread() const { return spread; };
+
+    int Width() const { return width; };
+    int Height() const { return height; };
+
+private:
+    int width;
+    int height;
+    glm::vec3 e, u, v, w;
+    glm::vec3 horizontal;
+    glm::vec3 vertical;
+    glm::vec3 lower_left_corner;
+    float aperture;
+    float focusDistance;
+    float spread;
+};
+
+#endif
@@ -0,0 +1,731 @@
+#ifndef DISTRIBUTED_H_
+#define DISTRIBUTED_H_
+
+#include <glm/glm.hpp>
+#include <glm/vec3.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "image.h"
+#include "render.h"
+#include "sceneio.h"
+#include "scheduler.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RAYTRACER_SOCKETS 1
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// Distributed rendering: a coordinator splits the frame into job tiles and hands them to worker
+// processes over TCP or Unix domain sockets; every worker renders its tiles with a local Renderer
+// on all of its cores and sends the pixels back, the coordinator streams them into the image sink.
+// a worker that disconnects or stays silent for longer than the worker timeout is dropped and its
+// tiles go back into the queue; once the queue is empty, idle workers also take over tiles that run
+// much longer than the median tile (the first result wins), so one slow machine does not hold up
+// the frame. workers may join while a frame is rendered.
+//
+// every message is a MessageHeader followed by its payload, in the byte order and struct layout of
+// the build (coordinator and workers run the same binary, like the scene cache):
+//   worker -> coordinator  Hello     protocol version
+//   coordinator -> worker  Job       JobSettings, then the scene in the scene cache format
+//   coordinator -> worker  TileJob   frame, tile id and bounds
+//   worker -> coordinator  TileDone  TileResult, then the RGB pixels of the tile row by row
+//   coordinator -> worker  Bye       no more work, the worker exits
+
+static const uint32_t ProtocolVersion = 1;
+
+enum class MessageType : uint32_t { Hello = 1, Job = 2, TileJob = 3, TileDone = 4, Bye = 5 };
+
+struct MessageHeader {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t size; // payload bytes
+};
+
+// the sampling settings of the coordinator, applied by the workers
+struct JobSettings {
+    uint32_t mode;
+    int32_t samples;
+    int32_t packetSize;
+    int32_t lightSamples;
+    int32_t maxDepth;
+    float minThroughput;
+    float adaptiveThreshold;
+    int32_t minSamples;
+    int32_t maxSamples;
+};
+
+struct TileJob {
+    uint32_t frame;
+    int32_t id;
+    int32_t x0, y0, x1, y1;
+};
+
+struct TileResult {
+    uint32_t frame;
+    int32_t id;
+    uint64_t primary, shadow, reflection;
+    double traceMs, shadeMs;
+};
+
+// the largest payload of a message of the type; tileDone is the largest TileDone the receiver
+// expects (0 for the worker). only the worker takes a Job, and only from the coordinator it
+// connected to, so the scene size is limited there alone
+inline uint64_t maxPayload(MessageType type, uint64_t tileDone) {
+    switch (type) {
+    case MessageType::Hello: return sizeof(uint32_t);
+    case MessageType::Job: return tileDone == 0 ? uint64_t(1) << 36 : 0;
+    case MessageType::TileJob: return sizeof(TileJob);
+    case MessageType::TileDone: return tileDone;
+    case MessageType::Bye: return 0;
+    }
+    return 0;
+}
+
+// "unix:<path>" for a Unix domain socket, "<host>:<port>" for TCP (an empty host is every interface
+// when listening and localhost when connecting)
+struct SocketAddress {
+    bool isUnix = false;
+    std::string path;
+    std::string host;
+    std::string port;
+};
+
+inline bool parseAddress(const std::string& text, SocketAddress& address) {
+    address = SocketAddress();
+    if (text.compare(0, 5, "unix:") == 0) {
+        address.isUnix = true;
+        address.path = text.substr(5);
+        return !address.path.empty();
+    }
+    size_t colon = text.rfind(':');
+    if (colon == std::string::npos || colon + 1 == text.size()) return false;
+    address.host = text.substr(0, colon);
+    address.port = text.substr(colon + 1);
+    return true;
+}
+
+#ifdef RAYTRACER_SOCKETS
+
+// one end of a message stream; receive() blocks, bounded by the receive timeout
+class Connection {
+public:
+    explicit Connection(int socket = -1) : fd(socket) {
+#ifdef SO_NOSIGPIPE
+        int on = 1;
+        if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    }
+    ~Connection() { close(); }
+    Connection(Connection&& other) noexcept : fd(other.fd) { other.fd = -1; }
+    Connection& operator=(Connection&& other) noexcept {
+        close();
+        fd = other.fd;
+        other.fd = -1;
+        return *this;
+    };
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
+    bool valid() const { return fd >= 0; };
+    int Descriptor() const { return fd; };
+    void close() {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+    };
+
+    void setReceiveTimeout(double ms) {
+        if (fd < 0 || ms <= 0.0) return;
+        timeval tv;
+        tv.tv_sec = time_t(ms / 1000.0);
+        tv.tv_usec = suseconds_t((ms - double(tv.tv_sec) * 1000.0) * 1000.0);
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    };
+
+    // a message whose payload is the concatenation of a and b
+    bool send(MessageType type, const void* a, size_t aSize, const void* b = nullptr, size_t bSize = 0) {
+        MessageHeader header;
+        header.type = uint32_t(type);
+        header.reserved = 0;
+        header.size = aSize + bSize;
+        return sendAll(&header, sizeof(header)) && sendAll(a, aSize) && sendAll(b, bSize);
+    };
+
+    // a message larger than maxPayload(type, tileDone) is taken for a corrupt stream, before
+    // anything is allocated for it
+    bool receive(MessageType& type, std::vector<uint8_t>& payload, uint64_t tileDone) {
+        MessageHeader header;
+        if (!receiveAll(&header, sizeof(header)) || header.size > maxPayload(MessageType(header.type), tileDone)) {
+            return false;
+        }
+        type = MessageType(header.type);
+        payload.resize(size_t(header.size));
+        return receiveAll(payload.data(), payload.size());
+    };
+
+    // appends what has arrived to buffer without blocking, until it holds size bytes; false once
+    // the peer closed the connection or it failed
+    bool receiveAvailable(std::vector<uint8_t>& buffer, size_t size) {
+        while (buffer.size() < size && fd >= 0) {
+            uint8_t chunk[64];
+            ssize_t n = ::recv(fd, chunk, std::min(sizeof(chunk), size - buffer.size()), MSG_DONTWAIT);
+            if (n == 0) return false;
+            if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            buffer.insert(buffer.end(), chunk, chunk + n);
+        }
+        return fd >= 0;
+    };
+
+private:
+    bool sendAll(const void* data, size_t size) {
+        const char* p = static_cast<const char*>(data);
+        while (size > 0 && fd >= 0) {
+#ifdef MSG_NOSIGNAL
+            ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+#else
+            ssize_t n = ::send(fd, p, size, 0);
+#endif
+            if (n <= 0) return false;
+            p += n;
+            size -= size_t(n);
+        }
+        return size == 0;
+    };
+
+    bool receiveAll(void* data, size_t size) {
+        char* p = static_cast<char*>(data);
+        while (size > 0 && fd >= 0) {
+            ssize_t n = ::recv(fd, p, size, 0);
+            if (n <= 0) return false;
+            p += n;
+            size -= size_t(n);
+        }
+        return size == 0;
+    };
+
+    int fd;
+};
+
+// connected (or, with listen, listening and bound) socket for the address, -1 on failure
+inline int openSocket(const SocketAddress& address, bool listen) {
+    if (address.isUnix) {
+        sockaddr_un sa;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if (address.path.size() >= sizeof(sa.sun_path)) return -1;
+        std::memcpy(sa.sun_path, address.path.c_str(), address.path.size() + 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        if (listen) ::unlink(address.path.c_str());
+        bool ok = listen ? (bind(fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) == 0 && ::listen(fd, 64) == 0)
+                         : connect(fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) == 0;
+        if (!ok) ::close(fd);
+        return ok ? fd : -1;
+    }
+
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listen ? AI_PASSIVE : 0;
+    addrinfo* list = nullptr;
+    const char* host = address.host.empty() ? nullptr : address.host.c_str();
+    if (getaddrinfo(host, address.port.c_str(), &hints, &list) != 0) return -1;
+    int fd = -1;
+    for (addrinfo* ai = list; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        int on = 1;
+        bool ok;
+        if (listen) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            ok = bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && ::listen(fd, 64) == 0;
+        } else {
+            // tile jobs are small messages that should go out right away
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            ok = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+        }
+        if (!ok) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(list);
+    return fd;
+}
+
+// worker process: connects to the coordinator at address (retrying for a few seconds while it starts
+// up) and renders the tiles it is sent until the coordinator says goodbye or goes away. settings give
+// the thread count and tile size of the local renderer, the sampling settings come with every job.
+// returns false if the coordinator could not be reached or sent something invalid
+inline bool runWorker(const std::string& address, const RenderSettings& settings) {
+    SocketAddress addr;
+    if (!parseAddress(address, addr)) {
+        std::cerr << "invalid address " << address << std::endl;
+        return false;
+    }
+    Connection conn;
+    auto start = std::chrono::steady_clock::now();
+    while (!conn.valid()) {
+        conn = Connection(openSocket(addr, false));
+        if (conn.valid() || std::chrono::steady_clock::now() - start > std::chrono::seconds(10)) break;
+        usleep(100000);
+    }
+    if (!conn.valid()) {
+        std::cerr << "cannot connect to coordinator " << address << std::endl;
+        return false;
+    }
+    uint32_t version = ProtocolVersion;
+    if (!conn.send(MessageType::Hello, &version, sizeof(version))) return false;
+
+    SceneDescription desc;
+    std::unique_ptr<Renderer> renderer;
+    ShadeMode mode = ShadeMode::Reflections;
+    std::vector<uint8_t> pixels;
+    MessageType type;
+    std::vector<uint8_t> payload;
+    while (conn.receive(type, payload, 0)) {
+        if (type == MessageType::Bye) break;
+        if (type == MessageType::Job) {
+            JobSettings job;
+            if (payload.size() < sizeof(job)) return false;
+            std::memcpy(&job, payload.data(), sizeof(job));
+            // the scene arrays become views of their own copy of the message
+            auto scene = std::make_shared<std::vector<uint8_t>>(payload.begin() + sizeof(job), payload.end());
+            desc = SceneDescription();
+            if (job.mode > uint32_t(ShadeMode::Reflections) || !loadSceneCache(scene->data(), scene->size(), scene, desc) ||
+                desc.width <= 0 || desc.height <= 0) {
+                std::cerr << "invalid job from the coordinator" << std::endl;
+                return false;
+            }
+            mode = ShadeMode(job.mode);
+            RenderSettings local = settings;
+            local.samples = job.samples;
+            local.packetSize = job.packetSize;
+            local.lightSamples = job.lightSamples;
+            local.reflection.maxDepth = job.maxDepth;
+            local.reflection.minThroughput = job.minThroughput;
+            local.adaptiveThreshold = job.adaptiveThreshold;
+            local.minSamples = job.minSamples;
+            local.maxSamples = job.maxSamples;
+            local.timeBudgetMs = 0.0;
+            local.showStats = false;
+            if (!renderer || renderer->Width() != desc.width || renderer->Height() != desc.height) {
+                renderer.reset(new Renderer(desc.width, desc.height, desc.camera, local));
+            } else {
+                renderer->configure(local);
+                renderer->setCamera(desc.camera);
+            }
+        } else if (type == MessageType::TileJob) {
+            TileJob job;
+            if (!renderer || payload.size() != sizeof(job)) return false;
+            std::memcpy(&job, payload.data(), sizeof(job));
+            Tile region{job.id, job.x0, job.y0, job.x1, job.y1};
+            if (region.x0 < 0 || region.y0 < 0 || region.x1 > desc.width || region.y1 > desc.height ||
+                region.x0 >= region.x1 || region.y0 >= region.y1) {
+                return false;
+            }
+            size_t stride = size_t(region.x1 - region.x0) * 3;
+            pixels.resize(stride * size_t(region.y1 - region.y0));
+            BufferSink sink(pixels.data(), stride, region);
+            PixelSelection selection;
+            selection.region = &region;
+            PassStats stats = renderer->render(desc, mode, "tile", &sink, nullptr, selection);
+            TileResult result;
+            std::memset(&result, 0, sizeof(result));
+            result.frame = job.frame;
+            result.id = job.id;
+            result.primary = stats.rays.primary;
+            result.shadow = stats.rays.shadow;
+            result.reflection = stats.rays.reflection;
+            result.traceMs = stats.traceMs;
+            result.shadeMs = stats.shadeMs;
+            if (!conn.send(MessageType::TileDone, &result, sizeof(result), pixels.data(), pixels.size())) break;
+        }
+    }
+    return true;
+}
+
+// coordinator side: listens for workers and renders frames on them
+class Coordinator {
+public:
+    struct Settings {
+        int jobTile = 128;               // edge of the tiles handed out, in px
+        int pipeline = 2;                // tiles sent ahead to every worker
+        double workerTimeoutMs = 60000;  // a worker with tiles that is silent this long is dropped
+        double slowFactor = 4.0;         // idle workers take over tiles running this many times the median
+        double minSlowMs = 1000;         // ... but never ones running shorter than this
+        double helloTimeoutMs = 5000;    // a connection that has not said hello by then is closed
+    };
+
+    Coordinator(const RenderSettings& renderSettings, const Settings& config)
+        : settings(renderSettings), coordination(config) {}
+    ~Coordinator() {
+        for (Worker& w : workers) {
+            if (w.conn.valid()) w.conn.send(MessageType::Bye, nullptr, 0);
+            w.conn.close();
+        }
+        listener.close();
+        if (address.isUnix && !address.path.empty()) ::unlink(address.path.c_str());
+        for (pid_t pid : children) waitpid(pid, nullptr, 0);
+    }
+    Coordinator(const Coordinator&) = delete;
+    Coordinator& operator=(const Coordinator&) = delete;
+
+    bool listen(const std::string& text) {
+        if (!parseAddress(text, address)) {
+            std::cerr << "invalid address " << text << std::endl;
+            return false;
+        }
+        listener = Connection(openSocket(address, true));
+        if (!listener.valid()) std::cerr << "cannot listen on " << text << std::endl;
+        return listener.valid();
+    };
+
+    // forks count worker processes on this machine (call before any other thread is started)
+    bool spawnWorkers(int count, const std::string& text, const RenderSettings& workerSettings) {
+        std::cout.flush();
+        std::cerr.flush();
+        for (int i = 0; i < count; ++i) {
+            pid_t pid = fork();
+            if (pid < 0) return false;
+            if (pid == 0) {
+                listener.close();
+                bool ok = runWorker(text, workerSettings);
+                std::cout.flush();
+                _exit(ok ? 0 : 1);
+            }
+            children.push_back(pid);
+        }
+        return true;
+    };
+
+    // accepts workers until count of them are connected; false if that takes longer than timeoutMs
+    bool waitForWorkers(int count, double timeoutMs) {
+        auto start = Clock::now();
+        std::vector<pollfd> fds;
+        while (aliveCount() < count) {
+            double left = timeoutMs - ms(Clock::now() - start);
+            if (left <= 0.0) return false;
+            fds.clear();
+            pollJoining(fds);
+            if (poll(fds.data(), nfds_t(fds.size()), int(std::min(left, 100.0))) < 0) continue;
+            greet(fds, 0, nullptr);
+        }
+        return true;
+    };
+
+    int WorkerCount() const { return aliveCount(); };
+    const std::vector<glm::u8vec3>& Image() const { return image; };
+
+    // renders the frame of desc on the workers, tile by tile into sink; the image is the one
+    // Renderer::render gives with the same settings. ray counts and trace/shade times are summed
+    // over the workers. fails if every worker is lost before the frame is done
+    PassStats render(SceneDescription& desc, ShadeMode mode, const std::string& label, ImageSink* sink) {
+        auto start = Clock::now();
+        PassStats stats;
+        stats.label = label;
+        frame++;
+        width = desc.width;
+        height = desc.height;
+        image.assign(size_t(width) * height, glm::u8vec3(0, 0, 0));
+
+        job.mode = uint32_t(mode);
+        job.samples = settings.samples;
+        job.packetSize = settings.packetSize;
+        job.lightSamples = settings.lightSamples;
+        job.maxDepth = settings.reflection.maxDepth;
+        job.minThroughput = settings.reflection.minThroughput;
+        job.adaptiveThreshold = settings.adaptiveThreshold;
+        job.minSamples = settings.minSamples;
+        job.maxSamples = settings.maxSamples;
+        scene.clear();
+        writeSceneCache(desc, [&](const void* bytes, size_t count) {
+            const uint8_t* p = static_cast<const uint8_t*>(bytes);
+            scene.insert(scene.end(), p, p + count);
+        });
+        for (Worker& w : workers) {
+            w.pending.clear();
+            if (w.conn.valid()) sendJob(w);
+        }
+
+        // the job tiles, laid out like the renderer's
+        tiles = TileScheduler(width, height, coordination.jobTile, 1).Tiles();
+        std::deque<int> queue;
+        for (const Tile& tile : tiles) queue.push_back(tile.id);
+        done.assign(tiles.size(), 0);
+        copies.assign(tiles.size(), 0);
+        tileMs.clear();
+        size_t remaining = tiles.size();
+        if (sink) stats.ok = sink->open(width, height);
+
+        std::vector<pollfd> fds;
+        std::vector<uint8_t> payload;
+        while (remaining > 0) {
+            for (Worker& w : workers) {
+                if (!w.conn.valid()) continue;
+                while (int(w.pending.size()) < coordination.pipeline && !queue.empty()) {
+                    int t = queue.front();
+                    queue.pop_front();
+                    if (!done[t]) assign(w, t, queue);
+                }
+                if (w.pending.empty() && queue.empty()) speculate(w, queue);
+            }
+            if (aliveCount() == 0) {
+                std::cerr << label << ": no worker left, " << remaining << " tiles not rendered" << std::endl;
+                stats.ok = false;
+                break;
+            }
+
+            fds.clear();
+            for (Worker& w : workers) {
+                if (w.conn.valid()) fds.push_back({w.conn.Descriptor(), POLLIN, 0});
+            }
+            size_t firstJoining = fds.size();
+            pollJoining(fds);
+            if (poll(fds.data(), nfds_t(fds.size()), 50) < 0) continue;
+            size_t f = 0;
+            for (size_t i = 0; i < workers.size(); ++i) {
+                Worker& w = workers[i];
+                if (!w.conn.valid()) continue;
+                if (fds[f++].revents == 0) {
+                    if (!w.pending.empty() && ms(Clock::now() - w.lastHeard) > coordination.workerTimeoutMs) {
+                        drop(w, queue, "timed out");
+                    }
+                    continue;
+                }
+                MessageType type;
+                if (!w.conn.receive(type, payload, tileDoneSize()) || type != MessageType::TileDone) {
+                    drop(w, queue, "disconnected");
+                    continue;
+                }
+                w.lastHeard = Clock::now();
+                TileResult result;
+                if (payload.size() < sizeof(result)) {
+                    drop(w, queue, "sent an invalid result");
+                    continue;
+                }
+                std::memcpy(&result, payload.data(), sizeof(result));
+                if (result.frame != frame) continue; // a duplicate of an earlier frame
+                auto it = std::find_if(w.pending.begin(), w.pending.end(), [&](const Assignment& a) { return a.tile == result.id; });
+                if (it == w.pending.end()) continue;
+                double tileTime = ms(Clock::now() - it->start);
+                w.pending.erase(it);
+                copies[result.id]--;
+                const Tile& tile = tiles[result.id];
+                size_t stride = size_t(tile.x1 - tile.x0) * 3;
+                if (done[result.id] || payload.size() != sizeof(result) + stride * size_t(tile.y1 - tile.y0)) continue;
+
+                const uint8_t* src = payload.data() + sizeof(result);
+                for (int y = tile.y0; y < tile.y1; ++y) {
+                    std::memcpy(&image[size_t(y) * width + tile.x0], src + size_t(y - tile.y0) * stride, stride);
+                }
+                if (sink) sink->tileDone(tile, image.data());
+                done[result.id] = 1;
+                remaining--;
+                tileMs.push_back(tileTime);
+                stats.rays.primary += result.primary;
+                stats.rays.shadow += result.shadow;
+                stats.rays.reflection += result.reflection;
+                stats.traceMs += result.traceMs;
+                stats.shadeMs += result.shadeMs;
+            }
+            // a worker joining mid-frame gets the job and starts on the next queued tile
+            greet(fds, firstJoining, &queue);
+        }
+
+        auto rendered = Clock::now();
+        if (sink) stats.ok = sink->close() && stats.ok;
+        auto end = Clock::now();
+        stats.outputMs = ms(end - rendered);
+        stats.wallMs = ms(end - start);
+        if (settings.showStats) {
+            std::cout << label << ": " << tiles.size() << " tiles on " << aliveCount() << " workers, "
+                      << reassigned << " reassigned, " << duplicated << " duplicated" << std::endl;
+            printPassStats(std::cout, stats);
+        }
+        return stats;
+    };
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Assignment {
+        int tile;
+        Clock::time_point start;
+    };
+
+    struct Worker {
+        Connection conn;
+        std::vector<Assignment> pending;
+        Clock::time_point lastHeard;
+    };
+
+    // an accepted connection that has not said hello yet
+    struct Joining {
+        Connection conn;
+        std::vector<uint8_t> hello;  // the bytes of the hello message so far
+        Clock::time_point since;
+    };
+
+    static double ms(Clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); };
+
+    int aliveCount() const {
+        int n = 0;
+        for (const Worker& w : workers) n += w.conn.valid() ? 1 : 0;
+        return n;
+    };
+
+    uint64_t tileDoneSize() const {
+        return sizeof(TileResult) + uint64_t(coordination.jobTile) * uint64_t(coordination.jobTile) * 3;
+    };
+
+    // adds the joining connections and then the listener to fds
+    void pollJoining(std::vector<pollfd>& fds) {
+        for (Joining& j : joining) fds.push_back({j.conn.Descriptor(), POLLIN, 0});
+        fds.push_back({listener.Descriptor(), POLLIN, 0});
+    };
+
+    // handles the joining connections and the listener from fds[first] on (see pollJoining) without
+    // blocking: a connection that completes a valid hello becomes a worker, which gets the job right
+    // away if a frame is rendered (queue); one that sends anything else or is silent for longer than
+    // the hello timeout is closed. then accepts the new connection, if any
+    void greet(const std::vector<pollfd>& fds, size_t first, std::deque<int>* queue) {
+        const size_t helloSize = sizeof(MessageHeader) + sizeof(uint32_t);
+        auto now = Clock::now();
+        size_t kept = 0;
+        for (size_t i = 0; i < joining.size(); ++i) {
+            Joining& j = joining[i];
+            bool open = fds[first + i].revents == 0 || j.conn.receiveAvailable(j.hello, helloSize);
+            if (open && j.hello.size() == helloSize) {
+                MessageHeader header;
+                uint32_t version;
+                std::memcpy(&header, j.hello.data(), sizeof(header));
+                std::memcpy(&version, j.hello.data() + sizeof(header), sizeof(version));
+                if (header.type == uint32_t(MessageType::Hello) && header.size == sizeof(version) &&
+                    version == ProtocolVersion) {
+                    addWorker(std::move(j.conn), queue);
+                } else if (header.type == uint32_t(MessageType::Hello)) {
+                    std::cerr << "worker speaks protocol " << version << ", expected " << ProtocolVersion << std::endl;
+                }
+                continue;
+            }
+            if (!open || ms(now - j.since) > coordination.helloTimeoutMs) continue;
+            if (kept != i) joining[kept] = std::move(j);
+            kept++;
+        }
+        joining.resize(kept);
+
+        if (fds.back().revents == 0) return;
+        Connection conn(accept(listener.Descriptor(), nullptr, nullptr));
+        if (!conn.valid()) return;
+        joining.push_back(Joining());
+        joining.back().conn = std::move(conn);
+        joining.back().since = now;
+    };
+
+    void addWorker(Connection conn, std::deque<int>* queue) {
+        conn.setReceiveTimeout(coordination.workerTimeoutMs);
+        workers.push_back(Worker());
+        workers.back().conn = std::move(conn);
+        workers.back().lastHeard = Clock::now();
+        if (queue) {
+            if (!sendJob(workers.back())) drop(workers.back(), *queue, "disconnected");
+        }
+    };
+
+    bool sendJob(Worker& w) {
+        if (w.conn.send(MessageType::Job, &job, sizeof(job), scene.data(), scene.size())) return true;
+        w.conn.close();
+        return false;
+    };
+
+    void assign(Worker& w, int t, std::deque<int>& queue) {
+        const Tile& tile = tiles[t];
+        TileJob message = {frame, tile.id, tile.x0, tile.y0, tile.x1, tile.y1};
+        if (w.pending.empty()) w.lastHeard = Clock::now();
+        w.pending.push_back({t, Clock::now()});
+        copies[t]++;
+        if (!w.conn.send(MessageType::TileJob, &message, sizeof(message))) drop(w, queue, "disconnected");
+    };
+
+    // an idle worker takes over the longest running tile if that is far behind the others
+    void speculate(Worker& idle, std::deque<int>& queue) {
+        if (tileMs.empty()) return;
+        std::vector<double> sorted(tileMs);
+        std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+        double limit = std::max(coordination.minSlowMs, coordination.slowFactor * sorted[sorted.size() / 2]);
+        int slowest = -1;
+        double longest = limit;
+        auto now = Clock::now();
+        for (const Worker& w : workers) {
+            if (&w == &idle || !w.conn.valid()) continue;
+            for (const Assignment& a : w.pending) {
+                double running = ms(now - a.start);
+                if (!done[a.tile] && copies[a.tile] == 1 && running > longest) {
+                    longest = running;
+                    slowest = a.tile;
+                }
+            }
+        }
+        if (slowest < 0) return;
+        duplicated++;
+        assign(idle, slowest, queue);
+    };
+
+    // closes the connection, the tiles of the worker go back to the front of the queue
+    void drop(Worker& w, std::deque<int>& queue, const char* reason) {
+        std::cerr << "worker " << (&w - workers.data()) << " " << reason << ", " << w.pending.size()
+                  << " tiles reassigned" << std::endl;
+        for (const Assignment& a : w.pending) {
+            copies[a.tile]--;
+            if (!done[a.tile] && copies[a.tile] == 0) {
+                queue.push_front(a.tile);
+                reassigned++;
+            }
+        }
+        w.pending.clear();
+        w.conn.close();
+    };
+
+    RenderSettings settings;
+    Settings coordination;
+    SocketAddress address;
+    Connection listener;
+    std::vector<pid_t> children;
+    std::vector<Worker> workers; // grows only between the passes over it
+    std::vector<Joining> joining;
+
+    // the current frame
+    uint32_t frame = 0;
+    JobSettings job;
+    std::vector<uint8_t> scene;
+    int width = 0;
+    int height = 0;
+    std::vector<glm::u8vec3> image;
+    std::vector<Tile> tiles;
+    std::vector<uint8_t> done;
+    std::vector<int> copies;      // workers the tile is assigned to
+    std::vector<double> tileMs;   // time from assignment to result of the finished tiles
+    uint64_t reassigned = 0;
+    uint64_t duplicated = 0;
+};
+
+#endif
+
+#endif
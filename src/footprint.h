@@ -0,0 +1,59 @@
+#ifndef FOOTPRINT_H_
+#define FOOTPRINT_H_
+
+#include <glm/glm.hpp>
+#include <glm/vec3.hpp>
+#include <cfloat>
+#include <cstdint>
+#include "aabb.h"
+
+// bit of a primitive in a footprint mask; distinct primitives may share a bit, which only makes an
+// incremental re-render shade a pixel that did not need it
+inline uint64_t footprintBit(uint32_t primId) {
+    uint32_t h = primId * 0x9e3779b9u;
+    return uint64_t(1) << (h >> 26);
+}
+
+// what the shading of one pixel depended on besides its primary rays, recorded for incremental
+// re-rendering: an object edit only has to re-shade the pixels whose footprint the object touched
+// before or after it moved
+struct PixelFootprint {
+    uint64_t touched;   // footprintBit() of every primary hit, reflection hit and shadow blocker
+    AABB secondary;     // bounds of the reflection segments and their shadow rays
+
+    void clear() {
+        touched = 0;
+        secondary = AABB();
+    };
+};
+
+// collects the footprint of the pixel the calling thread is shading; inactive (recording nothing)
+// unless the renderer was asked for footprints. the shadow rays of primary hits are not recorded,
+// the session re-derives them from the primary hit
+struct FootprintRecorder {
+    bool active = false;
+    uint64_t touched = 0;
+    AABB secondary;
+
+    void begin() {
+        active = true;
+        touched = 0;
+        secondary = AABB();
+    };
+    void touch(uint32_t primId) { touched |= footprintBit(primId); };
+    void segment(const glm::vec3& a, const glm::vec3& b) {
+        secondary.grow(a);
+        secondary.grow(b);
+    };
+    // a reflection left the scene: anything placed anywhere may end up in its way
+    void unbounded() {
+        secondary = AABB(glm::vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX), glm::vec3(FLT_MAX, FLT_MAX, FLT_MAX));
+    };
+};
+
+inline FootprintRecorder& threadFootprint() {
+    thread_local FootprintRecorder recorder;
+    return recorder;
+}
+
+#endif
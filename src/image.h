@@ -0,0 +1,375 @@
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <glm/glm.hpp>
+#include <glm/vec3.hpp>
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "scheduler.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RAYTRACER_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// frames are written straight from the framebuffer memory, which requires tightly packed pixels
+static_assert(sizeof(glm::u8vec3) == 3, "glm::u8vec3 must be 3 bytes");
+
+// destination for a rendered 8 bit frame. a sink is either fed the whole frame at once with write(),
+// or opened before rendering and handed every finished tile while the other tiles are still being
+// rendered, so encoding and disk I/O overlap with the render. tileDone() may be called concurrently
+// from several render threads, in any tile order.
+class ImageSink {
+public:
+    virtual ~ImageSink() {}
+
+    virtual bool open(int width, int height) = 0;
+    // frame is the full framebuffer (row 0 at the top); only the pixels inside tile are read
+    virtual void tileDone(const Tile& tile, const glm::u8vec3* frame) = 0;
+    virtual bool close() = 0;
+
+    // whole frame in one go
+    virtual bool write(const glm::u8vec3* frame, int width, int height) {
+        if (!open(width, height)) return false;
+        tileDone(Tile{0, 0, 0, width, height}, frame);
+        return close();
+    };
+};
+
+// binary PPM (P6). on POSIX systems the output file is sized up front and memory-mapped, every tile
+// is copied straight to its final place in the page cache; elsewhere the frame is collected in
+// memory and written with a single call on close().
+class PpmSink : public ImageSink {
+public:
+    explicit PpmSink(const std::string& file) : filename(file) {}
+    ~PpmSink() { close(); }
+
+    bool open(int dX, int dY) {
+        width = dX;
+        height = dY;
+        std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+        headerSize = header.size();
+        size_t size = headerSize + size_t(width) * height * 3;
+#ifdef RAYTRACER_MMAP
+        fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0 && ftruncate(fd, off_t(size)) == 0) {
+            void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED) {
+                mapped = static_cast<uint8_t*>(p);
+                mappedSize = size;
+                std::memcpy(mapped, header.data(), headerSize);
+                return true;
+            }
+        }
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+        // buffered fallback
+        buffer.assign(size, 0);
+        std::memcpy(buffer.data(), header.data(), headerSize);
+        return true;
+    };
+
+    void tileDone(const Tile& tile, const glm::u8vec3* frame) {
+        uint8_t* base = mapped ? mapped : buffer.data();
+        if (!base) return;
+        size_t rowBytes = size_t(tile.x1 - tile.x0) * 3;
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            size_t offset = size_t(y) * width + tile.x0;
+            std::memcpy(base + headerSize + offset * 3, frame + offset, rowBytes);
+        }
+    };
+
+    bool close() {
+#ifdef RAYTRACER_MMAP
+        if (mapped) {
+            bool ok = munmap(mapped, mappedSize) == 0;
+            mapped = nullptr;
+            ok = ::close(fd) == 0 && ok;
+            fd = -1;
+            return ok;
+        }
+#endif
+        if (buffer.empty()) return true;
+        std::ofstream ofs(filename, std::ios_base::out | std::ios_base::binary);
+        ofs.write(reinterpret_cast<const char*>(buffer.data()), std::streamsize(buffer.size()));
+        buffer.clear();
+        return !ofs.fail();
+    };
+
+    bool write(const glm::u8vec3* frame, int dX, int dY) {
+        // single buffered write straight from the framebuffer, no staging copy
+        std::ofstream ofs(filename, std::ios_base::out | std::ios_base::binary);
+        if (ofs.fail()) return false;
+        ofs << "P6\n" << dX << ' ' << dY << "\n255\n";
+        ofs.write(reinterpret_cast<const char*>(frame), std::streamsize(size_t(dX) * dY * 3));
+        return !ofs.fail();
+    };
+
+private:
+    std::string filename;
+    int width = 0;
+    int height = 0;
+    size_t headerSize = 0;
+    std::vector<uint8_t> buffer;
+    uint8_t* mapped = nullptr;
+    size_t mappedSize = 0;
+    int fd = -1;
+};
+
+// 8 bit RGB PNG without a zlib dependency: scanlines go into stored (uncompressed) deflate blocks.
+// PNG rows have to be written top to bottom, so finished tiles are counted per row and every run of
+// complete rows at the top of the image is appended to the file as its own IDAT chunk right away.
+class PngSink : public ImageSink {
+public:
+    explicit PngSink(const std::string& file) : filename(file) {}
+    ~PngSink() { close(); }
+
+    bool open(int dX, int dY) {
+        width = dX;
+        height = dY;
+        nextRow = 0;
+        adler = 1;
+        rowPixels.assign(height, 0);
+        rows.assign(size_t(height) * (1 + size_t(width) * 3), 0);
+
+        out = std::fopen(filename.c_str(), "wb");
+        if (!out) return false;
+        static const uint8_t signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+        std::fwrite(signature, 1, 8, out);
+        uint8_t ihdr[13];
+        put32(ihdr, uint32_t(width));
+        put32(ihdr + 4, uint32_t(height));
+        ihdr[8] = 8;  // bit depth
+        ihdr[9] = 2;  // truecolor
+        ihdr[10] = 0; // deflate
+        ihdr[11] = 0; // adaptive filtering (every row uses filter 0)
+        ihdr[12] = 0; // no interlace
+        chunk("IHDR", ihdr, 13);
+        // zlib header: deflate, 32K window, no preset dictionary
+        static const uint8_t zlibHeader[2] = {0x78, 0x01};
+        chunk("IDAT", zlibHeader, 2);
+        return true;
+    };
+
+    void tileDone(const Tile& tile, const glm::u8vec3* frame) {
+        if (!out) return;
+        size_t stride = 1 + size_t(width) * 3;
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            std::memcpy(&rows[y * stride + 1 + size_t(tile.x0) * 3], frame + size_t(y) * width + tile.x0,
+                        size_t(tile.x1 - tile.x0) * 3);
+        }
+
+        std::lock_guard<std::mutex> lock(m);
+        for (int y = tile.y0; y < tile.y1; ++y) rowPixels[y] += tile.x1 - tile.x0;
+        int first = nextRow;
+        while (nextRow < height && rowPixels[nextRow] == width) nextRow++;
+        if (nextRow > first) flushRows(first, nextRow);
+    };
+
+    bool close() {
+        if (!out) return true;
+        // final empty stored block and the adler32 checksum of all scanline bytes
+        uint8_t tail[9] = {1, 0, 0, 0xff, 0xff};
+        put32(tail + 5, adler);
+        chunk("IDAT", tail, 9);
+        chunk("IEND", nullptr, 0);
+        bool ok = std::fclose(out) == 0 && nextRow == height;
+        out = nullptr;
+        return ok;
+    };
+
+private:
+    static void put32(uint8_t* p, uint32_t v) {
+        p[0] = uint8_t(v >> 24);
+        p[1] = uint8_t(v >> 16);
+        p[2] = uint8_t(v >> 8);
+        p[3] = uint8_t(v);
+    };
+
+    static uint32_t crc32(uint32_t crc, const uint8_t* data, size_t n) {
+        static uint32_t table[256];
+        static bool init = [] {
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                table[i] = c;
+            }
+            return true;
+        }();
+        (void)init;
+        for (size_t i = 0; i < n; ++i) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        return crc;
+    };
+
+    void chunk(const char* type, const uint8_t* data, size_t n) {
+        uint8_t len[4];
+        put32(len, uint32_t(n));
+        std::fwrite(len, 1, 4, out);
+        std::fwrite(type, 1, 4, out);
+        if (n) std::fwrite(data, 1, n, out);
+        uint32_t crc = crc32(0xffffffffu, reinterpret_cast<const uint8_t*>(type), 4);
+        crc = crc32(crc, data, n) ^ 0xffffffffu;
+        uint8_t c[4];
+        put32(c, crc);
+        std::fwrite(c, 1, 4, out);
+    };
+
+    // append rows [first, last) as stored deflate blocks of at most 65535 bytes
+    void flushRows(int first, int last) {
+        size_t stride = 1 + size_t(width) * 3;
+        const uint8_t* data = &rows[first * stride];
+        size_t n = size_t(last - first) * stride;
+
+        uint32_t a = adler & 0xffff, b = adler >> 16;
+        for (size_t i = 0; i < n; ++i) {
+            a = (a + data[i]) % 65521;
+            b = (b + a) % 65521;
+        }
+        adler = (b << 16) | a;
+
+        std::vector<uint8_t> idat;
+        idat.reserve(n + (n / 65535 + 1) * 5);
+        for (size_t pos = 0; pos < n; pos += 65535) {
+            uint16_t len = uint16_t(std::min<size_t>(65535, n - pos));
+            uint8_t head[5] = {0, uint8_t(len), uint8_t(len >> 8), uint8_t(~len), uint8_t(~len >> 8)};
+            idat.insert(idat.end(), head, head + 5);
+            idat.insert(idat.end(), data + pos, data + pos + len);
+        }
+        chunk("IDAT", idat.data(), idat.size());
+    };
+
+    std::string filename;
+    std::FILE* out = nullptr;
+    int width = 0;
+    int height = 0;
+    std::vector<uint8_t> rows;     // filter byte + RGB per scanline
+    std::vector<int> rowPixels;    // finished pixels per row
+    int nextRow = 0;               // first row not yet written
+    uint32_t adler = 1;
+    std::mutex m;
+};
+
+// caller-owned RGB memory for a region of the frame (x0, y0 its top left corner, stride bytes per
+// row): every tile is copied in as it finishes, no file is involved. pixels outside the region are
+// dropped
+class BufferSink : public ImageSink {
+public:
+    BufferSink(uint8_t* buffer, size_t rowStride, const Tile& area) : data(buffer), stride(rowStride), region(area) {}
+
+    bool open(int width, int) {
+        frameWidth = width;
+        return data != nullptr;
+    };
+    void tileDone(const Tile& tile, const glm::u8vec3* frame) {
+        int x0 = std::max(tile.x0, region.x0);
+        int x1 = std::min(tile.x1, region.x1);
+        if (x0 >= x1) return;
+        for (int y = std::max(tile.y0, region.y0); y < std::min(tile.y1, region.y1); ++y) {
+            uint8_t* dst = data + size_t(y - region.y0) * stride + size_t(x0 - region.x0) * 3;
+            std::memcpy(dst, &frame[size_t(y) * frameWidth + x0], size_t(x1 - x0) * 3);
+        }
+    };
+    bool close() { return true; };
+
+private:
+    uint8_t* data;
+    size_t stride;
+    Tile region;
+    int frameWidth = 0;
+};
+
+// "ppm" or "png"; appends the extension to the base file name
+inline std::unique_ptr<ImageSink> makeImageSink(const std::string& format, const std::string& filename) {
+    if (format == "png") return std::unique_ptr<ImageSink>(new PngSink(filename + ".png"));
+    return std::unique_ptr<ImageSink>(new PpmSink(filename + ".ppm"));
+}
+
+// write PPM image file (input parameters: image width in px, image height in px, image data (vector of uint8 vec3), filename)
+inline bool writeP6PPM(unsigned int dX, unsigned int dY, const std::vector<glm::u8vec3>& img, std::string filename = "rtimage") {
+    // return false if image size does not fit data size
+    if (img.size() != dX * dY) return false;
+    PpmSink sink(filename + ".ppm");
+    return sink.write(img.data(), int(dX), int(dY));
+}
+
+// read a binary PPM image file (P6 with maxval 255, rows top to bottom), e.g. an image texture
+inline bool readP6PPM(const std::string& path, unsigned int& dX, unsigned int& dY, std::vector<glm::u8vec3>& img) {
+    std::ifstream ifs(path, std::ios_base::in | std::ios_base::binary);
+    if (ifs.fail()) return false;
+    // header fields are separated by whitespace and may be followed by # comments
+    auto field = [&](std::string& token) {
+        token.clear();
+        while (ifs) {
+            int c = ifs.get();
+            if (c == '#') {
+                while (ifs && c != '\n') c = ifs.get();
+            } else if (std::isspace(c) || c == EOF) {
+                if (!token.empty()) return true;
+            } else {
+                token += char(c);
+            }
+        }
+        return false;
+    };
+    std::string magic, w, h, maxval;
+    if (!field(magic) || magic != "P6" || !field(w) || !field(h) || !field(maxval) || maxval != "255") return false;
+    dX = unsigned(std::strtoul(w.c_str(), nullptr, 10));
+    dY = unsigned(std::strtoul(h.c_str(), nullptr, 10));
+    if (dX == 0 || dY == 0) return false;
+    img.resize(size_t(dX) * dY);
+    ifs.read(reinterpret_cast<char*>(img.data()), std::streamsize(img.size() * 3));
+    return !ifs.fail();
+}
+
+// write a float RGB image as portable float map (little endian, rows bottom to top), values are not clamped
+inline bool writePFM(unsigned int dX, unsigned int dY, const std::vector<glm::vec3>& img, std::string filename = "rtimage") {
+    if (img.size() != dX * dY) return false;
+    static_assert(sizeof(glm::vec3) == 12, "glm::vec3 must be 3 floats");
+    std::ofstream ofs(filename + ".pfm", std::ios_base::out | std::ios_base::binary);
+    if (ofs.fail()) return false;
+    ofs << "PF\n" << dX << ' ' << dY << "\n-1.0\n";
+    for (int j = int(dY) - 1; j >= 0; --j) {
+        ofs.write(reinterpret_cast<const char*>(&img[size_t(j) * dX]), std::streamsize(dX * sizeof(glm::vec3)));
+    }
+    return !ofs.fail();
+}
+
+// false color image of a per-pixel cost (row 0 at the top): black, blue, red, yellow to white on a log
+// scale up to the 99.9th percentile, so a few extreme pixels do not wash out the rest. writes it
+// to sink and returns the cost the white end stands for in max (0 for an empty frame)
+inline bool writeHeatmap(const std::vector<uint32_t>& costs, int width, int height, ImageSink& sink, uint32_t& max) {
+    if (costs.size() != size_t(width) * size_t(height)) return false;
+    max = 0;
+    if (!costs.empty()) {
+        std::vector<uint32_t> sorted(costs);
+        size_t p = (sorted.size() - 1) * 999 / 1000;
+        std::nth_element(sorted.begin(), sorted.begin() + std::ptrdiff_t(p), sorted.end());
+        max = std::max(sorted[p], 1u);
+    }
+    static const glm::vec3 ramp[5] = {glm::vec3(0, 0, 0), glm::vec3(0, 0, 255), glm::vec3(255, 0, 0),
+                                      glm::vec3(255, 255, 0), glm::vec3(255, 255, 255)};
+    float scale = 4.0f / std::log1p(float(max));
+    std::vector<glm::u8vec3> image(costs.size());
+    for (size_t k = 0; k < costs.size(); ++k) {
+        float t = std::min(std::log1p(float(costs[k])) * scale, 4.0f);
+        int i = std::min(int(t), 3);
+        image[k] = glm::mix(ramp[i], ramp[i + 1], t - float(i));
+    }
+    return sink.write(image.data(), width, height);
+}
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef INTEGRATOR_H_
+#define INTEGRATOR_H_
+
+#include <glm/glm.hpp>
+#include <glm/vec3.hpp>
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include "footprint.h"
+#include "lights.h"
+#include "material.h"
+#include "ray.h"
+#include "scene.h"
+#include "shading.h"
+#include "stats.h"
+
+// upper bound for ReflectionSettings::maxDepth, sizes the per-call bounce stack
+static const int MaxReflectionDepth = 32;
+static_assert(MaxProfiledDepth >= MaxReflectionDepth, "the profile depth histogram needs a bucket for every bounce");
+
+struct ReflectionSettings {
+    // number of mirror bounces after the primary hit
+    int maxDepth = 10;
+    // a bounce whose contribution to the pixel is scaled below this is not traced; its radiance is
+    // taken as black, which changes the pixel by less than minThroughput * 255 (0 traces every bounce)
+    float minThroughput = 0.5f / 255.0f;
+};
+
+// Phong shading with mirror reflections, evaluated iteratively.
+// the reflection chain is first traced forward into a fixed-size stack (hit and direct lighting of
+// every bounce, from its selected and shadow tested lights), then shaded back to front: every reflecting
+// surface uses the radiance of the bounce behind it as its color, or its own color if that bounce
+// left the scene or exceeded the depth limit. the throughput of the chain (ambient plus unshadowed
+// diffuse factor of every reflecting surface on the way) bounds how much a deeper bounce can still
+// change the pixel. textures are filtered over the pixel's ray cone, which widens by pixelSpread per
+// unit of path length (0 samples them at a point).
+class ReflectionIntegrator {
+public:
+    ReflectionIntegrator(const Scene& scn, const LightSampler& lightSampler, const ReflectionSettings& config = ReflectionSettings(),
+                         float spreadAngle = 0.0f)
+        : scene(scn), lights(lightSampler), settings(config), pixelSpread(spreadAngle) {
+        settings.maxDepth = glm::clamp(settings.maxDepth, 0, MaxReflectionDepth);
+    };
+
+    // color of a primary hit
+    glm::vec3 shade(const Ray& ray, uint32_t primId, const glm::vec3& intersectPos, const glm::vec3& normal) const {
+        return withMaterialFeatures(materialFeatures(scene.material(primId)), [&](auto features) {
+            return shade<decltype(features)::value>(ray, primId, intersectPos, normal);
+        });
+    };
+
+    // same, compiled for the features of the primary hit's material
+    template<uint32_t Features>
+    glm::vec3 shade(const Ray& ray, uint32_t primId, const glm::vec3& intersectPos, const glm::vec3& normal) const {
+        LightSelection selection;
+        lights.select(intersectPos, selection);
+        traceShadows(scene, primId, intersectPos, selection);
+        return shade<Features>(ray, primId, intersectPos, normal, selection);
+    };
+
+    // same, with the lights of the primary hit already selected and shadow tested by the caller
+    glm::vec3 shade(const Ray& ray, uint32_t primId, const glm::vec3& intersectPos, const glm::vec3& normal,
+                    const LightSelection& selection) const {
+        return withMaterialFeatures(materialFeatures(scene.material(primId)), [&](auto features) {
+            return shade<decltype(features)::value>(ray, primId, intersectPos, normal, selection);
+        });
+    };
+
+    template<uint32_t Features>
+    glm::vec3 shade(const Ray& ray, uint32_t primId, const glm::vec3& intersectPos, const glm::vec3& normal,
+                    const LightSelection& selection) const {
+        if constexpr ((Features & ReflectiveFeature) == 0) {
+            // no chain to trace
+            profileDepth(0);
+            const Material& mat = scene.material(primId);
+            glm::vec3 k = surfaceColor(scene, mat, primId, intersectPos, pixelSpread * glm::distance(ray.origin(), intersectPos));
+            return phongShading<Features>(mat, phongLighting<Features, true>(mat, intersectPos, normal, ray, selection), k, k);
+        }
+
+        Bounce stack[MaxReflectionDepth + 1];
+        int n = 0;
+        push(stack, n, primId, intersectPos, normal, ray.direction(), ray.origin(), glm::distance(ray.origin(), intersectPos), selection);
+
+        // trace the chain forward
+        float throughput = 1.0f;
+        bool truncated = false;
+        while (stack[n - 1].mat->reflect && n <= settings.maxDepth) {
+            const Bounce& b = stack[n - 1];
+            throughput *= b.mat->ambient + diffuseFactor(b);
+            if (throughput < settings.minThroughput) {
+                truncated = true;
+                break;
+            }
+
+            glm::vec3 reflectedRay = glm::normalize(glm::reflect(b.dir, b.normal));
+            threadRayCounts().reflection++;
+            Hit next = scene.intersect(b.pos, reflectedRay, -FLT_EPSILON, b.primId);
+            FootprintRecorder& footprint = threadFootprint();
+            if (next.primId == NoHit) {
+                if (footprint.active) footprint.unbounded();
+                break;
+            }
+
+            glm::vec3 nextPos;
+            glm::vec3 nextNormal;
+            scene.attributes(b.pos, reflectedRay, next, nextPos, nextNormal);
+            // the view point of a bounce is the origin of the ray that led to its parent
+            glm::vec3 eye = n >= 2 ? stack[n - 2].pos : ray.origin();
+            LightSelection nextLights;
+            lights.select(nextPos, nextLights);
+            traceShadows(scene, next.primId, nextPos, nextLights);
+            if (footprint.active) {
+                footprint.touch(next.primId);
+                footprint.segment(b.pos, nextPos);
+                for (int i = 0; i < nextLights.count; ++i) footprint.segment(nextPos, nextLights.position[i]);
+            }
+            push(stack, n, next.primId, nextPos, nextNormal, reflectedRay, eye, b.distance + next.t, nextLights);
+        }
+
+        // shade back to front
+        glm::vec3 radiance(0.0f, 0.0f, 0.0f);
+        bool valid = truncated;
+        for (int i = n - 1; i >= 0; --i) {
+            const Bounce& b = stack[i];
+            profileDepth(i);
+            glm::vec3 k = (b.mat->reflect && valid) ? radiance : surfaceColor(scene, *b.mat, b.primId, b.pos, pixelSpread * b.distance);
+            radiance = withMaterialFeatures(b.features, [&](auto features) {
+                return phongShading<decltype(features)::value>(*b.mat, b.lighting, k, k);
+            });
+            valid = true;
+        }
+        return radiance;
+    };
+
+private:
+    struct Bounce {
+        uint32_t primId;
+        const Material* mat;
+        uint32_t features; // of mat
+        glm::vec3 pos;
+        glm::vec3 normal;
+        glm::vec3 dir; // direction of the ray that hit pos
+        float distance; // length of the path from the camera to pos
+        PhongLighting lighting;
+    };
+
+    // eye is the view point used for the specular term
+    void push(Bounce* stack, int& n, uint32_t primId, const glm::vec3& pos, const glm::vec3& normal,
+              const glm::vec3& dir, const glm::vec3& eye, float distance, const LightSelection& selection) const {
+        Bounce& b = stack[n++];
+        b.primId = primId;
+        b.mat = &scene.material(primId);
+        b.features = materialFeatures(*b.mat);
+        b.pos = pos;
+        b.normal = normal;
+        b.dir = dir;
+        b.distance = distance;
+        b.lighting = withMaterialFeatures(b.features, [&](auto features) {
+            return phongLighting<decltype(features)::value, true>(*b.mat, pos, normal, Ray(eye, dir), selection);
+        });
+    };
+
+    // diffuse factor of the visible lights, in the strongest channel
+    static float diffuseFactor(const Bounce& b) {
+        return std::max(std::max(b.lighting.diffuse.x, b.lighting.diffuse.y), b.lighting.diffuse.z);
+    };
+
+    const Scene& scene;
+    const LightSampler& lights;
+    ReflectionSettings settings;
+    float pixelSpread; // widening of the ray cone per unit of path length
+};
+
+#endif
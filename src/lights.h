@@ -0,0 +1,329 @@
+#ifndef LIGHTS_H_
+#define LIGHTS_H_
+
+#include <glm/glm.hpp>
+#include <glm/vec3.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+#include "aabb.h"
+#include "array.h"
+
+// point or area light. intensity 1 is the assignment light; range is the distance at which the
+// intensity has fallen to half (inverse square further out), infinite for no falloff at all.
+// area lights are parallelograms position + s*edgeU + t*edgeV emitting to the side of
+// cross(edgeU, edgeV), intensity is their total; point lights have zero edges
+struct Light {
+    glm::vec3 position;
+    glm::vec3 intensity;
+    glm::vec3 edgeU;
+    glm::vec3 edgeV;
+    float range;
+
+    bool isArea() const { return edgeU != glm::vec3(0.0f) || edgeV != glm::vec3(0.0f); };
+};
+
+// falloff of a light with the given range at squared distance d2
+inline float lightAttenuation(float range, float d2) {
+    if (range == std::numeric_limits<float>::infinity()) return 1.0f;
+    return range * range / (range * range + d2);
+}
+
+// the lights of a scene and a tree over them for importance sampled light selection.
+// the tree is stored like the scene BVH (flat, depth-first, the left child follows its parent) and
+// built by splitting the lights at the median of their widest axis, so it is balanced. every node
+// stores the bounds, total power and largest range of its lights, so a shading point can estimate
+// how much a subtree can contribute; sample() walks down choosing children in proportion to that
+// estimate, which costs O(log n) per selected light and favours bright lights close to the point.
+class LightSet {
+public:
+    uint32_t addPoint(const glm::vec3& position, const glm::vec3& intensity = glm::vec3(1.0f, 1.0f, 1.0f),
+                      float range = std::numeric_limits<float>::infinity()) {
+        return addArea(position, glm::vec3(0.0f), glm::vec3(0.0f), intensity, range);
+    };
+    uint32_t addArea(const glm::vec3& corner, const glm::vec3& edgeU, const glm::vec3& edgeV,
+                     const glm::vec3& intensity = glm::vec3(1.0f, 1.0f, 1.0f),
+                     float range = std::numeric_limits<float>::infinity()) {
+        Light light;
+        light.position = corner;
+        light.intensity = intensity;
+        light.edgeU = edgeU;
+        light.edgeV = edgeV;
+        light.range = range;
+        lights.push_back(light);
+        return uint32_t(lights.size() - 1);
+    };
+    void clear() {
+        lights.clear();
+        nodes.clear();
+    };
+
+    // builds the selection tree; needed after adding lights
+    void commit() {
+        std::vector<uint32_t> order(lights.size());
+        for (uint32_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::vector<Node> tree;
+        tree.reserve(2 * order.size());
+        if (!order.empty()) buildNode(tree, order, 0, order.size());
+        nodes.assign(std::move(tree));
+    };
+
+    size_t size() const { return lights.size(); };
+    bool empty() const { return lights.empty(); };
+    const Light& operator[](size_t i) const { return lights[i]; };
+
+    // choose count lights for shading point p, one for each of the ascending numbers u in [0, 1)
+    // (overwritten); chosen and pmf receive the lights and the probabilities of choosing them. the
+    // numbers go down the tree together, so the levels they share are only evaluated once
+    void sample(const glm::vec3& p, float* u, int count, uint32_t* chosen, float* pmf) const {
+        descend(0, p, u, count, 1.0f, chosen, pmf);
+    };
+
+    // point on light i for the sample (s, t) in [0, 1)^2 and the light's intensity arriving from it at p
+    glm::vec3 samplePoint(uint32_t i, const glm::vec3& p, float s, float t, glm::vec3& intensity) const {
+        const Light& light = lights[i];
+        glm::vec3 point = light.position + s * light.edgeU + t * light.edgeV;
+        glm::vec3 toPoint = p - point;
+        float d2 = glm::dot(toPoint, toPoint);
+        intensity = light.intensity * lightAttenuation(light.range, d2);
+        if (light.isArea()) {
+            glm::vec3 n = glm::cross(light.edgeU, light.edgeV);
+            float len = glm::length(n);
+            float cosine = (len > 0.0f && d2 > 0.0f) ? glm::dot(n, toPoint) / (len * std::sqrt(d2)) : 0.0f;
+            intensity *= std::max(cosine, 0.0f);
+        }
+        return point;
+    };
+
+    // the light and tree arrays, in a fixed order (used by the scene cache)
+    template<typename Visitor>
+    void visitArrays(Visitor&& visit) {
+        visit(lights);
+        visit(nodes);
+    };
+
+    // the tree is one over all the lights that sample() can walk safely (it may come from a corrupt
+    // scene cache): subtrees are contiguous node ranges no deeper than the traversal ever needs and
+    // the leaves name existing lights
+    bool valid() const {
+        if (lights.empty() || nodes.size() != 2 * lights.size() - 1) return lights.empty() && nodes.empty();
+        struct Range {
+            uint32_t index, end;
+            int depth;
+        };
+        std::vector<Range> pending(1, Range{0, uint32_t(nodes.size()), 0});
+        while (!pending.empty()) {
+            Range r = pending.back();
+            pending.pop_back();
+            const Node& node = nodes[r.index];
+            // a median split tree over 2^32 lights is 32 levels deep
+            if (r.depth > 64) return false;
+            if (node.right == 0) {
+                if (r.end != r.index + 1 || node.light >= lights.size()) return false;
+                continue;
+            }
+            if (node.right <= r.index + 1 || node.right >= r.end) return false;
+            pending.push_back({r.index + 1, node.right, r.depth + 1});
+            pending.push_back({node.right, r.end, r.depth + 1});
+        }
+        return true;
+    };
+
+private:
+    struct Node {
+        glm::vec3 bmin;
+        uint32_t right;  // inner node: index of the right child, 0 for leaves
+        glm::vec3 bmax;
+        uint32_t light;  // leaf: the light
+        float power;     // summed over the subtree
+        float rangeSq;   // square of the largest range in the subtree
+    };
+
+    static constexpr float OneMinusEpsilon = 0x1.fffffep-1f;
+
+    static float power(const Light& light) {
+        return (light.intensity.x + light.intensity.y + light.intensity.z) / 3.0f;
+    };
+
+    AABB bounds(const Light& light) const {
+        AABB box(light.position, light.position);
+        box.grow(light.position + light.edgeU);
+        box.grow(light.position + light.edgeV);
+        box.grow(light.position + light.edgeU + light.edgeV);
+        return box;
+    };
+
+    // upper estimate of the light reaching p from the node: its power at the closest point of its
+    // bounds, as the fraction num / den (so choosing between two nodes needs a single division)
+    static void importance(const Node& node, const glm::vec3& p, float& num, float& den) {
+        if (node.rangeSq == std::numeric_limits<float>::infinity()) {
+            num = node.power;
+            den = 1.0f;
+            return;
+        }
+        glm::vec3 d = glm::max(glm::max(node.bmin - p, p - node.bmax), glm::vec3(0.0f));
+        num = node.power * node.rangeSq;
+        den = node.rangeSq + glm::dot(d, d);
+    };
+
+    void descend(uint32_t index, const glm::vec3& p, float* u, int count, float pmf, uint32_t* chosen, float* pmfs) const {
+        const Node& node = nodes[index];
+        if (node.right == 0) {
+            for (int i = 0; i < count; ++i) {
+                chosen[i] = node.light;
+                pmfs[i] = pmf;
+            }
+            return;
+        }
+        float numL, denL, numR, denR;
+        importance(nodes[index + 1], p, numL, denL);
+        importance(nodes[node.right], p, numR, denR);
+        float wl = numL * denR;
+        float wr = numR * denL;
+        float pl = (wl + wr) > 0.0f ? wl / (wl + wr) : 0.5f;
+        // u is ascending: the first nl numbers go left, each rescaled to [0, 1) within its side
+        int nl = 0;
+        while (nl < count && u[nl] < pl) {
+            u[nl] = std::min(u[nl] / pl, OneMinusEpsilon);
+            nl++;
+        }
+        for (int i = nl; i < count; ++i) u[i] = std::min((u[i] - pl) / (1.0f - pl), OneMinusEpsilon);
+        if (nl > 0) descend(index + 1, p, u, nl, pmf * pl, chosen, pmfs);
+        if (nl < count) descend(node.right, p, u + nl, count - nl, pmf * (1.0f - pl), chosen + nl, pmfs + nl);
+    };
+
+    uint32_t buildNode(std::vector<Node>& tree, std::vector<uint32_t>& order, size_t begin, size_t end) const {
+        uint32_t index = uint32_t(tree.size());
+        tree.push_back(Node());
+
+        AABB box;
+        AABB centroidBox;
+        float total = 0.0f;
+        float range = 0.0f;
+        for (size_t i = begin; i < end; ++i) {
+            const Light& light = lights[order[i]];
+            AABB b = bounds(light);
+            box.grow(b);
+            centroidBox.grow(b.centroid());
+            total += power(light);
+            range = std::max(range, light.range);
+        }
+        tree[index].bmin = box.bmin;
+        tree[index].bmax = box.bmax;
+        tree[index].power = total;
+        tree[index].rangeSq = range * range;
+        tree[index].right = 0;
+        tree[index].light = order[begin];
+        if (end - begin == 1) return index;
+
+        // median along the widest centroid axis
+        glm::vec3 extent = centroidBox.bmax - centroidBox.bmin;
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        size_t split = begin + (end - begin) / 2;
+        std::nth_element(order.begin() + begin, order.begin() + split, order.begin() + end, [&](uint32_t a, uint32_t b) {
+            return bounds(lights[a]).centroid()[axis] < bounds(lights[b]).centroid()[axis];
+        });
+
+        buildNode(tree, order, begin, split);
+        tree[index].right = buildNode(tree, order, split, end);
+        return index;
+    };
+
+    Array<Light> lights;
+    Array<Node> nodes;
+};
+
+// upper bound for the lights evaluated per shading point
+static const int MaxLightSamples = 8;
+
+// the lights chosen for one shading point: a point on each (sampled on area lights), the intensity
+// arriving from it already divided by the probability of the choice, and whether it is unoccluded.
+// filled by LightSampler::select(), left uninitialized before
+struct LightSelection {
+    int count;
+    glm::vec3 position[MaxLightSamples];
+    glm::vec3 intensity[MaxLightSamples];
+    bool visible[MaxLightSamples];
+};
+
+// picks the lights a shading point evaluates. with at most `budget` lights every light is taken
+// (exact, a point light always at full weight); with more, `budget` lights are drawn from the light
+// tree with stratified numbers, so the shadow rays per point stay bounded however many lights the
+// scene has. the random numbers are hashed from the shading position, so the result is
+// deterministic and every sample of a supersampled pixel gets fresh ones
+class LightSampler {
+public:
+    LightSampler(const LightSet& lightSet, int lightBudget)
+        : lights(lightSet), budget(glm::clamp(lightBudget, 1, MaxLightSamples)) {
+        for (size_t i = 0; i < lights.size(); ++i) hasArea = hasArea || lights[i].isArea();
+    }
+
+    void select(const glm::vec3& p, LightSelection& selection) const {
+        selection.count = 0;
+        bool exact = lights.size() <= size_t(budget);
+        // the point lights of an exact selection need no random numbers
+        uint32_t h = (hasArea || !exact) ? hashPoint(p) : 0;
+        if (exact) {
+            for (uint32_t i = 0; i < lights.size(); ++i) add(selection, i, p, 1.0f, h);
+            return;
+        }
+        // one stratified number per selected light
+        float offset = unitFloat(h);
+        float u[MaxLightSamples];
+        uint32_t chosen[MaxLightSamples];
+        float pmf[MaxLightSamples];
+        for (int k = 0; k < budget; ++k) u[k] = (float(k) + offset) / float(budget);
+        lights.sample(p, u, budget, chosen, pmf);
+        for (int k = 0; k < budget; ++k) add(selection, chosen[k], p, 1.0f / (float(budget) * pmf[k]), h);
+    };
+
+    const LightSet& Lights() const { return lights; };
+    int Budget() const { return budget; };
+
+private:
+    void add(LightSelection& selection, uint32_t i, const glm::vec3& p, float weight, uint32_t& h) const {
+        int n = selection.count++;
+        float s = 0.0f;
+        float t = 0.0f;
+        if (lights[i].isArea()) {
+            h = mix(h + 0x9e3779b9u);
+            s = unitFloat(h);
+            h = mix(h + 0x9e3779b9u);
+            t = unitFloat(h);
+        }
+        glm::vec3 intensity;
+        selection.position[n] = lights.samplePoint(i, p, s, t, intensity);
+        selection.intensity[n] = weight == 1.0f ? intensity : intensity * weight;
+        selection.visible[n] = true;
+    };
+
+    static uint32_t mix(uint32_t h) {
+        h ^= h >> 16;
+        h *= 0x85ebca6bu;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35u;
+        h ^= h >> 16;
+        return h;
+    };
+
+    static uint32_t hashPoint(const glm::vec3& p) {
+        uint32_t h = 0;
+        for (int i = 0; i < 3; ++i) {
+            uint32_t bits;
+            std::memcpy(&bits, &p[i], sizeof(bits));
+            h = mix(h ^ bits);
+        }
+        return h;
+    };
+
+    static float unitFloat(uint32_t h) { return float(h >> 8) * (1.0f / 16777216.0f); };
+
+    const LightSet& lights;
+    int budget;
+    bool hasArea = false;
+};
+
+#endif
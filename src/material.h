@@ -0,0 +1,27 @@
+#ifndef MATERIAL_H_
+#define MATERIAL_H_
+
+#include <glm/glm.hpp>
+#include <glm/vec3.hpp>
+#include <cstdint>
+
+static const uint32_t NoTexture = 0xffffffffu;
+
+// surface parameters, stored once per material in the scene's material table and referenced by index
+struct Material {
+    Material() {}
+    Material(glm::vec3 col, bool reflecting = false, float ambientFactor = 0.2f, float specExponent = 50.0f)
+        : color(col), ambient(ambientFactor), specularEx(specExponent), reflect(reflecting) {}
+
+    // object color
+    glm::vec3 color = glm::vec3(1.0f, 1.0f, 1.0f);
+    // basic material parameters; a specular exponent <= 0 means no highlight
+    float ambient = 0.2f;
+    float specularEx = 50.0f;
+    // is this material reflecting?
+    bool reflect = false;
+    // index in the scene's texture table, its color multiplies the object color
+    uint32_t texture = NoTexture;
+};
+
+#endif
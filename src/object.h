@@ -17,10 +17,10 @@ public:
 	// PURE VIRTUAL FUNCTION: has to be implemented in all child classes.
 	virtual float intersect(const glm::vec3& rayOrigin, const glm::vec3& rayDir, glm::vec3& intersectPos, glm::vec3& normal) = 0;
 
-	const glm::vec3& Color() { return color; };
-	float AmbientFactor() { return ambient; };
-	float SpecularExponent() { return specularEx; };
-	bool Reflect() { return reflect; };
+	const glm::vec3& Color() const { return color; };
+	float AmbientFactor() const { return ambient; };
+	float SpecularExponent() const { return specularEx; };
+	bool Reflect() const { return reflect; };
 
 private:
 	// object color
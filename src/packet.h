@@ -0,0 +1,248 @@
+#ifndef PACKET_H_
+#define PACKET_H_
+
+#include <glm/glm.hpp>
+#include <glm/vec3.hpp>
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RAYTRACER_X86 1
+#include <immintrin.h>
+#endif
+
+// packets hold up to 16 coherent rays in structure-of-arrays layout
+static const int MaxPacketSize = 16;
+
+struct alignas(64) RayPacket {
+    float ox[MaxPacketSize], oy[MaxPacketSize], oz[MaxPacketSize];
+    float dx[MaxPacketSize], dy[MaxPacketSize], dz[MaxPacketSize];
+    int size = 0;
+
+    void set(int lane, const glm::vec3& origin, const glm::vec3& dir) {
+        ox[lane] = origin.x; oy[lane] = origin.y; oz[lane] = origin.z;
+        dx[lane] = dir.x; dy[lane] = dir.y; dz[lane] = dir.z;
+    };
+    glm::vec3 origin(int lane) const { return glm::vec3(ox[lane], oy[lane], oz[lane]); };
+    glm::vec3 direction(int lane) const { return glm::vec3(dx[lane], dy[lane], dz[lane]); };
+};
+
+// instruction set used by the packet kernels, picked once at startup from the CPU features
+enum class SimdLevel { Scalar = 0, SSE = 1, AVX2 = 2 };
+
+inline SimdLevel detectSimd() {
+#if defined(RAYTRACER_X86) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+    if (__builtin_cpu_supports("sse2")) return SimdLevel::SSE;
+#endif
+    return SimdLevel::Scalar;
+}
+
+// active level; may be lowered (e.g. to compare against the scalar path) but never raised above detectSimd()
+inline SimdLevel& simdLevel() {
+    static SimdLevel level = detectSimd();
+    return level;
+}
+
+inline const char* simdName(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::AVX2: return "avx2";
+        case SimdLevel::SSE: return "sse";
+        default: return "scalar";
+    }
+}
+
+// All kernels write the ray parameter of every lane to dist (negative or NaN: no hit) and evaluate
+// in exactly the same operation order as Sphere::intersect and Plane::intersect, without FMA,
+// so the packet results match the scalar path bit for bit.
+
+// single ray kernels, distance only
+inline float sphereDistance(const glm::vec3& rayOrigin, const glm::vec3& rayDir, const glm::vec3& center, float radius) {
+    glm::vec3 oc = rayOrigin - center;
+    float a = glm::dot(rayDir, rayDir);
+    float b = 2.0f * glm::dot(oc, rayDir);
+    float c = glm::dot(oc, oc) - radius*radius;
+    float discriminant = b*b - 4*a*c;
+    if (discriminant < 0) return -1.0f;
+    return (-b - std::sqrt(discriminant))/(2*a);
+}
+
+inline float planeDistance(const glm::vec3& rayOrigin, const glm::vec3& rayDir, const glm::vec3& normal, const glm::vec3& point) {
+    float dn = glm::dot(rayDir, normal);
+    if (dn == 0) return -1.0f;
+    float dist_ = (glm::dot(point - rayOrigin, normal))/dn;
+    if (dist_ < 0) return -1.0f;
+    return dist_;
+}
+
+// watertight ray/triangle test (Woop, Benthin and Wald 2013): the triangle is sheared into a space
+// where the ray runs along +z from the origin, so the edge tests of triangles sharing an edge are
+// evaluated on exactly the same values and no ray slips through between them. b1 and b2 (optional)
+// receive the barycentric weights of v1 and v2. both sides are hit.
+inline float triangleDistance(const glm::vec3& rayOrigin, const glm::vec3& rayDir, const glm::vec3& v0,
+                              const glm::vec3& v1, const glm::vec3& v2, float* b1 = nullptr, float* b2 = nullptr) {
+    // dominant axis of the direction becomes z, winding is kept by swapping x and y for negative z
+    glm::vec3 ad = glm::abs(rayDir);
+    int kz = ad.x > ad.y ? (ad.x > ad.z ? 0 : 2) : (ad.y > ad.z ? 1 : 2);
+    int kx = kz == 2 ? 0 : kz + 1;
+    int ky = kx == 2 ? 0 : kx + 1;
+    if (rayDir[kz] < 0.0f) std::swap(kx, ky);
+    float sx = rayDir[kx] / rayDir[kz];
+    float sy = rayDir[ky] / rayDir[kz];
+    float sz = 1.0f / rayDir[kz];
+
+    glm::vec3 a = v0 - rayOrigin;
+    glm::vec3 b = v1 - rayOrigin;
+    glm::vec3 c = v2 - rayOrigin;
+    float ax = a[kx] - sx*a[kz], ay = a[ky] - sy*a[kz];
+    float bx = b[kx] - sx*b[kz], by = b[ky] - sy*b[kz];
+    float cx = c[kx] - sx*c[kz], cy = c[ky] - sy*c[kz];
+
+    // scaled barycentrics, recomputed in double precision when the ray runs exactly through an edge
+    float u = cx*by - cy*bx;
+    float v = ax*cy - ay*cx;
+    float w = bx*ay - by*ax;
+    if (u == 0.0f || v == 0.0f || w == 0.0f) {
+        u = float(double(cx)*double(by) - double(cy)*double(bx));
+        v = float(double(ax)*double(cy) - double(ay)*double(cx));
+        w = float(double(bx)*double(ay) - double(by)*double(ax));
+    }
+    if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f)) return -1.0f;
+    float det = u + v + w;
+    if (det == 0.0f) return -1.0f;
+
+    float t = (u*(sz*a[kz]) + v*(sz*b[kz]) + w*(sz*c[kz])) / det;
+    if (b1) *b1 = v / det;
+    if (b2) *b2 = w / det;
+    return t;
+}
+
+// scalar fallback for lanes [begin, size)
+inline void intersectSphereScalar(const RayPacket& p, int begin, const glm::vec3& center, float radius, float* dist) {
+    for (int l = begin; l < p.size; ++l) dist[l] = sphereDistance(p.origin(l), p.direction(l), center, radius);
+}
+
+inline void intersectPlaneScalar(const RayPacket& p, int begin, const glm::vec3& normal, const glm::vec3& point, float* dist) {
+    for (int l = begin; l < p.size; ++l) dist[l] = planeDistance(p.origin(l), p.direction(l), normal, point);
+}
+
+#ifdef RAYTRACER_X86
+
+// SSE2: 4 lanes per iteration starting at lane begin, returns the first lane not handled
+inline int intersectSphereSSE(const RayPacket& p, int begin, const glm::vec3& center, float radius, float* dist) {
+    const __m128 cx = _mm_set1_ps(center.x), cy = _mm_set1_ps(center.y), cz = _mm_set1_ps(center.z);
+    const __m128 rr = _mm_set1_ps(radius*radius);
+    const __m128 two = _mm_set1_ps(2.0f), four = _mm_set1_ps(4.0f), miss = _mm_set1_ps(-1.0f);
+    const __m128 sign = _mm_set1_ps(-0.0f), zero = _mm_setzero_ps();
+    int l = begin;
+    for (; l + 4 <= p.size; l += 4) {
+        __m128 dx = _mm_load_ps(p.dx + l), dy = _mm_load_ps(p.dy + l), dz = _mm_load_ps(p.dz + l);
+        __m128 ocx = _mm_sub_ps(_mm_load_ps(p.ox + l), cx);
+        __m128 ocy = _mm_sub_ps(_mm_load_ps(p.oy + l), cy);
+        __m128 ocz = _mm_sub_ps(_mm_load_ps(p.oz + l), cz);
+        __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        __m128 b = _mm_mul_ps(two, _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz)));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), rr);
+        __m128 disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(_mm_mul_ps(four, a), c));
+        __m128 t = _mm_div_ps(_mm_sub_ps(_mm_xor_ps(b, sign), _mm_sqrt_ps(disc)), _mm_mul_ps(two, a));
+        __m128 hit = _mm_cmpge_ps(disc, zero);
+        _mm_storeu_ps(dist + l, _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, miss)));
+    }
+    return l;
+}
+
+inline int intersectPlaneSSE(const RayPacket& p, int begin, const glm::vec3& normal, const glm::vec3& point, float* dist) {
+    const __m128 nx = _mm_set1_ps(normal.x), ny = _mm_set1_ps(normal.y), nz = _mm_set1_ps(normal.z);
+    const __m128 px = _mm_set1_ps(point.x), py = _mm_set1_ps(point.y), pz = _mm_set1_ps(point.z);
+    const __m128 zero = _mm_setzero_ps(), miss = _mm_set1_ps(-1.0f);
+    int l = begin;
+    for (; l + 4 <= p.size; l += 4) {
+        __m128 dn = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_load_ps(p.dx + l), nx), _mm_mul_ps(_mm_load_ps(p.dy + l), ny)),
+                               _mm_mul_ps(_mm_load_ps(p.dz + l), nz));
+        __m128 pox = _mm_sub_ps(px, _mm_load_ps(p.ox + l));
+        __m128 poy = _mm_sub_ps(py, _mm_load_ps(p.oy + l));
+        __m128 poz = _mm_sub_ps(pz, _mm_load_ps(p.oz + l));
+        __m128 t = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(pox, nx), _mm_mul_ps(poy, ny)), _mm_mul_ps(poz, nz)), dn);
+        __m128 reject = _mm_or_ps(_mm_cmpeq_ps(dn, zero), _mm_cmplt_ps(t, zero));
+        _mm_storeu_ps(dist + l, _mm_or_ps(_mm_andnot_ps(reject, t), _mm_and_ps(reject, miss)));
+    }
+    return l;
+}
+
+// AVX2: 8 lanes per iteration (FMA is deliberately not used)
+__attribute__((target("avx2")))
+inline int intersectSphereAVX2(const RayPacket& p, int begin, const glm::vec3& center, float radius, float* dist) {
+    const __m256 cx = _mm256_set1_ps(center.x), cy = _mm256_set1_ps(center.y), cz = _mm256_set1_ps(center.z);
+    const __m256 rr = _mm256_set1_ps(radius*radius);
+    const __m256 two = _mm256_set1_ps(2.0f), four = _mm256_set1_ps(4.0f), miss = _mm256_set1_ps(-1.0f);
+    const __m256 sign = _mm256_set1_ps(-0.0f), zero = _mm256_setzero_ps();
+    int l = begin;
+    for (; l + 8 <= p.size; l += 8) {
+        __m256 dx = _mm256_load_ps(p.dx + l), dy = _mm256_load_ps(p.dy + l), dz = _mm256_load_ps(p.dz + l);
+        __m256 ocx = _mm256_sub_ps(_mm256_load_ps(p.ox + l), cx);
+        __m256 ocy = _mm256_sub_ps(_mm256_load_ps(p.oy + l), cy);
+        __m256 ocz = _mm256_sub_ps(_mm256_load_ps(p.oz + l), cz);
+        __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+        __m256 b = _mm256_mul_ps(two, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)),
+                                                    _mm256_mul_ps(ocz, dz)));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)),
+                                               _mm256_mul_ps(ocz, ocz)), rr);
+        __m256 disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(_mm256_mul_ps(four, a), c));
+        __m256 t = _mm256_div_ps(_mm256_sub_ps(_mm256_xor_ps(b, sign), _mm256_sqrt_ps(disc)), _mm256_mul_ps(two, a));
+        __m256 hit = _mm256_cmp_ps(disc, zero, _CMP_GE_OQ);
+        _mm256_storeu_ps(dist + l, _mm256_blendv_ps(miss, t, hit));
+    }
+    return l;
+}
+
+__attribute__((target("avx2")))
+inline int intersectPlaneAVX2(const RayPacket& p, int begin, const glm::vec3& normal, const glm::vec3& point, float* dist) {
+    const __m256 nx = _mm256_set1_ps(normal.x), ny = _mm256_set1_ps(normal.y), nz = _mm256_set1_ps(normal.z);
+    const __m256 px = _mm256_set1_ps(point.x), py = _mm256_set1_ps(point.y), pz = _mm256_set1_ps(point.z);
+    const __m256 zero = _mm256_setzero_ps(), miss = _mm256_set1_ps(-1.0f);
+    int l = begin;
+    for (; l + 8 <= p.size; l += 8) {
+        __m256 dn = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(p.dx + l), nx),
+                                                _mm256_mul_ps(_mm256_load_ps(p.dy + l), ny)),
+                                  _mm256_mul_ps(_mm256_load_ps(p.dz + l), nz));
+        __m256 pox = _mm256_sub_ps(px, _mm256_load_ps(p.ox + l));
+        __m256 poy = _mm256_sub_ps(py, _mm256_load_ps(p.oy + l));
+        __m256 poz = _mm256_sub_ps(pz, _mm256_load_ps(p.oz + l));
+        __m256 t = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(pox, nx), _mm256_mul_ps(poy, ny)),
+                                               _mm256_mul_ps(poz, nz)), dn);
+        __m256 reject = _mm256_or_ps(_mm256_cmp_ps(dn, zero, _CMP_EQ_OQ), _mm256_cmp_ps(t, zero, _CMP_LT_OQ));
+        _mm256_storeu_ps(dist + l, _mm256_blendv_ps(t, miss, reject));
+    }
+    return l;
+}
+
+#endif
+
+// triangles are tested lane by lane, the setup of the watertight test depends on the ray direction
+inline void intersectTrianglePacket(const RayPacket& p, const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2, float* dist) {
+    for (int l = 0; l < p.size; ++l) dist[l] = triangleDistance(p.origin(l), p.direction(l), v0, v1, v2);
+}
+
+// packet entry points: widest available kernel first, narrower kernels and the scalar loop mop up the tail
+inline void intersectSpherePacket(const RayPacket& p, const glm::vec3& center, float radius, float* dist) {
+    int l = 0;
+#ifdef RAYTRACER_X86
+    SimdLevel level = simdLevel();
+    if (level >= SimdLevel::AVX2) l = intersectSphereAVX2(p, l, center, radius, dist);
+    if (level >= SimdLevel::SSE) l = intersectSphereSSE(p, l, center, radius, dist);
+#endif
+    intersectSphereScalar(p, l, center, radius, dist);
+}
+
+inline void intersectPlanePacket(const RayPacket& p, const glm::vec3& normal, const glm::vec3& point, float* dist) {
+    int l = 0;
+#ifdef RAYTRACER_X86
+    SimdLevel level = simdLevel();
+    if (level >= SimdLevel::AVX2) l = intersectPlaneAVX2(p, l, normal, point, dist);
+    if (level >= SimdLevel::SSE) l = intersectPlaneSSE(p, l, normal, point, dist);
+#endif
+    intersectPlaneScalar(p, l, normal, point, dist);
+}
+
+#endif
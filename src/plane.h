@@ -34,6 +34,9 @@ public:
         return dist_;
     };
 
+    const glm::vec3& Normal() const { return planeNormal; };
+    const glm::vec3& Point() const { return planePoint; };
+
 private:
     glm::vec3 planeNormal;
     glm::vec3 planePoint;
@@ -3,450 +3,268 @@
 #include <fstream>
 #include <cstdio>
 #include <cmath>
+#include <cstdlib>
 #include <vector>
 #include <chrono>
 #include <string>
+#include <sstream>
 
 #include <glm/glm.hpp>
 #include <glm/vec3.hpp>
 
-#include "object.h"
-#include "sphere.h"
-#include "plane.h"
 #include "ray.h"
-
-
-#include "glm/gtx/string_cast.hpp"
-
-
-// write PPM image file (input parameters: image width in px, image height in px, image data (vector of uint8 vec3), filename)
-bool writeP6PPM(unsigned int dX, unsigned int dY, std::vector<glm::u8vec3> img, std::string filename = "rtimage") {
-    // return false if image size does not fit data size
-    try {
-        if (img.size() != dX * dY) return false;
-        // PPM writing code adapted from: https://rosettacode.org/wiki/Bitmap/Write_a_PPM_file#C++
-        std::ofstream ofs(filename + ".ppm", std::ios_base::out | std::ios_base::binary);
-        if (ofs.fail()) return false;
-        ofs << "P6" << std::endl << dX << ' ' << dY << std::endl << "255" << std::endl;
-        for (unsigned int j = 0; j < dY; ++j)
-            for (unsigned int i = 0; i < dX; ++i)
-                ofs << img[j * dX + i].r << img[j * dX + i].g << img[j * dX + i].b;
-        ofs.close();
-    }
-    catch (const std::exception& e) {
-        // return false if an exception occurred
-        std::cerr << e.what() << std::endl;
-        return false;
-    }
-    return true;
-}
-
-// generate the correct RGB vector for Phong illumination model
-glm::vec3 phongShading(Object* obj, glm::vec3& intersectPos, glm::vec3& normal, Ray& ray,
-                       glm::vec3& light, glm::vec3 k_a, glm::vec3 k_d){
-    glm::vec3 res(0.0f, 0.0f, 0.0f);
-    float I_a = obj->AmbientFactor(); // ambient intensity
-//    glm::vec3 k_a = obj->Color()*255.0f; // ambient coefficients
-
-    float I_i = 1.0f; // light intensity
-//    glm::vec3 k_d = obj->Color()*255.0f; // diffuse coefficients
-
-    float n = obj->SpecularExponent(); // specular exponent/Phong exponent
-    glm::vec3 k_s(1.0f, 1.0f, 1.0f); // specular coefficient
-    k_s *= 255.0f;
-
-    glm::vec3 l = glm::normalize(light - intersectPos); // direction to light
-    // Ambient Component
-    res += I_a*k_a;
-
-    // Diffuse Component
-    float ln = glm::clamp(glm::dot(l,normal), .0f, 1.0f); // cosine
-    res += I_i*k_d*ln;
-
-    // Specular Reflection
-    glm::vec3 r = glm::normalize(2*ln*normal - l); // reflection ray
-    glm::vec3 v = glm::normalize(ray.orig - intersectPos); // direction to camera
-    float rv = glm::clamp(glm::dot(v, r), 0.0f, 1.0f);
-    res += I_i*k_s*float(pow(rv, n));
-
-    return glm::clamp(res, 0.0f, 255.0f);
-}
-
-// generate the correct RGB vector for shadow color
-glm::vec3 phongShadows(Object* obj, glm::vec3 k_a){
-    glm::vec3 res(0.0f, 0.0f, 0.0f);
-    float I_a = obj->AmbientFactor(); // ambient intensity
-//    glm::vec3 k_a = obj->Color()*255.0f; // ambient coefficients
-
-    // Ambient Component
-    res += I_a*k_a;
-
-    return glm::clamp(res, 0.0f, 255.0f);
-}
-// check whether there is an object intersected by the ray starting from the light to a point
-bool isIntersected(std::vector<Object*> objs, Object* obj,
-                   glm::vec3& intersectPosOnObj, glm::vec3& light){
-    glm::vec3 intersectPos;
-    glm::vec3 normal;
-
-    float distObjToLight = glm::distance(light, intersectPosOnObj);
-    glm::vec3 lightToObj = glm::normalize( intersectPosOnObj - light);
-
-    // loop through all other objects
-    // and check whether there is an object intersected in the middle by checking the distance
-    for(Object* currObj : objs){
-        if(currObj == obj) continue;
-
-        float dist_ = currObj->intersect(light, lightToObj, intersectPos, normal);
-
-        if(dist_ < 0) continue; // either -1(no interset) or behind the intersectPosOnObj point
-
-        if(dist_ <= distObjToLight){
-            return true;
+#include "scene.h"
+#include "image.h"
+#include "sceneio.h"
+#include "render.h"
+#include "distributed.h"
+#include "sequence.h"
+
+
+int main(int argc, char** argv) {
+    // render scheduler settings: --threads N (0 = all cores), --tile N (tile edge in px),
+    // --stats (per-thread timing and ray counts per part), --tile-stats (additionally list every tile)
+    // profiling (builds with -DRAYTRACER_PROFILE=ON): --stats adds BVH node visits, intersection tests,
+    // blocked shadow rays and path depths, --heatmap writes the traversal steps and intersection tests
+    // of every pixel of parts 2 to 6 as a false color image <part>_cost next to the part
+    // primary rays: --packet N (1 = one ray at a time, up to 16 rays per SIMD packet),
+    // --simd scalar|sse|avx2 (caps the detected instruction set), --samples N (rays per pixel)
+    // adaptive sampling: --adaptive X (stop sampling a pixel once the standard error of its color is
+    // below X, in the 0-1 range), --min-samples N (per round), --max-samples N, --time-budget MS (per part)
+    // camera: --aperture R --focus D (thin lens of radius R focused at distance D, needs several samples)
+    // lights: --light-samples N (lights and shadow rays per shading point, all lights if there are no more)
+    // reflections: --max-depth N (mirror bounces), --min-throughput X (0 traces every bounce),
+    // --no-wavefront (follow every path to its end instead of advancing a tile of paths together)
+    // output: --format ppm|png, --hdr (also write the reflection part as float PFM)
+    // --aov LIST renders the final scene once into the comma separated outputs flat, phong, shadows,
+    // reflections, depth, normal, id (or all) instead of the six parts, files are named aov_<output>;
+    // with --hdr every output is also written as PFM
+    // scene: --scene FILE renders a scene description (cached next to it as FILE.bin) instead of the
+    // built-in assignment scene, --no-cache always parses the text
+    // textures: --texture-cache MB is the memory for image texture tiles (64 by default), --stats
+    // reports its use
+    // animation: --sequence FILE renders the final image of every frame of a sequence of camera and
+    // sphere keys (see sequence.h) into frame_NNNN files, with the scene loaded once
+    // distributed: --distribute ADDR renders only the final image (part6_reflections) on worker
+    // processes; the coordinator listens on ADDR (host:port or unix:PATH) for --workers N of them,
+    // --spawn starts them on this machine, --job-tile N is the edge of the tiles handed out and
+    // --worker-timeout MS drops a worker silent for that long. --worker ADDR runs this process as a
+    // worker of the coordinator at ADDR, with its own --threads and --tile
+    RenderSettings settings;
+    std::string format = "ppm";
+    bool hdr = false;
+    bool heatmap = false;
+    std::string scenePath;
+    bool useCache = true;
+    float aperture = -1.0f;
+    float focusDistance = -1.0f;
+    std::vector<AOV> aovs;
+    std::string sequencePath;
+    std::string coordinatorAddress;
+    std::string workerAddress;
+    int workerCount = 1;
+    bool spawn = false;
+    Coordinator::Settings coordination;
+    for (int a = 1; a < argc; ++a) {
+        std::string arg = argv[a];
+        if (arg == "--threads" && a + 1 < argc) settings.threadCount = std::atoi(argv[++a]);
+        else if (arg == "--tile" && a + 1 < argc) settings.tileSize = std::atoi(argv[++a]);
+        else if (arg == "--packet" && a + 1 < argc) settings.packetSize = glm::clamp(std::atoi(argv[++a]), 1, MaxPacketSize);
+        else if (arg == "--simd" && a + 1 < argc) {
+            std::string name = argv[++a];
+            SimdLevel level = name == "avx2" ? SimdLevel::AVX2 : (name == "sse" ? SimdLevel::SSE : SimdLevel::Scalar);
+            if (level < simdLevel()) simdLevel() = level;
+        }
+        else if (arg == "--samples" && a + 1 < argc) settings.samples = std::max(1, std::atoi(argv[++a]));
+        else if (arg == "--adaptive" && a + 1 < argc) settings.adaptiveThreshold = float(std::atof(argv[++a]));
+        else if (arg == "--min-samples" && a + 1 < argc) settings.minSamples = std::max(2, std::atoi(argv[++a]));
+        else if (arg == "--max-samples" && a + 1 < argc) settings.maxSamples = std::max(1, std::atoi(argv[++a]));
+        else if (arg == "--time-budget" && a + 1 < argc) settings.timeBudgetMs = std::atof(argv[++a]);
+        else if (arg == "--aperture" && a + 1 < argc) aperture = float(std::atof(argv[++a]));
+        else if (arg == "--focus" && a + 1 < argc) focusDistance = float(std::atof(argv[++a]));
+        else if (arg == "--light-samples" && a + 1 < argc) settings.lightSamples = glm::clamp(std::atoi(argv[++a]), 1, MaxLightSamples);
+        else if (arg == "--max-depth" && a + 1 < argc) settings.reflection.maxDepth = std::atoi(argv[++a]);
+        else if (arg == "--min-throughput" && a + 1 < argc) settings.reflection.minThroughput = float(std::atof(argv[++a]));
+        else if (arg == "--no-wavefront") settings.wavefront = false;
+        else if (arg == "--format" && a + 1 < argc) format = argv[++a];
+        else if (arg == "--hdr") hdr = true;
+        else if (arg == "--aov" && a + 1 < argc) {
+            std::stringstream list(argv[++a]);
+            std::string name;
+            while (std::getline(list, name, ',')) {
+                AOV aov;
+                if (name == "all") {
+                    for (int o = 0; o < AOVCount; ++o) aovs.push_back(AOV(o));
+                } else if (parseAOV(name, aov)) {
+                    aovs.push_back(aov);
+                } else {
+                    std::cerr << "unknown output " << name << std::endl;
+                    return 1;
+                }
+            }
+        }
+        else if (arg == "--scene" && a + 1 < argc) scenePath = argv[++a];
+        else if (arg == "--no-cache") useCache = false;
+        else if (arg == "--texture-cache" && a + 1 < argc) textureCache().setBudget(size_t(std::max(1, std::atoi(argv[++a]))) << 20);
+        else if (arg == "--sequence" && a + 1 < argc) sequencePath = argv[++a];
+        else if (arg == "--distribute" && a + 1 < argc) coordinatorAddress = argv[++a];
+        else if (arg == "--workers" && a + 1 < argc) workerCount = std::max(1, std::atoi(argv[++a]));
+        else if (arg == "--spawn") spawn = true;
+        else if (arg == "--job-tile" && a + 1 < argc) coordination.jobTile = std::max(1, std::atoi(argv[++a]));
+        else if (arg == "--worker-timeout" && a + 1 < argc) coordination.workerTimeoutMs = std::atof(argv[++a]);
+        else if (arg == "--worker" && a + 1 < argc) workerAddress = argv[++a];
+        else if (arg == "--stats") settings.showStats = true;
+        else if (arg == "--tile-stats") settings.showStats = settings.perTileStats = true;
+        else if (arg == "--heatmap") heatmap = true;
+        else {
+            std::cerr << "usage: " << argv[0] << " [--threads N] [--tile N] [--packet N] [--simd scalar|sse|avx2]"
+                      << " [--samples N] [--adaptive X] [--min-samples N] [--max-samples N] [--time-budget MS]"
+                      << " [--aperture R] [--focus D]"
+                      << " [--light-samples N] [--max-depth N] [--min-throughput X] [--no-wavefront] [--format ppm|png] [--hdr] [--stats] [--tile-stats] [--heatmap]"
+                      << " [--scene FILE] [--no-cache] [--texture-cache MB] [--aov LIST] [--sequence FILE]"
+                      << " [--distribute ADDR [--workers N] [--spawn] [--job-tile N] [--worker-timeout MS]] [--worker ADDR]"
+                      << std::endl;
+            return 1;
         }
     }
 
-    return false;
-}
-
+    if (heatmap && !ProfileCounters) {
+        std::cerr << "--heatmap needs a build with RAYTRACER_PROFILE" << std::endl;
+        return 1;
+    }
 
-glm::vec3 reflect(std::vector<Object*>& objs, Object* obj, glm::vec3& intersectPos, glm::vec3& normal, Ray& ray,
-                  glm::vec3& light, int level){
-    if(level == 0){
-        // return the color of the last object
-        return glm::vec3(300.0f, 300.0f, 300.0f); // invalid vector
+#ifdef RAYTRACER_SOCKETS
+    // a worker gets its scenes and settings from the coordinator
+    if (!workerAddress.empty()) return runWorker(workerAddress, settings) ? 0 : 1;
+#else
+    if (!workerAddress.empty() || !coordinatorAddress.empty()) {
+        std::cerr << "distributed rendering is not supported on this platform" << std::endl;
+        return 1;
     }
+#endif
 
-    glm::vec3 reflectedRay = glm::normalize(glm::reflect(ray.direction(), normal));
+    // without a scene file the description keeps the assignment defaults and the scene is built below, part by part
+    SceneDescription desc;
+    if (!scenePath.empty() && !loadScene(scenePath, desc, useCache)) return 1;
 
-    float minDistance = FLT_MAX;
-    bool setFlag = false;
-    Object* closeObj = nullptr;
+    // command line overrides of the lens
+    if (aperture >= 0.0f) desc.camera.aperture = aperture;
+    if (focusDistance > 0.0f) desc.camera.focusDistance = focusDistance;
 
-    glm::vec3 intersectPosCurr;
-    glm::vec3 normalCurr;
-    glm::vec3 closeIntersectPos;
-    glm::vec3 closeNormal;
-    for(Object* objCurr : objs){
-        if(objCurr == obj) continue;
-        float dist_ = objCurr->intersect(intersectPos, reflectedRay, intersectPosCurr, normalCurr);
+    // image dimensions
+    int dimx = desc.width;
+    int dimy = desc.height;
 
-//        -0.1f
-        if(dist_ > -FLT_EPSILON){
-            if(!setFlag || minDistance > dist_){
-                setFlag = true;
-                minDistance = dist_;
-                closeObj = objCurr;
-                closeIntersectPos = intersectPosCurr;
-                closeNormal = normalCurr;
-            }
+    if (!sequencePath.empty()) {
+        if (scenePath.empty()) {
+            addAssignmentSpheres(desc.scene);
+            addAssignmentPlanes(desc.scene);
         }
+        SequenceDescription seq;
+        if (!loadSequence(sequencePath, seq, desc.scene)) return 1;
+        return renderSequence(desc, seq, ShadeMode::Reflections, settings, format, "frame") ? 0 : 1;
     }
-    if(setFlag){
-        if(closeObj->Reflect()){
-            Ray nextRay(intersectPos, reflectedRay);
-            glm::vec3 next = reflect(objs, closeObj, closeIntersectPos, closeNormal, nextRay, light, level-1);
-            if(next.x < 255.1f){
-                if(isIntersected(objs, closeObj, closeIntersectPos, light)) {
-                    return phongShadows(closeObj, next);
-                }
-                return phongShading(closeObj, closeIntersectPos, closeNormal, ray, light, next, next);
-            }
+
+#ifdef RAYTRACER_SOCKETS
+    if (!coordinatorAddress.empty()) {
+        if (scenePath.empty()) {
+            addAssignmentSpheres(desc.scene);
+            addAssignmentPlanes(desc.scene);
         }
-        if(isIntersected(objs, closeObj, closeIntersectPos, light)) {
-            return phongShadows(closeObj, closeObj->Color()*255.0f);
+        // the workers are forked before the coordinator starts any thread
+        Coordinator coordinator(settings, coordination);
+        if (!coordinator.listen(coordinatorAddress)) return 1;
+        if (spawn && !coordinator.spawnWorkers(workerCount, coordinatorAddress, settings)) return 1;
+        if (!coordinator.waitForWorkers(workerCount, 60000.0)) {
+            std::cerr << "waited for " << workerCount << " workers, " << coordinator.WorkerCount() << " connected" << std::endl;
+            return 1;
         }
-        return phongShading(closeObj, closeIntersectPos, closeNormal, ray, light, closeObj->Color()*255.0f, closeObj->Color()*255.0f);
 
-    }else{
-        return glm::vec3(300.0f, 300.0f, 300.0f); // invalid vector
+        auto start = std::chrono::high_resolution_clock::now();
+        bool ok = coordinator.render(desc, ShadeMode::Reflections, "part6_reflections",
+                                     makeImageSink(format, "part6_reflections").get()).ok;
+        auto stop = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start);
+        std::cout << "Total execution time in milliseconds: " << duration.count() << std::endl;
+        return ok ? 0 : 1;
     }
-}
-
-
-int main() {
-    // image dimensions
-    int dimx = 800;
-    int dimy = 600;
-
-    // TODO Set up camera, light etc.
-    float focal_length = 1.0f;
-    float viewport_width = 2.0f * tan(glm::radians(45.0f / 2.0f));
-    float viewport_height = viewport_width * 3.0f / 4.0f;
-
-    glm::vec3 e = glm::vec3(0.0, 0.0, 0.0); // camera position
-    glm::vec3 v = glm::vec3(0.0,1.0,0.0); // camera up direction
-    glm::vec3 w = glm::vec3(0.0,0.0,1.0); // camera view direction
-    glm::vec3 u = glm::cross(v,w); // camera right direction
+#endif
 
-    glm::vec3 horizontal = viewport_width * u;
-    glm::vec3 vertical = viewport_height * v;
-    glm::vec3 lower_left_corner = e - horizontal/2.0f - vertical/2.0f - w*focal_length;
+    if (settings.showStats) std::cout << "packet size " << settings.packetSize << ", simd " << simdName(simdLevel()) << std::endl;
+    Renderer renderer(dimx, dimy, desc.camera, settings);
 
-    // image data
-    std::vector<glm::u8vec3> image;
-    image.resize(dimx * dimy);
     // start time measurement
     auto start = std::chrono::high_resolution_clock::now();
 
-    // TODO Loop over all pixels
-    // TODO    Compute ray-object intersections etc.
-    // TODO    Store color per pixel in image vector
-
-    std::vector<Ray> ray;
-    ray.resize(dimx * dimy);
-
-    int k = 0;
-    for (int j = dimy-1; j >= 0; --j) {
-        for (int i = 0; i < dimx; ++i) {
-            glm::vec3 direction = glm::normalize(lower_left_corner + float(i)/float(dimx-1)*horizontal
-                                                 + float(j)/float(dimy-1)*vertical - e);
-
-//            image[k] = direction*255.0f; // code for non-clamped images
-
-            glm::vec3 directionClamped = glm::clamp(direction, 0.0f, 1.0f);
-            image[k] = directionClamped*255.0f; // clamped
+    if (!aovs.empty()) {
+        // one pass over the final scene
+        if (scenePath.empty()) {
+            addAssignmentSpheres(desc.scene);
+            addAssignmentPlanes(desc.scene);
+        }
+        std::vector<std::unique_ptr<ImageSink>> sinks;
+        std::vector<AOVOutput> outputs(aovs.size());
+        for (size_t o = 0; o < aovs.size(); ++o) {
+            sinks.push_back(makeImageSink(format, std::string("aov_") + aovName(aovs[o])));
+            outputs[o].aov = aovs[o];
+            outputs[o].sink = sinks.back().get();
+            outputs[o].keepHdr = hdr;
+        }
+        bool ok = renderer.renderAOVs(desc, outputs, "aov").ok;
 
-            ray[k] = Ray(e, direction);
+        auto stop = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start);
+        std::cout << "Total execution time in milliseconds: " << duration.count() << std::endl;
 
-            k++;
+        for (const AOVOutput& out : outputs) {
+            if (hdr) ok = writePFM((unsigned int)dimx, (unsigned int)dimy, out.hdr, std::string("aov_") + aovName(out.aov)) && ok;
         }
+        return ok ? 0 : 1;
     }
 
-    // write part1 clamped image
-    writeP6PPM((unsigned int)dimx, (unsigned int)dimy, image, "part1_clamped");
-
-
-    glm::vec3 light = e - u*1.9f + v*1.9f;
+    // every part streams its finished tiles into its own output file while the rest of the frame renders
+    bool ok = true;
+    ok = renderer.rayDirections("part1_clamped", makeImageSink(format, "part1_clamped").get()).ok && ok;
+    std::vector<uint32_t> costs(heatmap ? size_t(dimx) * dimy : 0);
+    auto part = [&](const std::string& label, ShadeMode mode, std::vector<glm::vec3>* hdrOut) {
+        PixelSelection pixels;
+        pixels.costs = heatmap ? costs.data() : nullptr;
+        ok = renderer.render(desc, mode, label, makeImageSink(format, label).get(), hdrOut, pixels).ok && ok;
+        if (heatmap) {
+            uint32_t max;
+            ok = writeHeatmap(costs, dimx, dimy, *makeImageSink(format, label + "_cost"), max) && ok;
+            std::cout << label << "_cost: white at " << max << " node visits and intersection tests per pixel" << std::endl;
+        }
+    };
 
-    std::vector<Object*> objs;
-    objs.push_back(new Sphere(glm::vec3(1.0, 0.5, 0.0), 0.75, glm::vec3(0.0, 0.0, -5.0), true));
-    objs.push_back(new Sphere(glm::vec3(0.0, 1.0, 0.5), 0.5, glm::vec3(1.0, 0.0, -5.5), false));
-    objs.push_back(new Sphere(glm::vec3(0.0, 0.5, 1.0), 0.2, glm::vec3(-1.0, 0.5, -3.0), false));
-    objs.push_back(new Sphere(glm::vec3(1.0, 0.5, 0.5), 0.2, glm::vec3(-0.5, -0.5, -2.5), false));
+    if (scenePath.empty()) addAssignmentSpheres(desc.scene);
 
     // part 2 spheres
-    k= 0;
-    for (int j = dimy-1; j >= 0; --j) {
-        for (int i = 0; i < dimx; ++i) {
-            float minDistance = FLT_MAX;
-            bool setFlag = false;
-            Object* closeObj = nullptr;
-
-            glm::vec3 intersectPos;
-            glm::vec3 normal;
-            glm::vec3 closeIntersectPos;
-            glm::vec3 closeNormal;
-
-            for(Object* obj : objs){
-                float dist_ = obj->intersect(ray[k].origin(), ray[k].direction(), intersectPos, normal);
-
-                if(dist_ != -1.0f){
-                    if(!setFlag || minDistance > dist_){
-                        setFlag = true;
-                        minDistance = dist_;
-                        closeObj = obj;
-                        closeIntersectPos = intersectPos;
-                        closeNormal = normal;
-                    }
-                }
-            }
-            if(setFlag){
-                image[k] = closeObj->Color()*255.0f;
-            }else{
-                image[k] = glm::vec3(0.5, 0.0, 1.0)*255.0f;
-            }
-            k++;
-        }
-    }
-    // write part2 spheres
-    writeP6PPM((unsigned int)dimx, (unsigned int)dimy, image, "part2_spheres");
+    part("part2_spheres", ShadeMode::Flat, nullptr);
 
     // part 3 shading
-    k= 0;
-    for (int j = dimy-1; j >= 0; --j) {
-        for (int i = 0; i < dimx; ++i) {
-            float minDistance = FLT_MAX;
-            bool setFlag = false;
-            Object* closeObj = nullptr;
-
-            glm::vec3 intersectPos;
-            glm::vec3 normal;
-            glm::vec3 closeIntersectPos;
-            glm::vec3 closeNormal;
-
-            for(Object* obj : objs){
-                float dist_ = obj->intersect(ray[k].origin(), ray[k].direction(), intersectPos, normal);
-
-                if(dist_ != -1.0f){
-                    if(!setFlag || minDistance > dist_){
-                        setFlag = true;
-                        minDistance = dist_;
-                        closeObj = obj;
-                        closeIntersectPos = intersectPos;
-                        closeNormal = normal;
-                    }
-                }
-            }
-            if(setFlag){
-                image[k] = phongShading(closeObj, closeIntersectPos, closeNormal, ray[k], light, closeObj->Color()*255.0f, closeObj->Color()*255.0f);
-            }else{
-                image[k] = glm::vec3(0.5, 0.0, 1.0)*255.0f;
-            }
-            k++;
-        }
-    }
-    // write part3 shading
-    writeP6PPM((unsigned int)dimx, (unsigned int)dimy, image, "part3_shading");
+    part("part3_shading", ShadeMode::Phong, nullptr);
 
     // part 4 shadows
-    k= 0;
-    for (int j = dimy-1; j >= 0; --j) {
-        for (int i = 0; i < dimx; ++i) {
-            float minDistance = FLT_MAX;
-            bool setFlag = false;
-            Object* closeObj = nullptr;
-
-            glm::vec3 intersectPos;
-            glm::vec3 normal;
-            glm::vec3 closeIntersectPos;
-            glm::vec3 closeNormal;
-
-            for(Object* obj : objs){
-                float dist_ = obj->intersect(ray[k].origin(), ray[k].direction(), intersectPos, normal);
-
-                if(dist_ != -1.0f){
-                    if(!setFlag || minDistance > dist_){
-                        setFlag = true;
-                        minDistance = dist_;
-                        closeObj = obj;
-                        closeIntersectPos = intersectPos;
-                        closeNormal = normal;
-                    }
-                }
-            }
-            if(setFlag){
-                if(isIntersected(objs, closeObj, closeIntersectPos, light)){
-                    image[k] = phongShadows(closeObj, closeObj->Color()*255.0f);
-                }else{
-                    image[k] = phongShading(closeObj, closeIntersectPos, closeNormal, ray[k], light, closeObj->Color()*255.0f, closeObj->Color()*255.0f);
-                }
-            }else{
-                image[k] = glm::vec3(0.5, 0.0, 1.0)*255.0f;
-            }
-            k++;
-        }
-    }
-    // write part4 shadows
-    writeP6PPM((unsigned int)dimx, (unsigned int)dimy, image, "part4_shadows");
+    part("part4_shadows", ShadeMode::Shadows, nullptr);
 
-    objs.push_back(new Plane(glm::vec3(0.75, 0.75, 0.75), glm::vec3(0.0, 1.0, 0.0), glm::vec3(0.0, -1.0, 0.0), true));
-    objs.push_back(new Plane(glm::vec3(0.75, 0.75, 0.75), glm::vec3(-1.0, 0.0, 0.0), glm::vec3(2.0, 0.0, 0.0), false));
-    objs.push_back(new Plane(glm::vec3(0.75, 0.75, 0.75), glm::vec3(0.0, 0.0, 1.0), glm::vec3(0.0, 0.0, -10.0), false));
-    objs.push_back(new Plane(glm::vec3(0.75, 0.75, 0.75), glm::vec3(1.0, 0.0, 0.0), glm::vec3(-3.0, 0.0, 0.0), false));
-    objs.push_back(new Plane(glm::vec3(0.75, 0.75, 0.75), glm::vec3(0.0, -1.0, 0.0), glm::vec3(0.0, 2.5, 0.0), false));
-    objs.push_back(new Plane(glm::vec3(0.75, 0.75, 0.75), glm::vec3(0.0, 0.0, -1.0), glm::vec3(0.0, 0.0, 2.0), false));
+    if (scenePath.empty()) addAssignmentPlanes(desc.scene);
 
     // part 5 planes
-    k= 0;
-    for (int j = dimy-1; j >= 0; --j) {
-        for (int i = 0; i < dimx; ++i) {
-            float minDistance = FLT_MAX;
-            bool setFlag = false;
-            Object* closeObj = nullptr;
-
-            glm::vec3 intersectPos;
-            glm::vec3 normal;
-            glm::vec3 closeIntersectPos;
-            glm::vec3 closeNormal;
-
-            for(Object* obj : objs){
-                float dist_ = obj->intersect(ray[k].origin(), ray[k].direction(), intersectPos, normal);
-
-                if(dist_ != -1.0f){
-                    if(!setFlag || minDistance > dist_){
-                        setFlag = true;
-                        minDistance = dist_;
-                        closeObj = obj;
-                        closeIntersectPos = intersectPos;
-                        closeNormal = normal;
-                    }
-                }
-            }
-            if(setFlag){
-                if(isIntersected(objs, closeObj, closeIntersectPos, light)){
-                    image[k] = phongShadows(closeObj, closeObj->Color()*255.0f);
-                }else{
-                    image[k] = phongShading(closeObj, closeIntersectPos, closeNormal, ray[k], light, closeObj->Color()*255.0f, closeObj->Color()*255.0f);
-                }
-            }else{
-                image[k] = glm::vec3(0.5, 0.0, 1.0)*255.0f;
-            }
-            k++;
-        }
-    }
-    // write part 5 planes
-    writeP6PPM((unsigned int)dimx, (unsigned int)dimy, image, "part5_planes");
+    part("part5_planes", ShadeMode::Shadows, nullptr);
 
     // part 6 reflections
-    k = 0;
-    for (int j = dimy-1; j >= 0; --j) {
-        for (int i = 0; i < dimx; ++i) {
-            float minDistance = FLT_MAX;
-            bool setFlag = false;
-            Object* closeObj = nullptr;
-
-            glm::vec3 intersectPos;
-            glm::vec3 normal;
-            glm::vec3 closeIntersectPos;
-            glm::vec3 closeNormal;
-
-            for(Object* obj : objs){
-                float dist_ = obj->intersect(ray[k].origin(), ray[k].direction(), intersectPos, normal);
-
-//                if(dist_ != -1.0){
-                if(dist_ != -1.0f){
-                    if(!setFlag || minDistance > dist_){
-                        setFlag = true;
-                        minDistance = dist_;
-                        closeObj = obj;
-                        closeIntersectPos = intersectPos;
-                        closeNormal = normal;
-                    }
-                }
-            }
-            if(setFlag){
-                if(isIntersected(objs, closeObj, closeIntersectPos, light)){
-                    if(closeObj->Reflect()){
-                        glm::vec3 reflectRes = reflect(objs, closeObj, closeIntersectPos, closeNormal, ray[k], light, 10);
-                        image[k] = phongShadows(closeObj, reflectRes);
-                    }else{
-                        image[k] = phongShadows(closeObj, closeObj->Color()*255.0f);
-                    }
-                }else{
-                    if(closeObj->Reflect()){
-//                        image[k] = reflect(objs, closeObj, closeIntersectPos, closeNormal, ray[k], light, 10);
-
-                        glm::vec3 reflectRes = reflect(objs, closeObj, closeIntersectPos, closeNormal, ray[k], light, 10);
-                        image[k] = phongShading(closeObj, closeIntersectPos, closeNormal, ray[k], light, reflectRes, reflectRes);
-                    }else{
-                        image[k] = phongShading(closeObj, closeIntersectPos, closeNormal, ray[k], light, closeObj->Color()*255.0f, closeObj->Color()*255.0f);
-                    }
-                }
-            }else{
-                image[k] = glm::vec3(0.5, 0.0, 1.0)*255.0f;
-            }
-
-            k++;
-        }
-    }
+    std::vector<glm::vec3> hdrImage(hdr ? dimx * dimy : 0);
+    part("part6_reflections", ShadeMode::Reflections, hdr ? &hdrImage : nullptr);
 
 
     // stop time
     auto stop = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start);
     std::cout << "Total execution time in milliseconds: " << duration.count() << std::endl;
+    if (settings.showStats && textureCache().FileCount() > 0) printTextureCacheStats(std::cout, textureCache().stats());
 
-    // write image data to PPM file
-    return writeP6PPM((unsigned int)dimx, (unsigned int)dimy, image, "part6_reflections");
+    // float output of the last part
+    if (hdr) ok = writePFM((unsigned int)dimx, (unsigned int)dimy, hdrImage, "part6_reflections") && ok;
+    return ok ? 0 : 1;
 }
@@ -0,0 +1,287 @@
+// C interface of the renderer (raytracer_api.h): thin wrappers over SceneDescription and Renderer.
+// no exception crosses the interface, failures are reported as rt_status
+
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <new>
+
+#include <glm/glm.hpp>
+#include <glm/vec3.hpp>
+
+#include "image.h"
+#include "raytracer_api.h"
+#include "render.h"
+#include "scene.h"
+#include "sceneio.h"
+
+struct rt_scene {
+    SceneDescription desc;
+    bool committed = true; // nothing changed since the last commit
+};
+
+struct rt_renderer {
+    rt_renderer(int width, int height, const RenderSettings& config)
+        : settings(config), renderer(width, height, CameraDesc(), config) {}
+
+    RenderSettings settings;
+    Renderer renderer;
+};
+
+namespace {
+
+glm::vec3 vec3(const float* v) { return glm::vec3(v[0], v[1], v[2]); }
+
+bool finite(float v) { return std::isfinite(v); }
+
+bool finite(const float* v) { return v && finite(v[0]) && finite(v[1]) && finite(v[2]); }
+
+// runs fn, turning exceptions into RT_ERROR_INTERNAL
+template<typename Fn>
+rt_status guarded(Fn&& fn) {
+    try {
+        return fn();
+    } catch (...) {
+        return RT_ERROR_INTERNAL;
+    }
+}
+
+float lightRange(float range) { return range > 0.0f ? range : std::numeric_limits<float>::infinity(); }
+
+}
+
+extern "C" {
+
+int rt_api_version(void) { return RT_API_VERSION; }
+
+const char* rt_status_string(rt_status status) {
+    switch (status) {
+        case RT_OK: return "ok";
+        case RT_ERROR_ARGUMENT: return "invalid argument";
+        case RT_ERROR_FILE: return "scene file could not be loaded";
+        case RT_ERROR_NOT_COMMITTED: return "scene changed since the last commit";
+        case RT_ERROR_INTERNAL: return "internal error";
+        case RT_CANCELLED: return "cancelled";
+    }
+    return "unknown status";
+}
+
+rt_status rt_scene_create(rt_scene** scene) {
+    if (!scene) return RT_ERROR_ARGUMENT;
+    return guarded([&] {
+        *scene = new rt_scene();
+        return RT_OK;
+    });
+}
+
+rt_status rt_scene_load(const char* path, int use_cache, rt_scene** scene) {
+    if (!path || !scene) return RT_ERROR_ARGUMENT;
+    return guarded([&] {
+        std::unique_ptr<rt_scene> s(new rt_scene());
+        if (!loadScene(path, s->desc, use_cache != 0)) return RT_ERROR_FILE;
+        *scene = s.release();
+        return RT_OK;
+    });
+}
+
+void rt_scene_destroy(rt_scene* scene) { delete scene; }
+
+rt_status rt_scene_get_resolution(const rt_scene* scene, int* width, int* height) {
+    if (!scene || !width || !height) return RT_ERROR_ARGUMENT;
+    *width = scene->desc.width;
+    *height = scene->desc.height;
+    return RT_OK;
+}
+
+rt_status rt_scene_set_resolution(rt_scene* scene, int width, int height) {
+    if (!scene || width <= 0 || height <= 0) return RT_ERROR_ARGUMENT;
+    scene->desc.width = width;
+    scene->desc.height = height;
+    return RT_OK;
+}
+
+rt_status rt_scene_set_camera(rt_scene* scene, const float eye[3], const float up[3], const float w[3],
+                              float fov_degrees, float focal_length) {
+    if (!scene || !finite(eye) || !finite(up) || !finite(w) || !(fov_degrees > 0.0f && fov_degrees < 180.0f) ||
+        !(focal_length > 0.0f)) {
+        return RT_ERROR_ARGUMENT;
+    }
+    CameraDesc& camera = scene->desc.camera;
+    camera.eye = vec3(eye);
+    camera.up = vec3(up);
+    camera.w = vec3(w);
+    camera.fov = fov_degrees;
+    camera.focal = focal_length;
+    return RT_OK;
+}
+
+rt_status rt_scene_set_lens(rt_scene* scene, float aperture, float focus_distance) {
+    if (!scene || !(aperture >= 0.0f) || !(focus_distance > 0.0f)) return RT_ERROR_ARGUMENT;
+    scene->desc.camera.aperture = aperture;
+    scene->desc.camera.focusDistance = focus_distance;
+    return RT_OK;
+}
+
+rt_status rt_scene_set_background(rt_scene* scene, const float rgb[3]) {
+    if (!scene || !finite(rgb)) return RT_ERROR_ARGUMENT;
+    scene->desc.background = vec3(rgb);
+    return RT_OK;
+}
+
+rt_status rt_scene_add_material(rt_scene* scene, const float rgb[3], int reflective, float ambient,
+                                float specular_exponent, uint32_t* material) {
+    if (!scene || !finite(rgb) || !finite(ambient) || !finite(specular_exponent)) return RT_ERROR_ARGUMENT;
+    return guarded([&] {
+        uint32_t index = scene->desc.scene.addMaterial(Material(vec3(rgb), reflective != 0, ambient, specular_exponent));
+        if (material) *material = index;
+        return RT_OK;
+    });
+}
+
+rt_status rt_scene_add_sphere(rt_scene* scene, uint32_t material, const float center[3], float radius) {
+    if (!scene || material >= scene->desc.scene.MaterialCount() || !finite(center) || !(radius > 0.0f)) {
+        return RT_ERROR_ARGUMENT;
+    }
+    return guarded([&] {
+        scene->desc.scene.addSphere(vec3(center), radius, material);
+        scene->committed = false;
+        return RT_OK;
+    });
+}
+
+rt_status rt_scene_add_plane(rt_scene* scene, uint32_t material, const float normal[3], const float point[3]) {
+    if (!scene || material >= scene->desc.scene.MaterialCount() || !finite(normal) || !finite(point) ||
+        vec3(normal) == glm::vec3(0.0f)) {
+        return RT_ERROR_ARGUMENT;
+    }
+    return guarded([&] {
+        scene->desc.scene.addPlane(glm::normalize(vec3(normal)), vec3(point), material);
+        scene->committed = false;
+        return RT_OK;
+    });
+}
+
+rt_status rt_scene_add_mesh(rt_scene* scene, uint32_t material, const float* positions, const float* normals,
+                            uint32_t vertex_count, const uint32_t* indices, uint32_t triangle_count) {
+    if (!scene || material >= scene->desc.scene.MaterialCount() || (!positions && vertex_count > 0) ||
+        (!indices && triangle_count > 0)) {
+        return RT_ERROR_ARGUMENT;
+    }
+    for (size_t i = 0; i < size_t(triangle_count) * 3; ++i) {
+        if (indices[i] >= vertex_count) return RT_ERROR_ARGUMENT;
+    }
+    return guarded([&] {
+        Scene& s = scene->desc.scene;
+        uint32_t base = 0;
+        for (uint32_t v = 0; v < vertex_count; ++v) {
+            glm::vec3 normal = normals ? vec3(&normals[3 * v]) : glm::vec3(0.0f);
+            uint32_t index = s.addVertex(vec3(&positions[3 * v]), normal);
+            if (v == 0) base = index;
+        }
+        for (uint32_t t = 0; t < triangle_count; ++t) {
+            s.addTriangle(base + indices[3 * t], base + indices[3 * t + 1], base + indices[3 * t + 2], material);
+        }
+        scene->committed = false;
+        return RT_OK;
+    });
+}
+
+rt_status rt_scene_clear_lights(rt_scene* scene) {
+    if (!scene) return RT_ERROR_ARGUMENT;
+    scene->desc.lights.clear();
+    scene->committed = false;
+    return RT_OK;
+}
+
+rt_status rt_scene_add_point_light(rt_scene* scene, const float position[3], const float intensity[3], float range) {
+    if (!scene || !finite(position) || !finite(intensity) || std::isnan(range)) return RT_ERROR_ARGUMENT;
+    return guarded([&] {
+        scene->desc.lights.addPoint(vec3(position), vec3(intensity), lightRange(range));
+        scene->committed = false;
+        return RT_OK;
+    });
+}
+
+rt_status rt_scene_add_area_light(rt_scene* scene, const float corner[3], const float edge_u[3],
+                                  const float edge_v[3], const float intensity[3], float range) {
+    if (!scene || !finite(corner) || !finite(edge_u) || !finite(edge_v) || !finite(intensity) || std::isnan(range)) {
+        return RT_ERROR_ARGUMENT;
+    }
+    return guarded([&] {
+        scene->desc.lights.addArea(vec3(corner), vec3(edge_u), vec3(edge_v), vec3(intensity), lightRange(range));
+        scene->committed = false;
+        return RT_OK;
+    });
+}
+
+rt_status rt_scene_commit(rt_scene* scene) {
+    if (!scene) return RT_ERROR_ARGUMENT;
+    return guarded([&] {
+        scene->desc.scene.commit();
+        scene->desc.lights.commit();
+        scene->committed = true;
+        return RT_OK;
+    });
+}
+
+rt_status rt_renderer_create(int width, int height, int threads, int tile_size, rt_renderer** renderer) {
+    if (width <= 0 || height <= 0 || !renderer) return RT_ERROR_ARGUMENT;
+    return guarded([&] {
+        RenderSettings settings;
+        settings.threadCount = std::max(0, threads);
+        if (tile_size > 0) settings.tileSize = tile_size;
+        *renderer = new rt_renderer(width, height, settings);
+        return RT_OK;
+    });
+}
+
+void rt_renderer_destroy(rt_renderer* renderer) { delete renderer; }
+
+rt_status rt_renderer_set(rt_renderer* renderer, rt_setting setting, double value) {
+    if (!renderer || !std::isfinite(value) || value < 0.0) return RT_ERROR_ARGUMENT;
+    RenderSettings& s = renderer->settings;
+    int count = int(std::min(value, 1e6));
+    switch (setting) {
+        case RT_SETTING_SAMPLES: s.samples = std::max(1, count); break;
+        case RT_SETTING_PACKET_SIZE: s.packetSize = glm::clamp(count, 1, MaxPacketSize); break;
+        case RT_SETTING_LIGHT_SAMPLES: s.lightSamples = glm::clamp(count, 1, MaxLightSamples); break;
+        case RT_SETTING_MAX_DEPTH: s.reflection.maxDepth = count; break;
+        case RT_SETTING_MIN_THROUGHPUT: s.reflection.minThroughput = float(value); break;
+        case RT_SETTING_ADAPTIVE_THRESHOLD: s.adaptiveThreshold = float(value); break;
+        case RT_SETTING_MIN_SAMPLES: s.minSamples = std::max(2, count); break;
+        case RT_SETTING_MAX_SAMPLES: s.maxSamples = std::max(1, count); break;
+        case RT_SETTING_TIME_BUDGET_MS: s.timeBudgetMs = value; break;
+        default: return RT_ERROR_ARGUMENT;
+    }
+    renderer->renderer.configure(s);
+    return RT_OK;
+}
+
+rt_status rt_render(rt_renderer* renderer, const rt_scene* scene, rt_shade_mode mode, int x, int y,
+                    int width, int height, uint8_t* rgb, size_t stride) {
+    if (!renderer || !scene || !rgb || mode < RT_SHADE_FLAT || mode > RT_SHADE_REFLECTIONS) return RT_ERROR_ARGUMENT;
+    Renderer& r = renderer->renderer;
+    if (x < 0 || y < 0 || width <= 0 || height <= 0 || x >= r.Width() || y >= r.Height() || width > r.Width() - x ||
+        height > r.Height() - y || stride < size_t(width) * 3) {
+        return RT_ERROR_ARGUMENT;
+    }
+    // the camera's aspect ratio is that of the scene resolution
+    if (scene->desc.width != r.Width() || scene->desc.height != r.Height()) return RT_ERROR_ARGUMENT;
+    if (!scene->committed) return RT_ERROR_NOT_COMMITTED;
+    return guarded([&] {
+        r.setCamera(scene->desc.camera);
+        Tile region{0, x, y, x + width, y + height};
+        BufferSink sink(rgb, stride, region);
+        PixelSelection pixels;
+        pixels.region = &region;
+        PassStats stats = r.render(scene->desc, ShadeMode(mode), "rt_render", &sink, nullptr, pixels);
+        if (stats.cancelled) return RT_CANCELLED;
+        return stats.ok ? RT_OK : RT_ERROR_INTERNAL;
+    });
+}
+
+void rt_renderer_cancel(rt_renderer* renderer) {
+    if (renderer) renderer->renderer.cancel();
+}
+
+}
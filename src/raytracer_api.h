@@ -0,0 +1,128 @@
+#ifndef RAYTRACER_API_H_
+#define RAYTRACER_API_H_
+
+/* C interface of the renderer, built as the raytracer library, for embedding it in a long-running
+   program such as a render service: scenes are built (or loaded) once and rendered region by region
+   straight into the caller's memory, without process start-up or image files.
+
+   objects are opaque handles. calls on different objects may run concurrently; a scene may be
+   rendered by several renderers at once as long as nobody modifies it meanwhile.
+   rt_renderer_cancel() is the exception to one call per object: it is meant to be called while
+   rt_render() runs on another thread. functions that can fail return an rt_status. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32) && defined(RT_SHARED)
+#ifdef RT_BUILDING_LIBRARY
+#define RT_API __declspec(dllexport)
+#else
+#define RT_API __declspec(dllimport)
+#endif
+#elif defined(__GNUC__)
+#define RT_API __attribute__((visibility("default")))
+#else
+#define RT_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* raised whenever a function or enumerator is added; existing ones keep their meaning */
+#define RT_API_VERSION 1
+
+typedef struct rt_scene rt_scene;
+typedef struct rt_renderer rt_renderer;
+
+typedef enum rt_status {
+    RT_OK = 0,
+    RT_ERROR_ARGUMENT = 1,    /* null handle, out of range index or region, invalid value */
+    RT_ERROR_FILE = 2,        /* a scene file could not be read or parsed (details on stderr) */
+    RT_ERROR_NOT_COMMITTED = 3, /* the scene changed since rt_scene_commit() */
+    RT_ERROR_INTERNAL = 4,    /* out of memory or an unexpected failure */
+    RT_CANCELLED = 5          /* rt_renderer_cancel() stopped the render, the region is incomplete */
+} rt_status;
+
+/* the shading of the assignment parts 2 (flat), 3 (phong), 4 and 5 (shadows) and 6 (reflections) */
+typedef enum rt_shade_mode {
+    RT_SHADE_FLAT = 0,
+    RT_SHADE_PHONG = 1,
+    RT_SHADE_SHADOWS = 2,
+    RT_SHADE_REFLECTIONS = 3
+} rt_shade_mode;
+
+/* renderer settings, see RenderSettings in render.h */
+typedef enum rt_setting {
+    RT_SETTING_SAMPLES = 0,            /* primary rays per pixel */
+    RT_SETTING_PACKET_SIZE = 1,        /* primary rays traced together, 1 to 16 */
+    RT_SETTING_LIGHT_SAMPLES = 2,      /* lights evaluated per shading point, 1 to 8 */
+    RT_SETTING_MAX_DEPTH = 3,          /* mirror bounces */
+    RT_SETTING_MIN_THROUGHPUT = 4,     /* contribution below which a bounce is not traced */
+    RT_SETTING_ADAPTIVE_THRESHOLD = 5, /* > 0 samples progressively until the pixel error is below */
+    RT_SETTING_MIN_SAMPLES = 6,        /* samples per progressive round */
+    RT_SETTING_MAX_SAMPLES = 7,        /* progressive sampling limit per pixel */
+    RT_SETTING_TIME_BUDGET_MS = 8      /* > 0 samples progressively until the time is spent */
+} rt_setting;
+
+RT_API int rt_api_version(void);
+RT_API const char* rt_status_string(rt_status status);
+
+/* scenes. a new scene is empty, 800x600, with the assignment camera, background and light */
+RT_API rt_status rt_scene_create(rt_scene** scene);
+/* a text scene file (see sceneio.h); use_cache keeps a binary cache of it next to the file */
+RT_API rt_status rt_scene_load(const char* path, int use_cache, rt_scene** scene);
+RT_API void rt_scene_destroy(rt_scene* scene);
+
+/* the frame size the scene is meant for (800x600 unless the scene file says otherwise); rt_render()
+   only accepts renderers created with it */
+RT_API rt_status rt_scene_get_resolution(const rt_scene* scene, int* width, int* height);
+RT_API rt_status rt_scene_set_resolution(rt_scene* scene, int width, int height);
+/* eye position, up direction and view direction w (the camera looks along -w) */
+RT_API rt_status rt_scene_set_camera(rt_scene* scene, const float eye[3], const float up[3], const float w[3],
+                                     float fov_degrees, float focal_length);
+/* thin lens of the given radius focused at focus_distance, 0 for a pinhole (needs several samples) */
+RT_API rt_status rt_scene_set_lens(rt_scene* scene, float aperture, float focus_distance);
+RT_API rt_status rt_scene_set_background(rt_scene* scene, const float rgb[3]);
+
+/* primitives reference materials by the index returned here; colors are in [0, 1] */
+RT_API rt_status rt_scene_add_material(rt_scene* scene, const float rgb[3], int reflective, float ambient,
+                                       float specular_exponent, uint32_t* material);
+RT_API rt_status rt_scene_add_sphere(rt_scene* scene, uint32_t material, const float center[3], float radius);
+RT_API rt_status rt_scene_add_plane(rt_scene* scene, uint32_t material, const float normal[3], const float point[3]);
+/* vertex_count xyz positions and optionally normals (null: faceted), three indices per triangle */
+RT_API rt_status rt_scene_add_mesh(rt_scene* scene, uint32_t material, const float* positions, const float* normals,
+                                   uint32_t vertex_count, const uint32_t* indices, uint32_t triangle_count);
+
+/* removes all lights including the default one */
+RT_API rt_status rt_scene_clear_lights(rt_scene* scene);
+/* intensity 1 is the assignment light; range is the distance of half intensity, <= 0 for no falloff */
+RT_API rt_status rt_scene_add_point_light(rt_scene* scene, const float position[3], const float intensity[3], float range);
+/* parallelogram corner + s*edge_u + t*edge_v emitting to the side of cross(edge_u, edge_v) */
+RT_API rt_status rt_scene_add_area_light(rt_scene* scene, const float corner[3], const float edge_u[3],
+                                         const float edge_v[3], const float intensity[3], float range);
+
+/* builds the acceleration structures; required after adding primitives or lights, before rendering */
+RT_API rt_status rt_scene_commit(rt_scene* scene);
+
+/* renderers own the worker threads and frame buffers of one frame size and can render any scene.
+   threads <= 0 uses all cores, tile_size is the tile edge in pixels (<= 0: 32) */
+RT_API rt_status rt_renderer_create(int width, int height, int threads, int tile_size, rt_renderer** renderer);
+RT_API void rt_renderer_destroy(rt_renderer* renderer);
+RT_API rt_status rt_renderer_set(rt_renderer* renderer, rt_setting setting, double value);
+
+/* renders the region (x, y: top left corner, row 0 at the top of the image) of the scene as seen by
+   its camera into rgb: 8 bit RGB, stride bytes from one row to the next. the renderer has to have the
+   scene's resolution (RT_ERROR_ARGUMENT otherwise). pixels arrive tile by tile while the render
+   runs; on RT_CANCELLED the tiles not rendered yet are left untouched */
+RT_API rt_status rt_render(rt_renderer* renderer, const rt_scene* scene, rt_shade_mode mode, int x, int y,
+                           int width, int height, uint8_t* rgb, size_t stride);
+/* stops the rt_render() in progress on another thread after the tiles being rendered, however far
+   it got; no effect on renders that start later */
+RT_API void rt_renderer_cancel(rt_renderer* renderer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
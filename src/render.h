@@ -0,0 +1,847 @@
+#ifndef RENDER_H_
+#define RENDER_H_
+
+#include <glm/glm.hpp>
+#include <glm/vec3.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "arena.h"
+#include "camera.h"
+#include "footprint.h"
+#include "image.h"
+#include "integrator.h"
+#include "lights.h"
+#include "material.h"
+#include "packet.h"
+#include "ray.h"
+#include "scene.h"
+#include "sceneio.h"
+#include "scheduler.h"
+#include "shading.h"
+#include "stats.h"
+#include "wavefront.h"
+
+struct RenderSettings {
+    int threadCount = 0;  // 0 = all cores
+    int tileSize = 32;    // tile edge in px
+    int packetSize = 8;   // primary rays per packet, 1 = one ray at a time
+    int samples = 1;      // primary rays per pixel, spread over the pixel and the lens
+    // progressive adaptive sampling, used by render() when a threshold or a time budget is set: every
+    // pixel starts with minSamples, then pixels whose estimated error (standard error of the mean
+    // color, 0-1 range) is above adaptiveThreshold get minSamples more per round, up to maxSamples
+    float adaptiveThreshold = 0.0f;  // 0 = no early stop, sample until maxSamples or the time budget
+    int minSamples = 4;
+    int maxSamples = 64;
+    double timeBudgetMs = 0.0;       // 0 = no limit; the first round is always completed
+    int lightSamples = 4;            // lights (and shadow rays) per shading point, up to MaxLightSamples
+    float depthRange = 10.0f;   // distance shown black in the 8 bit depth AOV
+    ReflectionSettings reflection;
+    // reflections of fixed-sample passes in wavefront order, a tile at a time (see wavefront.h)
+    bool wavefront = true;
+    bool showStats = false;     // per-thread timing of every pass
+    bool perTileStats = false;  // additionally list every tile
+};
+
+// how the closest primary hit is shaded; the six assignment parts are directions (part 1), Flat,
+// Phong, Shadows (parts 4 and 5) and Reflections
+enum class ShadeMode { Flat, Phong, Shadows, Reflections };
+
+// calls kernel(std::integral_constant<ShadeMode, mode>()), the mode as a compile time constant
+template<typename Kernel>
+inline decltype(auto) withShadeMode(ShadeMode mode, Kernel&& kernel) {
+    switch (mode) {
+        case ShadeMode::Flat: return kernel(std::integral_constant<ShadeMode, ShadeMode::Flat>());
+        case ShadeMode::Phong: return kernel(std::integral_constant<ShadeMode, ShadeMode::Phong>());
+        case ShadeMode::Shadows: return kernel(std::integral_constant<ShadeMode, ShadeMode::Shadows>());
+        default: return kernel(std::integral_constant<ShadeMode, ShadeMode::Reflections>());
+    }
+}
+
+// the material features that make a difference in a shading mode: flat shading has none, only
+// reflections look at the mirrors
+inline uint32_t modeFeatures(ShadeMode mode, uint32_t features) {
+    switch (mode) {
+        case ShadeMode::Flat: return 0;
+        case ShadeMode::Reflections: return features;
+        default: return features & ~uint32_t(ReflectiveFeature);
+    }
+}
+
+// outputs of the single pass AOV mode: the four shaded images of the assignment parts, the hit
+// distance along the primary ray, the surface normal and the object id
+enum class AOV { Flat, Phong, Shadows, Reflections, Depth, Normal, ObjectId };
+static const int AOVCount = 7;
+
+inline const char* aovName(AOV aov) {
+    static const char* const names[AOVCount] = {"flat", "phong", "shadows", "reflections", "depth", "normal", "id"};
+    return names[int(aov)];
+}
+
+inline bool parseAOV(const std::string& name, AOV& aov) {
+    for (int a = 0; a < AOVCount; ++a) {
+        if (name == aovName(AOV(a))) {
+            aov = AOV(a);
+            return true;
+        }
+    }
+    return false;
+}
+
+// one AOV buffer. the 8 bit image (streamed into sink, if any) is a preview; with keepHdr the float
+// values are kept as well: colors in [0, 1], depth in scene units (infinite for background pixels),
+// normals, and ids as (primitive kind, index within kind, material), -1 for the background
+struct AOVOutput {
+    AOV aov = AOV::Flat;
+    ImageSink* sink = nullptr;
+    bool keepHdr = false;
+    std::vector<glm::u8vec3> image;
+    std::vector<glm::vec3> hdr;
+};
+
+// timing and ray counts of one pass. trace and shade are summed over all threads, so on several
+// threads they add up to more than the wall time
+struct PassStats {
+    std::string label;
+    double wallMs = 0.0;    // the whole pass including the image output
+    double traceMs = 0.0;   // generation and closest hit of the primary rays
+    double shadeMs = 0.0;   // hit attributes and shading, including the shadow and reflection rays
+    double outputMs = 0.0;  // finishing the image file after the last tile
+    RayCounts rays;
+    ProfileCounts profile;  // hot path counters, zero unless built with RAYTRACER_PROFILE
+    bool ok = true;         // the image was written
+    bool cancelled = false; // stopped by Renderer::cancel(), part of the frame is not rendered
+};
+
+// outcome of a progressive pass
+struct SamplingStats {
+    int rounds = 0;
+    uint64_t samples = 0;           // primary samples over all pixels
+    uint64_t converged = 0;         // pixels whose error ended up below the threshold
+    bool budgetSpent = false;       // stopped by the time budget
+};
+
+// optional restriction of render() to some pixels, and per-pixel state for incremental re-rendering
+// (see RenderSession). all buffers are frame sized, hitDistances has RenderSettings::samples entries
+// per pixel
+struct PixelSelection {
+    const Tile* region = nullptr;           // render only the pixels inside, keep the others
+    const uint8_t* mask = nullptr;          // render only the pixels that are not 0, keep the others
+    PixelFootprint* footprints = nullptr;   // rewritten for every rendered pixel
+    float* hitDistances = nullptr;          // primary hit distance of every sample, FLT_MAX for none
+    uint32_t* costs = nullptr;              // ProfileCounts::work() of every pixel over its samples
+                                            // (needs RAYTRACER_PROFILE, primary rays are traced one by one)
+};
+
+inline void printPassStats(std::ostream& os, const PassStats& s) {
+    os << s.label << ": " << s.wallMs << " ms (trace " << s.traceMs << ", shade " << s.shadeMs
+       << ", output " << s.outputMs << "), rays: " << s.rays.primary << " primary, " << s.rays.shadow
+       << " shadow, " << s.rays.reflection << " reflection" << std::endl;
+    if constexpr (ProfileCounters) {
+        const ProfileCounts& p = s.profile;
+        os << s.label << ": " << p.nodeVisits << " node visits, " << p.primTests << " primitive tests, "
+           << p.shadowBlocked << " shadow rays blocked (" << p.shadowCached << " by the cached blocker)";
+        int deepest = MaxProfiledDepth;
+        while (deepest > 0 && p.depths[deepest] == 0) deepest--;
+        if (p.depths[0] > 0) {
+            os << ", paths reaching bounce 0.." << deepest << ":";
+            for (int d = 0; d <= deepest; ++d) os << " " << p.depths[d];
+        }
+        os << std::endl;
+    }
+}
+
+// tile renderer for the assignment camera. every pass runs a per-pixel kernel over the frame on the
+// tile scheduler and streams the finished tiles into an image sink (none: render only).
+// the row buffers of a tile come from a scratch arena of the worker thread that renders it, and the
+// frame sized buffers are members reused by every pass, so rendering frame after frame with one
+// renderer allocates nothing once the first frame has sized them.
+class Renderer {
+public:
+    Renderer(int dimx, int dimy, const CameraDesc& cameraDesc, const RenderSettings& config)
+        : width(dimx), height(dimy), settings(config), camera(cameraDesc, dimx, dimy),
+          scheduler(dimx, dimy, config.tileSize, config.threadCount) {
+        packetSize = glm::clamp(settings.packetSize, 1, MaxPacketSize);
+        image.resize(size_t(width) * height);
+        scratch.resize(size_t(scheduler.ThreadCount()));
+    };
+
+    // part 1: the image shows the clamped primary ray directions
+    PassStats rayDirections(const std::string& label, ImageSink* sink) {
+        scheduler.clearCancel();
+        return pass(label, {{sink, image.data()}}, [&](const Tile& tile, PassStats& local, ScratchArena& arena) {
+            for (int y = tile.y0; y < tile.y1; ++y) {
+                int j = height - 1 - y;
+                for (int i = tile.x0; i < tile.x1; ++i) {
+                    glm::vec3 direction = camera.generateRay(i, j).direction();
+
+//                    image[y * width + i] = direction*255.0f; // code for non-clamped images
+
+                    glm::vec3 directionClamped = glm::clamp(direction, 0.0f, 1.0f);
+                    image[y * width + i] = directionClamped*255.0f; // clamped
+                }
+            }
+            (void)local;
+            (void)arena;
+        });
+    };
+
+    // shade the closest primary hit of every pixel; hdr (optional, frame sized) receives the
+    // unclamped color scaled to [0, 1]. with an adaptive threshold or a time budget in the settings
+    // the pixels are sampled progressively, otherwise every pixel gets RenderSettings::samples.
+    // a pixel selection restricts the pass to some pixels or records what they depended on; apart
+    // from a plain region it is always rendered with the fixed number of samples
+    PassStats render(const SceneDescription& desc, ShadeMode mode, const std::string& label, ImageSink* sink,
+                     std::vector<glm::vec3>* hdr = nullptr, const PixelSelection& pixels = PixelSelection()) {
+        // a cancel from here on stops every round of the pass
+        scheduler.clearCancel();
+        const Scene& scene = desc.scene;
+        LightSampler lights(desc.lights, settings.lightSamples);
+        glm::vec3 background = desc.background*255.0f;
+        ReflectionIntegrator integrator(scene, lights, settings.reflection, camera.PixelSpread());
+
+        // color of a hit, compiled for the shading mode and the features of its material
+        auto shadeHit = [&](auto modeConstant, auto featureConstant, const Ray& ray, uint32_t closeId,
+                            const glm::vec3& closeIntersectPos, const glm::vec3& closeNormal) -> glm::vec3 {
+            constexpr ShadeMode Mode = decltype(modeConstant)::value;
+            constexpr uint32_t Features = decltype(featureConstant)::value;
+            const Material& closeMat = scene.material(closeId);
+            // the reflection integrator looks up the colors along the path itself
+            glm::vec3 color(0.0f, 0.0f, 0.0f);
+            if constexpr (Mode != ShadeMode::Reflections) {
+                color = surfaceColor(scene, closeMat, closeId, closeIntersectPos,
+                                     camera.PixelSpread() * glm::distance(ray.origin(), closeIntersectPos));
+            }
+            LightSelection selection;
+            if constexpr (Mode == ShadeMode::Flat) {
+                return color;
+            } else if constexpr (Mode == ShadeMode::Phong) {
+                lights.select(closeIntersectPos, selection);
+                PhongLighting lighting = phongLighting<Features, false>(closeMat, closeIntersectPos, closeNormal, ray, selection);
+                return phongShading<Features>(closeMat, lighting, color, color);
+            } else if constexpr (Mode == ShadeMode::Shadows) {
+                lights.select(closeIntersectPos, selection);
+                if (!traceShadows(scene, closeId, closeIntersectPos, selection)) return phongShadows(closeMat, color);
+                PhongLighting lighting = phongLighting<Features, true>(closeMat, closeIntersectPos, closeNormal, ray, selection);
+                return phongShading<Features>(closeMat, lighting, color, color);
+            } else {
+                return integrator.template shade<Features>(ray, closeId, closeIntersectPos, closeNormal);
+            }
+        };
+        // the same for a single hit, choosing the kernel at run time
+        auto shade = [&](const Ray& ray, uint32_t closeId, const glm::vec3& closeIntersectPos, const glm::vec3& closeNormal) -> glm::vec3 {
+            if (closeId == NoHit) return background;
+            uint32_t features = modeFeatures(mode, materialFeatures(scene.material(closeId)));
+            return withShadeMode(mode, [&](auto modeConstant) {
+                return withMaterialFeatures(features, [&](auto featureConstant) {
+                    return shadeHit(modeConstant, featureConstant, ray, closeId, closeIntersectPos, closeNormal);
+                });
+            });
+        };
+        bool selective = pixels.mask || pixels.footprints || pixels.hitDistances || pixels.costs;
+        if (!selective && (settings.adaptiveThreshold > 0.0f || settings.timeBudgetMs > 0.0)) {
+            return progressive(scene, shade, label, sink, hdr, pixels.region);
+        }
+        if (mode == ShadeMode::Reflections && settings.wavefront && !pixels.footprints && !pixels.costs) {
+            return wavefront(scene, lights, background, label, sink, hdr, pixels);
+        }
+
+        // the primary rays of the selected pixels of a tile row (all without a mask) are generated and
+        // traced in packets into a row of hits, then the row is shaded in batches of one material
+        // class, each by a kernel compiled for it; position and normal are only computed for the
+        // winner. with several samples per pixel this repeats per sample and the row averages the
+        // colors. nothing but the image is frame sized. for a cost heatmap the primary rays are traced
+        // one at a time, so that every traversal step is charged to its pixel
+        int samples = std::max(1, settings.samples);
+        return pass(label, {{sink, image.data()}}, [&](const Tile& tile, PassStats& local, ScratchArena& arena) {
+            RayPacket packet;
+            size_t rowWidth = size_t(tile.x1 - tile.x0);
+            int* active = arena.alloc<int>(rowWidth);
+            Ray* rays = arena.alloc<Ray>(rowWidth);
+            Hit* hits = arena.alloc<Hit>(rowWidth);
+            glm::vec3* colors = arena.alloc<glm::vec3>(rowWidth);
+            glm::vec3* sampleColors = arena.alloc<glm::vec3>(rowWidth);
+            uint8_t* classes = arena.alloc<uint8_t>(rowWidth);
+            int* order = arena.alloc<int>(rowWidth);
+            int batchStart[MissBatch + 2];
+            FootprintRecorder& recorder = threadFootprint();
+            uint64_t primary = 0;
+            for (int y = tile.y0; y < tile.y1; ++y) {
+                int j = height - 1 - y;
+                size_t row = size_t(y) * width;
+                int activeCount = 0;
+                for (int i = tile.x0; i < tile.x1; ++i) {
+                    if (!pixels.mask || pixels.mask[row + i]) active[activeCount++] = i;
+                }
+                for (int s = 0; s < samples && activeCount > 0; ++s) {
+                    auto start = Clock::now();
+                    for (int a = 0; a < activeCount; ++a) rays[a] = camera.generateRay(active[a], j, uint32_t(s));
+                    if (pixels.costs) {
+                        for (int a = 0; a < activeCount; ++a) {
+                            uint32_t& cost = pixels.costs[row + active[a]];
+                            if (s == 0) cost = 0;
+                            uint64_t before = threadProfileCounts().work();
+                            hits[a] = scene.intersect(rays[a].origin(), rays[a].direction(), 0.0f);
+                            cost += uint32_t(threadProfileCounts().work() - before);
+                        }
+                    } else {
+                        traceRays(scene, packet, rays, hits, activeCount);
+                    }
+                    auto traced = Clock::now();
+                    batchByMaterial(scene, mode, hits, activeCount, classes, order, batchStart);
+                    auto shadeBatch = [&](int b, auto&& kernel) {
+                        for (int o = batchStart[b]; o < batchStart[b + 1]; ++o) {
+                            int a = order[o];
+                            size_t k = row + active[a];
+                            const Ray& ray = rays[a];
+                            const Hit& hit = hits[a];
+                            glm::vec3 closeIntersectPos;
+                            glm::vec3 closeNormal;
+                            if (hit.primId != NoHit) scene.attributes(ray.origin(), ray.direction(), hit, closeIntersectPos, closeNormal);
+                            if (pixels.footprints) recorder.begin();
+                            uint64_t before = pixels.costs ? threadProfileCounts().work() : 0;
+                            sampleColors[a] = kernel(ray, hit.primId, closeIntersectPos, closeNormal);
+                            if (pixels.costs) pixels.costs[k] += uint32_t(threadProfileCounts().work() - before);
+                            if (pixels.footprints) {
+                                recorder.active = false;
+                                PixelFootprint& footprint = pixels.footprints[k];
+                                if (s == 0) footprint.clear();
+                                if (hit.primId != NoHit) footprint.touched |= footprintBit(hit.primId);
+                                footprint.touched |= recorder.touched;
+                                footprint.secondary.grow(recorder.secondary);
+                            }
+                        }
+                    };
+                    for (int b = 0; b < int(MaterialClassCount); ++b) {
+                        if (batchStart[b] == batchStart[b + 1]) continue;
+                        withShadeMode(mode, [&](auto modeConstant) {
+                            withMaterialFeatures(uint32_t(b), [&](auto featureConstant) {
+                                shadeBatch(b, [&](const Ray& ray, uint32_t closeId, const glm::vec3& pos, const glm::vec3& normal) {
+                                    return shadeHit(modeConstant, featureConstant, ray, closeId, pos, normal);
+                                });
+                            });
+                        });
+                    }
+                    shadeBatch(MissBatch, [&](const Ray&, uint32_t, const glm::vec3&, const glm::vec3&) { return background; });
+                    for (int a = 0; a < activeCount; ++a) {
+                        size_t k = row + active[a];
+                        if (pixels.hitDistances) pixels.hitDistances[k * samples + s] = hits[a].t;
+                        if (s == 0) colors[a] = sampleColors[a];
+                        else colors[a] += sampleColors[a];
+                    }
+                    auto shaded = Clock::now();
+                    local.traceMs += ms(traced - start);
+                    local.shadeMs += ms(shaded - traced);
+                }
+                for (int a = 0; a < activeCount; ++a) {
+                    size_t k = row + active[a];
+                    glm::vec3 color = colors[a] / float(samples);
+                    image[k] = color;
+                    if (hdr) (*hdr)[k] = color / 255.0f;
+                }
+                primary += uint64_t(activeCount) * uint64_t(samples);
+            }
+            threadRayCounts().primary += primary;
+        }, nullptr, pixels.region);
+    };
+
+    // reflections for render() with the wavefront integrator: the primary rays of the selected pixels
+    // of a tile are traced together, sample by sample, and every sample of the tile is shaded as one
+    // batch. the image is the one of the row by row kernel
+    PassStats wavefront(const Scene& scene, const LightSampler& lights, const glm::vec3& background, const std::string& label,
+                        ImageSink* sink, std::vector<glm::vec3>* hdr, const PixelSelection& pixels) {
+        WavefrontIntegrator integrator(scene, lights, settings.reflection, camera.PixelSpread());
+        int samples = std::max(1, settings.samples);
+        return pass(label, {{sink, image.data()}}, [&](const Tile& tile, PassStats& local, ScratchArena& arena) {
+            RayPacket packet;
+            size_t tilePixels = size_t(tile.x1 - tile.x0) * size_t(tile.y1 - tile.y0);
+            size_t* active = arena.alloc<size_t>(tilePixels);
+            Ray* rays = arena.alloc<Ray>(tilePixels);
+            Hit* hits = arena.alloc<Hit>(tilePixels);
+            glm::vec3* colors = arena.alloc<glm::vec3>(tilePixels);
+            glm::vec3* sampleColors = arena.alloc<glm::vec3>(tilePixels);
+            int activeCount = 0;
+            for (int y = tile.y0; y < tile.y1; ++y) {
+                for (int i = tile.x0; i < tile.x1; ++i) {
+                    size_t k = size_t(y) * width + i;
+                    if (!pixels.mask || pixels.mask[k]) active[activeCount++] = k;
+                }
+            }
+            for (int s = 0; s < samples && activeCount > 0; ++s) {
+                auto start = Clock::now();
+                for (int a = 0; a < activeCount; ++a) {
+                    int i = int(active[a] % size_t(width));
+                    int j = height - 1 - int(active[a] / size_t(width));
+                    rays[a] = camera.generateRay(i, j, uint32_t(s));
+                }
+                traceRays(scene, packet, rays, hits, activeCount);
+                auto traced = Clock::now();
+                integrator.shade(rays, hits, activeCount, background, sampleColors, arena);
+                for (int a = 0; a < activeCount; ++a) {
+                    if (pixels.hitDistances) pixels.hitDistances[active[a] * samples + s] = hits[a].t;
+                    if (s == 0) colors[a] = sampleColors[a];
+                    else colors[a] += sampleColors[a];
+                }
+                auto shaded = Clock::now();
+                local.traceMs += ms(traced - start);
+                local.shadeMs += ms(shaded - traced);
+            }
+            for (int a = 0; a < activeCount; ++a) {
+                glm::vec3 color = colors[a] / float(samples);
+                image[active[a]] = color;
+                if (hdr) (*hdr)[active[a]] = color / 255.0f;
+            }
+            threadRayCounts().primary += uint64_t(activeCount) * uint64_t(samples);
+        }, nullptr, pixels.region);
+    };
+
+    // single pass AOV mode: every primary hit is traced once and shaded into all requested outputs.
+    // color outputs average all samples, depth, normal and object id are those of sample 0 (the ray
+    // through the pixel grid point)
+    PassStats renderAOVs(const SceneDescription& desc, std::vector<AOVOutput>& outputs, const std::string& label) {
+        scheduler.clearCancel();
+        const Scene& scene = desc.scene;
+        LightSampler lights(desc.lights, settings.lightSamples);
+        glm::vec3 background = desc.background*255.0f;
+        ReflectionIntegrator integrator(scene, lights, settings.reflection, camera.PixelSpread());
+        int samples = std::max(1, settings.samples);
+
+        bool wanted[AOVCount] = {false};
+        std::vector<SinkFrame> sinks;
+        for (AOVOutput& out : outputs) {
+            wanted[int(out.aov)] = true;
+            out.image.assign(size_t(width) * height, glm::u8vec3(0, 0, 0));
+            out.hdr.assign(out.keepHdr ? size_t(width) * height : 0, glm::vec3(0.0f));
+            sinks.push_back({out.sink, out.image.data()});
+        }
+
+        // all AOVs of one sample; the color ones in the 0-255 range of the other passes
+        auto shade = [&](const Ray& ray, const Hit& hit, glm::vec3* value) {
+            if (hit.primId == NoHit) {
+                for (int a = 0; a <= int(AOV::Reflections); ++a) value[a] = background;
+                value[int(AOV::Depth)] = glm::vec3(std::numeric_limits<float>::infinity());
+                value[int(AOV::Normal)] = glm::vec3(0.0f);
+                value[int(AOV::ObjectId)] = glm::vec3(-1.0f);
+                return;
+            }
+            glm::vec3 closeIntersectPos;
+            glm::vec3 closeNormal;
+            scene.attributes(ray.origin(), ray.direction(), hit, closeIntersectPos, closeNormal);
+            const Material& closeMat = scene.material(hit.primId);
+            glm::vec3 color = surfaceColor(scene, closeMat, hit.primId, closeIntersectPos, camera.PixelSpread() * hit.t);
+
+            for (int a = 0; a < AOVCount; ++a) value[a] = glm::vec3(0.0f);
+            value[int(AOV::Flat)] = color;
+            LightSelection selection;
+            lights.select(closeIntersectPos, selection);
+            if (wanted[int(AOV::Phong)]) {
+                value[int(AOV::Phong)] = phongShading(closeMat, closeIntersectPos, closeNormal, ray, selection, color, color);
+            }
+            // the light selection and shadow rays of the hit are shared by the shadows and reflections outputs
+            if (wanted[int(AOV::Shadows)] || wanted[int(AOV::Reflections)]) {
+                bool lit = traceShadows(scene, hit.primId, closeIntersectPos, selection);
+                if (wanted[int(AOV::Shadows)]) {
+                    value[int(AOV::Shadows)] = lit ? phongShading(closeMat, closeIntersectPos, closeNormal, ray, selection, color, color)
+                                                   : phongShadows(closeMat, color);
+                }
+            }
+            if (wanted[int(AOV::Reflections)]) {
+                value[int(AOV::Reflections)] = integrator.shade(ray, hit.primId, closeIntersectPos, closeNormal, selection);
+            }
+            value[int(AOV::Depth)] = glm::vec3(hit.t);
+            value[int(AOV::Normal)] = closeNormal;
+            value[int(AOV::ObjectId)] = glm::vec3(float(primKind(hit.primId)), float(primIndex(hit.primId)),
+                                                  float(scene.materialIndex(hit.primId)));
+        };
+
+        return pass(label, sinks, [&](const Tile& tile, PassStats& local, ScratchArena& arena) {
+            size_t rowWidth = size_t(tile.x1 - tile.x0);
+            RayPacket packet;
+            Ray* rays = arena.alloc<Ray>(rowWidth);
+            Hit* hits = arena.alloc<Hit>(rowWidth);
+            glm::vec3* values = arena.alloc<glm::vec3>(rowWidth * AOVCount);
+            glm::vec3 sample[AOVCount];
+            for (int y = tile.y0; y < tile.y1; ++y) {
+                int j = height - 1 - y;
+                for (int s = 0; s < samples; ++s) {
+                    auto start = Clock::now();
+                    traceRow(scene, tile, j, uint32_t(s), packet, rays, hits);
+                    auto traced = Clock::now();
+                    for (size_t x = 0; x < rowWidth; ++x) {
+                        glm::vec3* value = &values[x * AOVCount];
+                        if (s == 0) {
+                            shade(rays[x], hits[x], value);
+                            continue;
+                        }
+                        shade(rays[x], hits[x], sample);
+                        for (int a = 0; a <= int(AOV::Reflections); ++a) value[a] += sample[a];
+                    }
+                    auto shaded = Clock::now();
+                    local.traceMs += ms(traced - start);
+                    local.shadeMs += ms(shaded - traced);
+                }
+                for (size_t x = 0; x < rowWidth; ++x) {
+                    size_t k = size_t(y) * width + tile.x0 + x;
+                    const glm::vec3* value = &values[x * AOVCount];
+                    for (AOVOutput& out : outputs) {
+                        glm::vec3 v = value[int(out.aov)];
+                        if (int(out.aov) <= int(AOV::Reflections)) v /= float(samples);
+                        out.image[k] = aovPreview(out.aov, v);
+                        if (out.keepHdr) out.hdr[k] = out.aov <= AOV::Reflections ? v / 255.0f : v;
+                    }
+                }
+            }
+            threadRayCounts().primary += uint64_t(rowWidth) * uint64_t(tile.y1 - tile.y0) * uint64_t(samples);
+        });
+    };
+
+    // test(i, j, k) for every pixel (camera coordinates i, j and frame index k) on the worker
+    // threads; returns the number of pixels it was true for
+    template<typename Test>
+    size_t countPixels(Test&& test) {
+        scheduler.clearCancel();
+        std::atomic<size_t> count(0);
+        PassStats stats;
+        runTiles(stats, [&](const Tile& tile, PassStats& local, ScratchArena& arena) {
+            size_t n = 0;
+            for (int y = tile.y0; y < tile.y1; ++y) {
+                for (int i = tile.x0; i < tile.x1; ++i) n += test(i, height - 1 - y, size_t(y) * width + i) ? 1 : 0;
+            }
+            count += n;
+            (void)local;
+            (void)arena;
+        });
+        return count;
+    };
+
+    // sampling, lighting and reflection settings of the following passes; the thread count and tile
+    // size stay those the renderer was created with
+    void configure(const RenderSettings& config) {
+        int threadCount = settings.threadCount;
+        int tileSize = settings.tileSize;
+        settings = config;
+        settings.threadCount = threadCount;
+        settings.tileSize = tileSize;
+        packetSize = glm::clamp(settings.packetSize, 1, MaxPacketSize);
+    };
+
+    // stops the pass in progress after the tiles being rendered, including the rounds of progressive
+    // sampling it has not started yet; may be called from any thread. the pass returns with
+    // PassStats::cancelled set. a cancel between passes is cleared by the start of the next one
+    void cancel() { scheduler.cancel(); };
+
+    // the frame buffers, tiles and threads are kept; the next pass renders the new view
+    void setCamera(const CameraDesc& cameraDesc) { camera = Camera(cameraDesc, width, height); };
+
+    int Width() const { return width; };
+    int Height() const { return height; };
+    const std::vector<glm::u8vec3>& Image() const { return image; };
+    const Camera& ViewCamera() const { return camera; };
+    const TileScheduler& Scheduler() const { return scheduler; };
+    const SamplingStats& LastSampling() const { return sampling; };
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    // an output file and the frame it is fed from
+    struct SinkFrame {
+        ImageSink* sink;
+        const glm::u8vec3* frame;
+    };
+
+    static double ms(Clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); };
+
+    // batch of the misses after those of the material classes
+    static const int MissBatch = int(MaterialClassCount);
+
+    // counting sort of a row of hits into batches of one material class (as far as the mode tells
+    // them apart): order lists the hits batch by batch, batch b is order[start[b]] up to
+    // order[start[b + 1]]. classes receives the batch of every hit
+    static void batchByMaterial(const Scene& scene, ShadeMode mode, const Hit* hits, int count, uint8_t* classes,
+                                int* order, int* start) {
+        int fill[MissBatch + 1] = {};
+        for (int a = 0; a < count; ++a) {
+            uint32_t b = hits[a].primId == NoHit ? uint32_t(MissBatch)
+                                                 : modeFeatures(mode, materialFeatures(scene.material(hits[a].primId)));
+            classes[a] = uint8_t(b);
+            fill[b]++;
+        }
+        start[0] = 0;
+        for (int b = 0; b <= MissBatch; ++b) {
+            start[b + 1] = start[b] + fill[b];
+            fill[b] = start[b];
+        }
+        for (int a = 0; a < count; ++a) order[fill[classes[a]]++] = a;
+    };
+
+    // 8 bit version of an AOV value: colors as rendered, depth as brightness falling off towards
+    // RenderSettings::depthRange, normals mapped from [-1, 1] and object ids as hashed colors
+    glm::u8vec3 aovPreview(AOV aov, const glm::vec3& v) const {
+        switch (aov) {
+            case AOV::Depth: {
+                if (!(v.x < std::numeric_limits<float>::infinity())) return glm::u8vec3(0, 0, 0);
+                float gray = 255.0f * (1.0f - glm::clamp(v.x / settings.depthRange, 0.0f, 1.0f));
+                return glm::u8vec3(glm::vec3(gray));
+            }
+            case AOV::Normal:
+                return glm::u8vec3(glm::clamp((v*0.5f + 0.5f)*255.0f, 0.0f, 255.0f));
+            case AOV::ObjectId: {
+                if (v.x < 0.0f) return glm::u8vec3(0, 0, 0);
+                uint32_t h = (uint32_t(v.x) * 0x9e3779b9u) ^ (uint32_t(v.y) * 0x85ebca6bu);
+                h ^= h >> 15;
+                h *= 0x2c1b3c6du;
+                h ^= h >> 12;
+                return glm::u8vec3(uint8_t(h >> 16), uint8_t(h >> 8), uint8_t(h));
+            }
+            default:
+                return glm::u8vec3(v);
+        }
+    };
+
+    // trace the primary rays (sample s) of tile row j into rays and hits, indexed from tile.x0
+    void traceRow(const Scene& scene, const Tile& tile, int j, uint32_t s, RayPacket& packet, Ray* rays, Hit* hits) const {
+        for (int i = tile.x0; i < tile.x1; ++i) rays[i - tile.x0] = camera.generateRay(i, j, s);
+        traceRays(scene, packet, rays, hits, tile.x1 - tile.x0);
+    };
+
+    // closest hits of count generated rays, packetSize at a time
+    void traceRays(const Scene& scene, RayPacket& packet, const Ray* rays, Hit* hits, int count) const {
+        for (int i = 0; i < count; i += packetSize) {
+            const Ray* r = &rays[i];
+            Hit* h = &hits[i];
+            packet.size = std::min(packetSize, count - i);
+            if (packetSize == 1) {
+                // scalar path
+                h[0] = scene.intersect(r[0].origin(), r[0].direction(), 0.0f);
+            } else {
+                for (int l = 0; l < packet.size; ++l) packet.set(l, r[l].origin(), r[l].direction());
+                scene.intersect(packet, 0.0f, h);
+            }
+        }
+    };
+
+    // standard error of the mean of n samples (largest over the color channels), from the sums of the
+    // samples and of their squares; infinite while there are too few samples to tell
+    static float meanError(const glm::vec3& sum, const glm::vec3& sumSq, uint32_t n) {
+        if (n < 2) return std::numeric_limits<float>::infinity();
+        glm::vec3 mean = sum / float(n);
+        glm::vec3 variance = glm::max(sumSq / float(n) - mean*mean, glm::vec3(0.0f)) * (float(n) / float(n - 1));
+        return std::sqrt(std::max(std::max(variance.x, variance.y), variance.z) / float(n));
+    };
+
+    // progressive adaptive sampling for render(): the samples of every pixel are summed up in float
+    // buffers, in rounds over the whole frame. the first round takes minSamples per pixel, every
+    // following round adds minSamples more to the pixels that are still above the error threshold
+    // (silhouettes, shadow and reflection edges); it ends when no pixel is left, all have maxSamples
+    // or the time budget is spent (checked per tile). the last pass resolves the sums into the image.
+    // with a region only its pixels are sampled
+    template<typename Shade>
+    PassStats progressive(const Scene& scene, Shade& shade, const std::string& label, ImageSink* sink,
+                          std::vector<glm::vec3>* hdr, const Tile* region) {
+        auto start = Clock::now();
+        size_t pixels = size_t(width) * height;
+        std::vector<glm::vec3>& sum = sampleSum;
+        std::vector<glm::vec3>& sumSq = sampleSumSq;
+        std::vector<uint32_t>& count = sampleCount;
+        std::vector<uint8_t>& done = sampleDone; // converged or at maxSamples, updated after sampling the pixel
+        sum.assign(pixels, glm::vec3(0.0f));
+        sumSq.assign(pixels, glm::vec3(0.0f));
+        count.assign(pixels, 0);
+        done.assign(pixels, 0);
+        uint32_t batch = uint32_t(std::max(2, settings.minSamples));
+        uint32_t maxSamples = std::max(batch, uint32_t(std::max(0, settings.maxSamples)));
+        float threshold = settings.adaptiveThreshold * 255.0f; // the colors are summed in the 0-255 range
+        auto overBudget = [&]() {
+            return settings.timeBudgetMs > 0.0 && ms(Clock::now() - start) > settings.timeBudgetMs;
+        };
+
+        sampling = SamplingStats();
+        PassStats stats;
+        std::atomic<bool> budgetSpent(false);
+        while (true) {
+            bool first = sampling.rounds == 0;
+            uint64_t before = stats.rays.primary;
+            runTiles(stats, [&](const Tile& tile, PassStats& local, ScratchArena& arena) {
+                if (!first && overBudget()) {
+                    budgetSpent = true;
+                    return;
+                }
+                RayPacket packet;
+                size_t rowWidth = size_t(tile.x1 - tile.x0);
+                int* active = arena.alloc<int>(rowWidth);
+                Ray* rays = arena.alloc<Ray>(rowWidth);
+                Hit* hits = arena.alloc<Hit>(rowWidth);
+                for (int y = tile.y0; y < tile.y1; ++y) {
+                    int j = height - 1 - y;
+                    size_t row = size_t(y) * width;
+                    int activeCount = 0;
+                    for (int i = tile.x0; i < tile.x1; ++i) {
+                        if (!done[row + i]) active[activeCount++] = i;
+                    }
+                    for (uint32_t s = 0; s < batch; ++s) {
+                        // pixels in the same round usually have the same count, but never exceed maxSamples
+                        int n = 0;
+                        auto begin = Clock::now();
+                        for (int a = 0; a < activeCount; ++a) {
+                            int i = active[a];
+                            if (count[row + i] < maxSamples) rays[n++] = camera.generateRay(i, j, count[row + i]);
+                        }
+                        if (n == 0) break;
+                        traceRays(scene, packet, rays, hits, n);
+                        auto traced = Clock::now();
+                        n = 0;
+                        for (int a = 0; a < activeCount; ++a) {
+                            size_t k = row + active[a];
+                            if (count[k] >= maxSamples) continue;
+                            const Ray& ray = rays[n];
+                            const Hit& hit = hits[n++];
+                            glm::vec3 closeIntersectPos;
+                            glm::vec3 closeNormal;
+                            if (hit.primId != NoHit) scene.attributes(ray.origin(), ray.direction(), hit, closeIntersectPos, closeNormal);
+                            glm::vec3 color = shade(ray, hit.primId, closeIntersectPos, closeNormal);
+                            sum[k] += color;
+                            sumSq[k] += color*color;
+                            count[k]++;
+                        }
+                        threadRayCounts().primary += uint64_t(n);
+                        local.traceMs += ms(traced - begin);
+                        local.shadeMs += ms(Clock::now() - traced);
+                    }
+                    for (int a = 0; a < activeCount; ++a) {
+                        size_t k = row + active[a];
+                        done[k] = count[k] >= maxSamples || meanError(sum[k], sumSq[k], count[k]) <= threshold;
+                    }
+                }
+            }, [](const Tile&) {}, region);
+            sampling.rounds++;
+            if (stats.rays.primary == before || budgetSpent || stats.cancelled) break;
+            if (overBudget()) {
+                budgetSpent = true;
+                break;
+            }
+        }
+        sampling.budgetSpent = budgetSpent;
+        sampling.samples = stats.rays.primary;
+        stats.wallMs = ms(Clock::now() - start);
+
+        PassStats result = pass(label, {{sink, image.data()}}, [&](const Tile& tile, PassStats& local, ScratchArena& arena) {
+            for (int y = tile.y0; y < tile.y1; ++y) {
+                for (int i = tile.x0; i < tile.x1; ++i) {
+                    size_t k = size_t(y) * width + i;
+                    glm::vec3 color = sum[k] / float(std::max(count[k], 1u));
+                    image[k] = color;
+                    if (hdr) (*hdr)[k] = color / 255.0f;
+                }
+            }
+            (void)local;
+            (void)arena;
+        }, &stats, region);
+        Tile area = region ? *region : Tile{0, 0, 0, width, height};
+        size_t areaPixels = size_t(area.x1 - area.x0) * size_t(area.y1 - area.y0);
+        for (int y = area.y0; y < area.y1; ++y) {
+            for (int i = area.x0; i < area.x1; ++i) {
+                size_t k = size_t(y) * width + i;
+                if (meanError(sum[k], sumSq[k], count[k]) <= threshold) sampling.converged++;
+            }
+        }
+        if (settings.showStats) {
+            std::cout << label << ": " << sampling.rounds << " rounds, "
+                      << double(sampling.samples) / double(areaPixels) << " samples per pixel, "
+                      << 100.0 * double(sampling.converged) / double(areaPixels) << "% of the pixels converged"
+                      << (sampling.budgetSpent ? ", time budget spent" : "") << std::endl;
+        }
+        return result;
+    };
+
+    // run renderTile(tile, tileStats, arena) over the frame (or the tiles of region, clipped to it),
+    // tileDone(tile) after each tile; per-tile stats, ray and profile counts are summed up into stats.
+    // arena is the scratch arena of the worker, memory taken from it is released when the tile is done
+    template<typename RenderTile, typename TileDone>
+    void runTiles(PassStats& stats, RenderTile&& renderTile, TileDone&& tileDone, const Tile* region = nullptr) {
+        for (ScratchArena& arena : scratch) arena.reset();
+        takeRayCounts();
+        takeProfileCounts();
+        std::mutex m;
+        scheduler.run([&](const Tile& tile, int worker) {
+            PassStats local;
+            {
+                ScratchArena::Scope scope(scratch[worker]);
+                renderTile(tile, local, scratch[worker]);
+            }
+            tileDone(tile);
+            RayCounts counts = takeRayCounts();
+            ProfileCounts profile;
+            if constexpr (ProfileCounters) profile = takeProfileCounts();
+            std::lock_guard<std::mutex> lock(m);
+            stats.traceMs += local.traceMs;
+            stats.shadeMs += local.shadeMs;
+            stats.rays += counts;
+            if constexpr (ProfileCounters) stats.profile += profile;
+        }, region);
+        stats.cancelled = stats.cancelled || scheduler.Cancelled();
+    };
+
+    template<typename RenderTile>
+    void runTiles(PassStats& stats, RenderTile&& renderTile) {
+        runTiles(stats, renderTile, [](const Tile&) {});
+    };
+
+    // run renderTile over the frame (or region) and stream every finished tile into the sinks (null
+    // sinks are skipped). stats of earlier work belonging to the pass (progressive sampling rounds)
+    // can be passed in as before and are included in the result
+    template<typename RenderTile>
+    PassStats pass(const std::string& label, const std::vector<SinkFrame>& sinks, RenderTile&& renderTile,
+                   const PassStats* before = nullptr, const Tile* region = nullptr) {
+        PassStats stats;
+        if (before) stats = *before;
+        stats.label = label;
+        auto start = Clock::now();
+        for (const SinkFrame& out : sinks) {
+            if (out.sink) stats.ok = out.sink->open(width, height) && stats.ok;
+        }
+
+        runTiles(stats, renderTile, [&](const Tile& tile) {
+            for (const SinkFrame& out : sinks) {
+                if (out.sink) out.sink->tileDone(tile, out.frame);
+            }
+        }, region);
+
+        auto rendered = Clock::now();
+        for (const SinkFrame& out : sinks) {
+            if (out.sink) stats.ok = out.sink->close() && stats.ok;
+        }
+        auto done = Clock::now();
+        stats.outputMs = ms(done - rendered);
+        stats.wallMs += ms(done - start);
+        if (settings.showStats) {
+            scheduler.report(std::cout, label, settings.perTileStats);
+            printPassStats(std::cout, stats);
+        }
+        return stats;
+    };
+
+    int width;
+    int height;
+    RenderSettings settings;
+    Camera camera;
+    int packetSize;
+    TileScheduler scheduler;
+
+    std::vector<glm::u8vec3> image;
+    SamplingStats sampling;
+
+    // per-worker scratch memory and the sample sums of progressive passes, kept between passes
+    std::vector<ScratchArena> scratch;
+    std::vector<glm::vec3> sampleSum;
+    std::vector<glm::vec3> sampleSumSq;
+    std::vector<uint32_t> sampleCount;
+    std::vector<uint8_t> sampleDone;
+};
+
+#endif
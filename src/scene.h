@@ -0,0 +1,832 @@
+#ifndef SCENE_H_
+#define SCENE_H_
+
+#include <glm/glm.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+#include <glm/mat4x4.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "aabb.h"
+#include "array.h"
+#include "bvh.h"
+#include "material.h"
+#include "packet.h"
+#include "plane.h"
+#include "sphere.h"
+#include "stats.h"
+#include "texture.h"
+#include "trianglemesh.h"
+
+// primitive ids carry the primitive kind in the top two bits and the index into that kind's arrays below.
+// the primitives of instances have no arrays of their own: an InstancePrim index counts through the
+// primitives of all instances (see Scene::addInstance), which leaves the ids of hits a single number
+enum PrimKind : uint32_t { SpherePrim = 0, PlanePrim = 1, TrianglePrim = 2, InstancePrim = 3 };
+static const uint32_t NoHit = 0xffffffffu;
+static const uint32_t NoMaterial = 0xffffffffu;
+static const uint32_t MaxInstancedPrims = 0x3fffffffu; // InstancePrim indices below, NoHit is the last
+
+inline uint32_t makePrimId(PrimKind kind, uint32_t index) { return (uint32_t(kind) << 30) | index; }
+inline PrimKind primKind(uint32_t id) { return PrimKind(id >> 30); }
+inline uint32_t primIndex(uint32_t id) { return id & 0x3fffffffu; }
+
+// result of a closest-hit query: only the ray parameter and the primitive, the hit position and
+// normal are computed afterwards by attributes() for the one hit that actually gets shaded
+struct Hit {
+    float t = FLT_MAX;
+    uint32_t primId = NoHit;
+};
+
+class Scene;
+
+// per-thread memory of the primitive that blocked the last shadow ray
+struct OcclusionCache {
+    const Scene* scene = nullptr;
+    uint32_t generation = 0;
+    uint32_t lastOccluder = NoHit;
+};
+
+// geometry placed by instances only: the spheres and triangles of the prototype are a range of the
+// scene arrays with a BVH tree of their own, in object space
+struct Prototype {
+    uint32_t sphereBegin, sphereEnd;
+    uint32_t triangleBegin, triangleEnd;
+    AABB bounds;
+
+    uint32_t primCount() const { return (sphereEnd - sphereBegin) + (triangleEnd - triangleBegin); };
+};
+
+// a placed prototype: 64 bytes however large the prototype is
+struct Instance {
+    glm::vec4 toObject[3]; // rows of the affine world to object transform
+    uint32_t prototype;
+    uint32_t material;     // for all of the prototype's primitives, NoMaterial keeps their own
+    uint32_t firstPrim;    // InstancePrim index of the instance's first primitive
+    uint32_t pad = 0;
+
+    glm::vec3 point(const glm::vec3& p) const {
+        glm::vec4 h(p, 1.0f);
+        return glm::vec3(glm::dot(toObject[0], h), glm::dot(toObject[1], h), glm::dot(toObject[2], h));
+    };
+    glm::vec3 vector(const glm::vec3& v) const {
+        glm::vec4 h(v, 0.0f);
+        return glm::vec3(glm::dot(toObject[0], h), glm::dot(toObject[1], h), glm::dot(toObject[2], h));
+    };
+    // an object space normal in world space (the transposed inverse of the object to world transform)
+    glm::vec3 normal(const glm::vec3& n) const {
+        glm::vec3 r0(toObject[0].x, toObject[0].y, toObject[0].z);
+        glm::vec3 r1(toObject[1].x, toObject[1].y, toObject[1].z);
+        glm::vec3 r2(toObject[2].x, toObject[2].y, toObject[2].z);
+        return glm::normalize(r0*n.x + r1*n.y + r2*n.z);
+    };
+};
+
+// render-time scene: geometry of every primitive kind lives in contiguous structure-of-arrays
+// storage, materials in a separate table. spheres and triangles are indexed by a BVH, the infinite
+// planes are few and tested for every ray. triangles index a shared vertex array, so meshes keep
+// their vertex sharing.
+// repeated geometry is instanced: a prototype is stored once with its own BVH tree, and instances
+// of it are leaves of the scene BVH that hold just a transform and a material override. rays that
+// reach an instance continue in the prototype's tree in object space, so memory grows with the
+// unique geometry, not with the number of copies
+class Scene {
+public:
+    uint32_t addMaterial(const Material& mat) {
+        materials.push_back(mat);
+        return uint32_t(materials.size() - 1);
+    };
+
+    uint32_t addTexture(const Texture& tex) {
+        textures.push_back(tex);
+        textureFiles.push_back(NoTexture);
+        return uint32_t(textures.size() - 1);
+    };
+
+    // an image texture of the PPM file at path (best absolute, the path is kept in the scene cache),
+    // opened in the texture cache; NoTexture if it cannot be read
+    uint32_t addImageTexture(const std::string& path, float scale = 1.0f) {
+        uint32_t file = textureCache().open(path);
+        if (file == NoTexture) return NoTexture;
+        Texture tex;
+        tex.kind = ImageTexture;
+        tex.scale = scale;
+        tex.pathBegin = uint32_t(texturePaths.size());
+        for (char c : path) texturePaths.push_back(c);
+        tex.pathEnd = uint32_t(texturePaths.size());
+        uint32_t index = addTexture(tex);
+        textureFiles[index] = file;
+        return index;
+    };
+
+    // opens the image textures of a scene pointed at a cache (visitArrays() leaves them closed);
+    // false if one cannot be read
+    bool bindTextures() {
+        textureFiles.assign(textures.size(), NoTexture);
+        for (size_t t = 0; t < textures.size(); ++t) {
+            const Texture& tex = textures[t];
+            if (tex.kind != ImageTexture) continue;
+            textureFiles[t] = textureCache().open(std::string(texturePaths.data() + tex.pathBegin, texturePaths.data() + tex.pathEnd));
+            if (textureFiles[t] == NoTexture) return false;
+        }
+        return true;
+    };
+
+    uint32_t addSphere(const glm::vec3& center, float radius, uint32_t material) {
+        sphereCx.push_back(center.x);
+        sphereCy.push_back(center.y);
+        sphereCz.push_back(center.z);
+        sphereRadius.push_back(radius);
+        sphereMaterial.push_back(material);
+        return makePrimId(SpherePrim, uint32_t(sphereRadius.size() - 1));
+    };
+
+    uint32_t addPlane(const glm::vec3& normal, const glm::vec3& point, uint32_t material) {
+        planeNx.push_back(normal.x);
+        planeNy.push_back(normal.y);
+        planeNz.push_back(normal.z);
+        planePx.push_back(point.x);
+        planePy.push_back(point.y);
+        planePz.push_back(point.z);
+        planeMaterial.push_back(material);
+        return makePrimId(PlanePrim, uint32_t(planeMaterial.size() - 1));
+    };
+
+    // vertex for triangles; a zero normal makes triangles using it shade with their face normal
+    uint32_t addVertex(const glm::vec3& position, const glm::vec3& normal = glm::vec3(0.0f, 0.0f, 0.0f)) {
+        vertexX.push_back(position.x);
+        vertexY.push_back(position.y);
+        vertexZ.push_back(position.z);
+        normalX.push_back(normal.x);
+        normalY.push_back(normal.y);
+        normalZ.push_back(normal.z);
+        return uint32_t(vertexX.size() - 1);
+    };
+
+    uint32_t addTriangle(uint32_t a, uint32_t b, uint32_t c, uint32_t material) {
+        triangleV0.push_back(a);
+        triangleV1.push_back(b);
+        triangleV2.push_back(c);
+        triangleMaterial.push_back(material);
+        return makePrimId(TrianglePrim, uint32_t(triangleMaterial.size() - 1));
+    };
+
+    // copy an authoring object into the scene, its material becomes a new table entry
+    uint32_t add(const Sphere& sphere) {
+        return addSphere(sphere.Center(), sphere.Radius(), addMaterial(materialOf(sphere)));
+    };
+    uint32_t add(const Plane& plane) {
+        return addPlane(plane.Normal(), plane.Point(), addMaterial(materialOf(plane)));
+    };
+    // all triangles of a mesh share one material, a new entry or one from the table
+    void add(const TriangleMesh& mesh) { add(mesh, addMaterial(materialOf(mesh))); };
+    void add(const TriangleMesh& mesh, uint32_t mat) {
+        uint32_t base = uint32_t(vertexX.size());
+        const std::vector<glm::vec3>& positions = mesh.Positions();
+        const std::vector<glm::vec3>& normals = mesh.Normals();
+        const std::vector<uint32_t>& indices = mesh.Indices();
+        for (size_t i = 0; i < positions.size(); ++i) addVertex(positions[i], normals[i]);
+        for (size_t t = 0; t < mesh.TriangleCount(); ++t) {
+            addTriangle(base + indices[3*t], base + indices[3*t + 1], base + indices[3*t + 2], mat);
+        }
+    };
+
+    // the spheres and triangles added until endPrototype() form a prototype (planes cannot be part
+    // of one); returns its index for addInstance()
+    uint32_t beginPrototype() {
+        Prototype p;
+        p.sphereBegin = p.sphereEnd = uint32_t(sphereRadius.size());
+        p.triangleBegin = p.triangleEnd = uint32_t(triangleMaterial.size());
+        prototypes.push_back(p);
+        prototypeOpen = true;
+        return uint32_t(prototypes.size() - 1);
+    };
+
+    void endPrototype() {
+        Prototype p = prototypes[prototypes.size() - 1];
+        p.sphereEnd = uint32_t(sphereRadius.size());
+        p.triangleEnd = uint32_t(triangleMaterial.size());
+        for (uint32_t i = p.sphereBegin; i < p.sphereEnd; ++i) p.bounds.grow(primBounds(makePrimId(SpherePrim, i)));
+        for (uint32_t i = p.triangleBegin; i < p.triangleEnd; ++i) p.bounds.grow(primBounds(makePrimId(TrianglePrim, i)));
+        prototypes.set(prototypes.size() - 1, p);
+        prototypeOpen = false;
+    };
+
+    // places a finished prototype with objectToWorld (affine), all of its primitives in material
+    // unless that is NoMaterial. returns the instance index, or NoHit once the instances hold
+    // MaxInstancedPrims primitives
+    uint32_t addInstance(uint32_t prototype, const glm::mat4& objectToWorld, uint32_t material = NoMaterial) {
+        const Prototype& p = prototypes[prototype];
+        uint32_t first = instancedPrims;
+        if (p.primCount() > MaxInstancedPrims - first) return NoHit;
+        instancedPrims += p.primCount();
+
+        Instance inst;
+        glm::mat4 toObject = glm::inverse(objectToWorld);
+        for (int r = 0; r < 3; ++r) inst.toObject[r] = glm::vec4(toObject[0][r], toObject[1][r], toObject[2][r], toObject[3][r]);
+        inst.prototype = prototype;
+        inst.material = material;
+        inst.firstPrim = first;
+        instances.push_back(inst);
+
+        // world bounds: the transformed corners of the prototype's box
+        AABB box;
+        for (int c = 0; c < 8 && !p.bounds.empty(); ++c) {
+            glm::vec3 corner((c & 1) ? p.bounds.bmax.x : p.bounds.bmin.x, (c & 2) ? p.bounds.bmax.y : p.bounds.bmin.y,
+                             (c & 4) ? p.bounds.bmax.z : p.bounds.bmin.z);
+            glm::vec4 w = objectToWorld * glm::vec4(corner, 1.0f);
+            box.grow(glm::vec3(w.x, w.y, w.z));
+        }
+        instanceBounds.push_back(box);
+        return uint32_t(instances.size() - 1);
+    };
+
+    // (re)build the acceleration structures, required after adding primitives: a tree per prototype
+    // and the scene BVH over the spheres and triangles outside prototypes and the instances. the
+    // leaves of the scene BVH name an instance by makePrimId(InstancePrim, instance index), hits
+    // inside it by the InstancePrim index of the primitive
+    void commit() {
+        generation = nextGeneration();
+        std::vector<AABB> boxes;
+        std::vector<uint32_t> ids;
+        std::vector<uint32_t> groupEnds;
+        std::vector<uint8_t> sphereInPrototype(sphereRadius.size(), 0);
+        std::vector<uint8_t> triangleInPrototype(triangleMaterial.size(), 0);
+        for (const Prototype& p : prototypes) {
+            for (uint32_t i = p.sphereBegin; i < p.sphereEnd; ++i) {
+                ids.push_back(makePrimId(SpherePrim, i));
+                sphereInPrototype[i] = 1;
+            }
+            for (uint32_t i = p.triangleBegin; i < p.triangleEnd; ++i) {
+                ids.push_back(makePrimId(TrianglePrim, i));
+                triangleInPrototype[i] = 1;
+            }
+            groupEnds.push_back(uint32_t(ids.size()));
+        }
+        for (uint32_t id : ids) boxes.push_back(primBounds(id));
+        prototypeBvh.build(boxes, ids, groupEnds);
+
+        boxes.clear();
+        ids.clear();
+        boxes.reserve(sphereRadius.size() + triangleMaterial.size() + instances.size());
+        ids.reserve(sphereRadius.size() + triangleMaterial.size() + instances.size());
+        for (uint32_t i = 0; i < sphereRadius.size(); ++i) {
+            if (!sphereInPrototype[i]) ids.push_back(makePrimId(SpherePrim, i));
+        }
+        for (uint32_t i = 0; i < triangleMaterial.size(); ++i) {
+            if (!triangleInPrototype[i]) ids.push_back(makePrimId(TrianglePrim, i));
+        }
+        for (uint32_t k = 0; k < instances.size(); ++k) {
+            if (!instanceBounds[k].empty()) ids.push_back(makePrimId(InstancePrim, k));
+        }
+        for (uint32_t id : ids) boxes.push_back(leafBounds(id));
+        bvh.build(boxes, ids);
+    };
+
+    // true for a sphere of the scene itself, false for one in a prototype (or past the last sphere)
+    bool isWorldSphere(uint32_t index) const {
+        if (index >= sphereRadius.size()) return false;
+        for (const Prototype& p : prototypes) {
+            if (index >= p.sphereBegin && index < p.sphereEnd) return false;
+        }
+        return true;
+    };
+
+    // moves and resizes a committed sphere outside prototypes; only the BVH nodes above it are
+    // refitted, no rebuild. returns false, changing nothing, unless isWorldSphere(index)
+    bool setSphere(uint32_t index, const glm::vec3& center, float radius) {
+        if (!isWorldSphere(index)) return false;
+        generation = nextGeneration();
+        sphereCx.set(index, center.x);
+        sphereCy.set(index, center.y);
+        sphereCz.set(index, center.z);
+        sphereRadius.set(index, radius);
+        return bvh.refit(makePrimId(SpherePrim, index), [&](uint32_t id) { return leafBounds(id); });
+    };
+
+    // bounds of a primitive, unbounded for planes; instanced primitives are bounded by their instance
+    AABB primBounds(uint32_t id) const {
+        uint32_t i = primIndex(id);
+        switch (primKind(id)) {
+            case InstancePrim: {
+                uint32_t local;
+                return instanceBounds[instanceOf(id, local)];
+            }
+            case SpherePrim: {
+                glm::vec3 r(sphereRadius[i], sphereRadius[i], sphereRadius[i]);
+                return AABB(sphereCenter(i) - r, sphereCenter(i) + r);
+            }
+            case PlanePrim: return AABB(glm::vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX), glm::vec3(FLT_MAX, FLT_MAX, FLT_MAX));
+            default: {
+                AABB box;
+                box.grow(vertex(triangleV0[i]));
+                box.grow(vertex(triangleV1[i]));
+                box.grow(vertex(triangleV2[i]));
+                return box;
+            }
+        }
+    };
+
+    // closest hit with tMin < t; the primitive ignore is skipped (self intersection of secondary rays)
+    Hit intersect(const glm::vec3& origin, const glm::vec3& dir, float tMin, uint32_t ignore = NoHit) const {
+        Hit hit;
+        uint64_t tests = 0;
+        auto test = [&](uint32_t id) {
+            if (primKind(id) == InstancePrim) return intersectInstance(primIndex(id), origin, dir, tMin, ignore, hit);
+            if (id == ignore) return;
+            tests++;
+            float dist_ = primDistance(id, origin, dir);
+            if (dist_ > tMin && dist_ < hit.t) {
+                hit.t = dist_;
+                hit.primId = id;
+            }
+        };
+        for (uint32_t i = 0; i < planeMaterial.size(); ++i) test(makePrimId(PlanePrim, i));
+        bvh.closest(origin, dir, tMin, hit.t, test);
+        profileCount(&ProfileCounts::primTests, tests);
+        return hit;
+    };
+
+    // closest hit for every lane of a packet, hits[l].primId is NoHit for lanes without a hit
+    void intersect(const RayPacket& packet, float tMin, Hit* hits) const {
+        float tMax[MaxPacketSize];
+        float dist[MaxPacketSize];
+        for (int l = 0; l < packet.size; ++l) tMax[l] = FLT_MAX;
+
+        uint64_t tests = 0;
+        auto test = [&](uint32_t id) {
+            if (primKind(id) == InstancePrim) {
+                // lane by lane in object space
+                for (int l = 0; l < packet.size; ++l) {
+                    Hit hit;
+                    hit.t = tMax[l];
+                    hit.primId = hits[l].primId;
+                    intersectInstance(primIndex(id), packet.origin(l), packet.direction(l), tMin, NoHit, hit);
+                    tMax[l] = hit.t;
+                    hits[l].primId = hit.primId;
+                }
+                return;
+            }
+            tests += uint64_t(packet.size);
+            primDistance(id, packet, dist);
+            for (int l = 0; l < packet.size; ++l) {
+                if (dist[l] > tMin && dist[l] < tMax[l]) {
+                    tMax[l] = dist[l];
+                    hits[l].primId = id;
+                }
+            }
+        };
+        for (int l = 0; l < packet.size; ++l) hits[l] = Hit();
+        for (uint32_t i = 0; i < planeMaterial.size(); ++i) test(makePrimId(PlanePrim, i));
+        bvh.closest(packet, tMin, tMax, test);
+        for (int l = 0; l < packet.size; ++l) hits[l].t = tMax[l];
+        profileCount(&ProfileCounts::primTests, tests);
+    };
+
+    // occlusion (any hit) query for shadow rays: is there a primitive other than ignore with 0 <= t <= tMax?
+    // no hit attributes are computed and the search stops at the first blocker. every thread remembers
+    // the primitive that blocked its last shadow ray and tests it first, since neighbouring pixels are
+    // usually shadowed by the same object. blocker, if given, receives the primitive found
+    bool occluded(const glm::vec3& origin, const glm::vec3& dir, float tMax, uint32_t ignore = NoHit,
+                  uint32_t* blocker = nullptr) const {
+        thread_local OcclusionCache cache;
+        bool cacheValid = cache.scene == this && cache.generation == generation;
+
+        uint64_t tests = 0;
+        auto occludes = [&](uint32_t id) {
+            if (id == ignore) return false;
+            tests++;
+            float dist_ = primDistance(id, origin, dir);
+            return dist_ >= 0.0f && dist_ <= tMax;
+        };
+        auto remember = [&](uint32_t id) {
+            if (blocker) *blocker = id;
+            cache.scene = this;
+            cache.generation = generation;
+            cache.lastOccluder = id;
+            profileCount(&ProfileCounts::primTests, tests);
+            profileCount(&ProfileCounts::shadowBlocked);
+            return true;
+        };
+
+        if (cacheValid && cache.lastOccluder != NoHit && occludes(cache.lastOccluder)) {
+            if (blocker) *blocker = cache.lastOccluder;
+            profileCount(&ProfileCounts::primTests, tests);
+            profileCount(&ProfileCounts::shadowBlocked);
+            profileCount(&ProfileCounts::shadowCached);
+            return true;
+        }
+        for (uint32_t i = 0; i < planeMaterial.size(); ++i) {
+            uint32_t id = makePrimId(PlanePrim, i);
+            if (occludes(id)) return remember(id);
+        }
+        uint32_t found = NoHit;
+        bool hit = bvh.any(origin, dir, tMax, [&](uint32_t id) {
+            if (primKind(id) == InstancePrim) {
+                found = occludingInstanced(primIndex(id), origin, dir, tMax, ignore, tests);
+                return found != NoHit;
+            }
+            if (!occludes(id)) return false;
+            found = id;
+            return true;
+        });
+        if (!hit) profileCount(&ProfileCounts::primTests, tests);
+        return hit && remember(found);
+    };
+
+    // hit position and surface normal, computed once for the winning hit. triangles are two-sided,
+    // their normal (interpolated from the vertex normals if there are any) faces the incoming ray
+    void attributes(const glm::vec3& origin, const glm::vec3& dir, const Hit& hit,
+                    glm::vec3& intersectPos, glm::vec3& normal) const {
+        uint32_t i = primIndex(hit.primId);
+        intersectPos = origin + dir*hit.t;
+        switch (primKind(hit.primId)) {
+            case SpherePrim: normal = glm::normalize(intersectPos - sphereCenter(i)); break;
+            case PlanePrim: normal = planeNormal(i); break;
+            case TrianglePrim: normal = triangleNormal(i, origin, dir); break;
+            default: {
+                uint32_t local;
+                const Instance& inst = instances[instanceOf(hit.primId, local)];
+                glm::vec3 o = inst.point(origin);
+                glm::vec3 d = inst.vector(dir);
+                float scale = glm::length(d);
+                d /= scale;
+                Hit objectHit;
+                objectHit.t = hit.t * scale;
+                objectHit.primId = local;
+                glm::vec3 objectPos;
+                attributes(o, d, objectHit, objectPos, normal);
+                normal = inst.normal(normal);
+                break;
+            }
+        }
+    };
+
+    const Material& material(uint32_t id) const { return materials[materialIndex(id)]; };
+
+    // color (0-1) of texture t at the point pos of primitive id, filtered over footprint world units
+    glm::vec3 textureColor(uint32_t t, uint32_t id, const glm::vec3& pos, float footprint) const {
+        const Texture& tex = textures[t];
+        glm::vec2 uv;
+        float width = footprint * surfaceUV(id, pos, uv) * tex.scale;
+        uv *= tex.scale;
+        if (tex.kind == ImageTexture) return textureCache().sample(textureFiles[t], uv, width);
+        return glm::mix(tex.colorA, tex.colorB, checkerWeight(uv, width));
+    };
+
+    // texture coordinates of the point pos of primitive id; returns their change per world unit.
+    // spheres are mapped by longitude and latitude (v = 0 at the top), planes by the world distances
+    // along two axes in the plane, triangles by the world coordinates across their dominant axis.
+    // instanced primitives are mapped in object space, so the texture moves with the instance
+    float surfaceUV(uint32_t id, const glm::vec3& pos, glm::vec2& uv) const {
+        uint32_t i = primIndex(id);
+        switch (primKind(id)) {
+            case SpherePrim: {
+                glm::vec3 n = (pos - sphereCenter(i)) / sphereRadius[i];
+                uv = glm::vec2(0.5f + std::atan2(n.z, n.x) / (2.0f * 3.14159265f), std::acos(glm::clamp(n.y, -1.0f, 1.0f)) / 3.14159265f);
+                return 1.0f / (3.14159265f * sphereRadius[i]);
+            }
+            case PlanePrim: {
+                glm::vec3 n = planeNormal(i);
+                glm::vec3 t = glm::normalize(glm::cross(n, std::abs(n.y) < 0.9f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f)));
+                glm::vec3 b = glm::cross(n, t);
+                glm::vec3 d = pos - planePoint(i);
+                uv = glm::vec2(glm::dot(d, t), glm::dot(d, b));
+                return 1.0f;
+            }
+            case TrianglePrim: {
+                glm::vec3 v0 = vertex(triangleV0[i]);
+                glm::vec3 f = glm::abs(glm::cross(vertex(triangleV1[i]) - v0, vertex(triangleV2[i]) - v0));
+                if (f.x >= f.y && f.x >= f.z) uv = glm::vec2(pos.z, pos.y);
+                else if (f.y >= f.z) uv = glm::vec2(pos.x, pos.z);
+                else uv = glm::vec2(pos.x, pos.y);
+                return 1.0f;
+            }
+            default: {
+                uint32_t local;
+                const Instance& inst = instances[instanceOf(id, local)];
+                // object units per world unit, the largest stretch of the world to object transform
+                float stretch = 0.0f;
+                for (int r = 0; r < 3; ++r) {
+                    stretch = std::max(stretch, glm::length(glm::vec3(inst.toObject[r].x, inst.toObject[r].y, inst.toObject[r].z)));
+                }
+                return surfaceUV(local, inst.point(pos), uv) * stretch;
+            }
+        }
+    };
+
+    // index of the primitive's material in the material table
+    uint32_t materialIndex(uint32_t id) const {
+        uint32_t i = primIndex(id);
+        switch (primKind(id)) {
+            case SpherePrim: return sphereMaterial[i];
+            case PlanePrim: return planeMaterial[i];
+            case TrianglePrim: return triangleMaterial[i];
+            default: {
+                uint32_t local;
+                const Instance& inst = instances[instanceOf(id, local)];
+                return inst.material != NoMaterial ? inst.material : materialIndex(local);
+            }
+        }
+    };
+
+    // every array of the scene including the BVH, in a fixed order; used to write the binary scene
+    // cache and to point a scene at a mapped one. the arrays may be modified, so the occlusion
+    // caches are invalidated
+    template<typename Visitor>
+    void visitArrays(Visitor&& visit) {
+        generation = nextGeneration();
+        visit(materials);
+        visit(textures);
+        visit(texturePaths);
+        visit(sphereCx);
+        visit(sphereCy);
+        visit(sphereCz);
+        visit(sphereRadius);
+        visit(sphereMaterial);
+        visit(planeNx);
+        visit(planeNy);
+        visit(planeNz);
+        visit(planePx);
+        visit(planePy);
+        visit(planePz);
+        visit(planeMaterial);
+        visit(vertexX);
+        visit(vertexY);
+        visit(vertexZ);
+        visit(normalX);
+        visit(normalY);
+        visit(normalZ);
+        visit(triangleV0);
+        visit(triangleV1);
+        visit(triangleV2);
+        visit(triangleMaterial);
+        visit(prototypes);
+        visit(instances);
+        visit(instanceBounds);
+        bvh.visitArrays(visit);
+        prototypeBvh.visitArrays(visit);
+        // restores the primitive count of a mapped scene (instances are only ever appended)
+        instancedPrims = 0;
+        if (!instances.empty() && instances[instances.size() - 1].prototype < prototypes.size()) {
+            const Instance& last = instances[instances.size() - 1];
+            instancedPrims = last.firstPrim + prototypes[last.prototype].primCount();
+        }
+    };
+
+    // every index in the arrays refers to an existing element and the BVH trees are well formed, so
+    // rendering stays inside the arrays; checked after pointing the scene at a cache, which may be
+    // truncated, corrupt or come from another machine
+    bool valid() const {
+        size_t spheres = sphereRadius.size();
+        size_t triangles = triangleMaterial.size();
+        size_t vertices = vertexX.size();
+        if (sphereCx.size() != spheres || sphereCy.size() != spheres || sphereCz.size() != spheres ||
+            sphereMaterial.size() != spheres) return false;
+        size_t planes = planeMaterial.size();
+        if (planeNx.size() != planes || planeNy.size() != planes || planeNz.size() != planes || planePx.size() != planes ||
+            planePy.size() != planes || planePz.size() != planes) return false;
+        if (vertexY.size() != vertices || vertexZ.size() != vertices || normalX.size() != vertices ||
+            normalY.size() != vertices || normalZ.size() != vertices) return false;
+        if (triangleV0.size() != triangles || triangleV1.size() != triangles || triangleV2.size() != triangles) return false;
+
+        auto isMaterial = [&](uint32_t m) { return m < materials.size(); };
+        for (const Material& m : materials) {
+            if (m.texture != NoTexture && m.texture >= textures.size()) return false;
+        }
+        for (const Texture& t : textures) {
+            if (t.kind != CheckerTexture && t.kind != ImageTexture) return false;
+            if (t.kind == ImageTexture && (t.pathBegin > t.pathEnd || t.pathEnd > texturePaths.size())) return false;
+        }
+        for (uint32_t m : sphereMaterial) {
+            if (!isMaterial(m)) return false;
+        }
+        for (uint32_t m : planeMaterial) {
+            if (!isMaterial(m)) return false;
+        }
+        for (size_t i = 0; i < triangles; ++i) {
+            if (!isMaterial(triangleMaterial[i]) || triangleV0[i] >= vertices || triangleV1[i] >= vertices ||
+                triangleV2[i] >= vertices) return false;
+        }
+        for (const Prototype& p : prototypes) {
+            if (p.sphereBegin > p.sphereEnd || p.sphereEnd > spheres || p.triangleBegin > p.triangleEnd ||
+                p.triangleEnd > triangles) return false;
+        }
+        // instances number their primitives consecutively (see addInstance)
+        uint64_t prims = 0;
+        for (const Instance& inst : instances) {
+            if (inst.prototype >= prototypes.size() || (inst.material != NoMaterial && !isMaterial(inst.material)) ||
+                inst.firstPrim != prims) return false;
+            prims += prototypes[inst.prototype].primCount();
+        }
+        if (prims > MaxInstancedPrims || instanceBounds.size() != instances.size()) return false;
+
+        // planes are not in the trees
+        bool sceneTree = bvh.valid(1, [&](uint32_t id) {
+            uint32_t i = primIndex(id);
+            switch (primKind(id)) {
+                case SpherePrim: return i < spheres;
+                case TrianglePrim: return i < triangles;
+                case InstancePrim: return i < instances.size();
+                default: return false;
+            }
+        });
+        return sceneTree && prototypeBvh.valid(prototypes.size(), [&](uint32_t id) {
+            uint32_t i = primIndex(id);
+            return (primKind(id) == SpherePrim && i < spheres) || (primKind(id) == TrianglePrim && i < triangles);
+        });
+    };
+
+    size_t SphereCount() const { return sphereRadius.size(); };
+    size_t PlaneCount() const { return planeMaterial.size(); };
+    size_t TriangleCount() const { return triangleMaterial.size(); };
+    size_t MaterialCount() const { return materials.size(); };
+    size_t TextureCount() const { return textures.size(); };
+    size_t PrototypeCount() const { return prototypes.size(); };
+    size_t InstanceCount() const { return instances.size(); };
+    bool PrototypeOpen() const { return prototypeOpen; };
+
+private:
+    static Material materialOf(const Object& obj) {
+        return Material(obj.Color(), obj.Reflect(), obj.AmbientFactor(), obj.SpecularExponent());
+    };
+
+    glm::vec3 sphereCenter(uint32_t i) const { return glm::vec3(sphereCx[i], sphereCy[i], sphereCz[i]); };
+    glm::vec3 planeNormal(uint32_t i) const { return glm::vec3(planeNx[i], planeNy[i], planeNz[i]); };
+    glm::vec3 planePoint(uint32_t i) const { return glm::vec3(planePx[i], planePy[i], planePz[i]); };
+    glm::vec3 vertex(uint32_t v) const { return glm::vec3(vertexX[v], vertexY[v], vertexZ[v]); };
+    glm::vec3 vertexNormal(uint32_t v) const { return glm::vec3(normalX[v], normalY[v], normalZ[v]); };
+
+    glm::vec3 triangleNormal(uint32_t i, const glm::vec3& origin, const glm::vec3& dir) const {
+        uint32_t a = triangleV0[i], b = triangleV1[i], c = triangleV2[i];
+        glm::vec3 v0 = vertex(a), v1 = vertex(b), v2 = vertex(c);
+        glm::vec3 face = glm::normalize(glm::cross(v1 - v0, v2 - v0));
+        float flip = glm::dot(face, dir) > 0.0f ? -1.0f : 1.0f;
+        glm::vec3 n0 = vertexNormal(a), n1 = vertexNormal(b), n2 = vertexNormal(c);
+        glm::vec3 zero(0.0f, 0.0f, 0.0f);
+        if (n0 == zero && n1 == zero && n2 == zero) return face * flip;
+
+        // interpolate with the barycentrics of the hit
+        float b1 = 0.0f, b2 = 0.0f;
+        triangleDistance(origin, dir, v0, v1, v2, &b1, &b2);
+        glm::vec3 n = n0*(1.0f - b1 - b2) + n1*b1 + n2*b2;
+        if (glm::dot(n, n) == 0.0f) return face * flip;
+        return glm::normalize(n) * flip;
+    };
+
+    float primDistance(uint32_t id, const glm::vec3& origin, const glm::vec3& dir) const {
+        uint32_t i = primIndex(id);
+        switch (primKind(id)) {
+            case SpherePrim: return sphereDistance(origin, dir, sphereCenter(i), sphereRadius[i]);
+            case PlanePrim: return planeDistance(origin, dir, planeNormal(i), planePoint(i));
+            case TrianglePrim: return triangleDistance(origin, dir, vertex(triangleV0[i]), vertex(triangleV1[i]), vertex(triangleV2[i]));
+            default: {
+                // an instanced primitive on its own, e.g. the cached blocker of a shadow ray
+                uint32_t local;
+                const Instance& inst = instances[instanceOf(id, local)];
+                glm::vec3 d = inst.vector(dir);
+                float scale = glm::length(d);
+                return primDistance(local, inst.point(origin), d / scale) / scale;
+            }
+        }
+    };
+
+    // bounds of a leaf entry of the scene BVH
+    AABB leafBounds(uint32_t id) const {
+        return primKind(id) == InstancePrim ? instanceBounds[primIndex(id)] : primBounds(id);
+    };
+
+    // the prototype primitive behind id if id is a primitive of inst, NoHit otherwise
+    uint32_t localId(const Instance& inst, uint32_t id) const {
+        if (id == NoHit || primKind(id) != InstancePrim) return NoHit;
+        uint32_t n = primIndex(id);
+        if (n < inst.firstPrim || n - inst.firstPrim >= prototypes[inst.prototype].primCount()) return NoHit;
+        uint32_t local;
+        instanceOf(id, local);
+        return local;
+    };
+
+    // the instance of an instanced primitive id, local receives the id of the prototype's primitive
+    uint32_t instanceOf(uint32_t id, uint32_t& local) const {
+        uint32_t n = primIndex(id);
+        const Instance* it = std::upper_bound(instances.begin(), instances.end(), n,
+                                              [](uint32_t f, const Instance& inst) { return f < inst.firstPrim; });
+        uint32_t k = uint32_t(it - instances.begin()) - 1;
+        const Prototype& p = prototypes[instances[k].prototype];
+        n -= instances[k].firstPrim;
+        uint32_t spheres = p.sphereEnd - p.sphereBegin;
+        local = n < spheres ? makePrimId(SpherePrim, p.sphereBegin + n) : makePrimId(TrianglePrim, p.triangleBegin + n - spheres);
+        return k;
+    };
+
+    // the InstancePrim id of primitive local of the prototype of instance k
+    uint32_t instancedId(const Instance& inst, uint32_t local) const {
+        const Prototype& p = prototypes[inst.prototype];
+        uint32_t i = primIndex(local);
+        uint32_t n = primKind(local) == SpherePrim ? i - p.sphereBegin : (p.sphereEnd - p.sphereBegin) + i - p.triangleBegin;
+        return makePrimId(InstancePrim, inst.firstPrim + n);
+    };
+
+    // closest hit inside instance k, in its object space: the direction is normalized there, so
+    // object distances are world distances times its length. lowers hit if closer
+    void intersectInstance(uint32_t k, const glm::vec3& origin, const glm::vec3& dir, float tMin, uint32_t ignore,
+                           Hit& hit) const {
+        const Instance& inst = instances[k];
+        glm::vec3 o = inst.point(origin);
+        glm::vec3 d = inst.vector(dir);
+        float scale = glm::length(d);
+        d /= scale;
+        float objectMin = tMin * scale;
+        float objectMax = hit.t * scale;
+        uint32_t skip = localId(inst, ignore);
+        uint32_t closest = NoHit;
+        uint64_t tests = 0;
+        prototypeBvh.closest(o, d, objectMin, objectMax, [&](uint32_t id) {
+            if (id == skip) return;
+            tests++;
+            float dist_ = primDistance(id, o, d);
+            if (dist_ > objectMin && dist_ < objectMax) {
+                objectMax = dist_;
+                closest = id;
+            }
+        }, prototypeBvh.Root(inst.prototype));
+        profileCount(&ProfileCounts::primTests, tests);
+        if (closest == NoHit) return;
+        hit.t = objectMax / scale;
+        hit.primId = instancedId(inst, closest);
+    };
+
+    // a primitive of instance k other than ignore that blocks the shadow ray, as an InstancePrim id
+    uint32_t occludingInstanced(uint32_t k, const glm::vec3& origin, const glm::vec3& dir, float tMax, uint32_t ignore,
+                                uint64_t& tests) const {
+        const Instance& inst = instances[k];
+        glm::vec3 o = inst.point(origin);
+        glm::vec3 d = inst.vector(dir);
+        float scale = glm::length(d);
+        d /= scale;
+        float objectMax = tMax * scale;
+        uint32_t skip = localId(inst, ignore);
+        uint32_t found = NoHit;
+        prototypeBvh.any(o, d, objectMax, [&](uint32_t id) {
+            if (id == skip) return false;
+            tests++;
+            float dist_ = primDistance(id, o, d);
+            if (dist_ < 0.0f || dist_ > objectMax) return false;
+            found = id;
+            return true;
+        }, prototypeBvh.Root(inst.prototype));
+        return found == NoHit ? NoHit : instancedId(inst, found);
+    };
+
+    void primDistance(uint32_t id, const RayPacket& packet, float* dist) const {
+        uint32_t i = primIndex(id);
+        switch (primKind(id)) {
+            case SpherePrim: intersectSpherePacket(packet, sphereCenter(i), sphereRadius[i], dist); break;
+            case PlanePrim: intersectPlanePacket(packet, planeNormal(i), planePoint(i), dist); break;
+            default: intersectTrianglePacket(packet, vertex(triangleV0[i]), vertex(triangleV1[i]), vertex(triangleV2[i]), dist); break;
+        }
+    };
+
+    // process-wide, so a new scene at the address of a destroyed one never matches a stale cache
+    static uint32_t nextGeneration() {
+        static std::atomic<uint32_t> counter(0);
+        return ++counter;
+    };
+
+    // sphere geometry
+    Array<float> sphereCx, sphereCy, sphereCz, sphereRadius;
+    Array<uint32_t> sphereMaterial;
+    // plane geometry
+    Array<float> planeNx, planeNy, planeNz;
+    Array<float> planePx, planePy, planePz;
+    Array<uint32_t> planeMaterial;
+    // triangle geometry: shared vertices (normal zero if not given) and three vertex indices per triangle
+    Array<float> vertexX, vertexY, vertexZ;
+    Array<float> normalX, normalY, normalZ;
+    Array<uint32_t> triangleV0, triangleV1, triangleV2;
+    Array<uint32_t> triangleMaterial;
+
+    // instancing
+    Array<Prototype> prototypes;
+    Array<Instance> instances;
+    Array<AABB> instanceBounds; // world bounds of every instance
+    uint32_t instancedPrims = 0; // primitives of all instances
+    bool prototypeOpen = false;  // between beginPrototype() and endPrototype()
+
+    Array<Material> materials;
+    // texture table, the characters of all image paths, and the texture cache file of every image
+    // texture (NoTexture for the others), which is not part of the scene cache
+    Array<Texture> textures;
+    Array<char> texturePaths;
+    std::vector<uint32_t> textureFiles;
+    BVH bvh;
+    BVH prototypeBvh; // a tree per prototype
+    // renewed by every commit, invalidates the per-thread occlusion caches
+    uint32_t generation = nextGeneration();
+};
+
+#endif
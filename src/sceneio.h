@@ -0,0 +1,516 @@
+#ifndef SCENEIO_H_
+#define SCENEIO_H_
+
+#include <glm/glm.hpp>
+#include <glm/vec3.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "camera.h"
+#include "lights.h"
+#include "material.h"
+#include "plane.h"
+#include "scene.h"
+#include "sphere.h"
+#include "trianglemesh.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RAYTRACER_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// everything needed to render a frame; the defaults are the hard-coded assignment setup
+struct SceneDescription {
+    SceneDescription() {
+        lights.addPoint(glm::vec3(-1.9f, 1.9f, 0.0f));
+        lights.commit();
+    }
+
+    int width = 800;
+    int height = 600;
+    CameraDesc camera;
+    LightSet lights;
+    glm::vec3 background = glm::vec3(0.5f, 0.0f, 1.0f);
+    Scene scene;
+    // the files the scene was read from (scene file, meshes, texture images), each followed by a 0
+    Array<char> sources;
+
+    void addSource(const std::string& path) {
+        for (char c : path) sources.push_back(c);
+        sources.push_back(0);
+    };
+    std::vector<std::string> Sources() const {
+        std::vector<std::string> paths;
+        const char* begin = sources.begin();
+        for (const char* p = begin; p != sources.end(); ++p) {
+            if (*p != 0) continue;
+            paths.push_back(std::string(begin, p));
+            begin = p + 1;
+        }
+        return paths;
+    };
+
+    // the scene arrays, the light arrays and the source paths (used by the scene cache)
+    template<typename Visitor>
+    void visitArrays(Visitor&& visit) {
+        scene.visitArrays(visit);
+        lights.visitArrays(visit);
+        visit(sources);
+    };
+};
+
+// fingerprint of the paths, sizes and modification times of the files, 0 if one cannot be read
+inline uint64_t sourceStamp(const std::vector<std::string>& files) {
+    uint64_t h = 14695981039346656037ull; // FNV-1a
+    auto mix = [&](uint64_t v) {
+        h ^= v;
+        h *= 1099511628211ull;
+    };
+    for (const std::string& file : files) {
+        std::error_code ec1, ec2;
+        auto time = std::filesystem::last_write_time(file, ec1);
+        uintmax_t size = std::filesystem::file_size(file, ec2);
+        if (ec1 || ec2) return 0;
+        for (char c : file) mix(uint8_t(c));
+        mix(uint64_t(time.time_since_epoch().count()));
+        mix(uint64_t(size));
+    }
+    return h;
+}
+
+// the built-in assignment scene is built in two steps: the spheres of parts 2 to 4, then the box of
+// planes added for parts 5 and 6. both commit the scene
+inline void addAssignmentSpheres(Scene& scene) {
+    scene.add(Sphere(glm::vec3(1.0, 0.5, 0.0), 0.75, glm::vec3(0.0, 0.0, -5.0), true));
+    scene.add(Sphere(glm::vec3(0.0, 1.0, 0.5), 0.5, glm::vec3(1.0, 0.0, -5.5), false));
+    scene.add(Sphere(glm::vec3(0.0, 0.5, 1.0), 0.2, glm::vec3(-1.0, 0.5, -3.0), false));
+    scene.add(Sphere(glm::vec3(1.0, 0.5, 0.5), 0.2, glm::vec3(-0.5, -0.5, -2.5), false));
+    scene.commit();
+}
+
+inline void addAssignmentPlanes(Scene& scene) {
+    scene.add(Plane(glm::vec3(0.75, 0.75, 0.75), glm::vec3(0.0, 1.0, 0.0), glm::vec3(0.0, -1.0, 0.0), true));
+    scene.add(Plane(glm::vec3(0.75, 0.75, 0.75), glm::vec3(-1.0, 0.0, 0.0), glm::vec3(2.0, 0.0, 0.0), false));
+    scene.add(Plane(glm::vec3(0.75, 0.75, 0.75), glm::vec3(0.0, 0.0, 1.0), glm::vec3(0.0, 0.0, -10.0), false));
+    scene.add(Plane(glm::vec3(0.75, 0.75, 0.75), glm::vec3(1.0, 0.0, 0.0), glm::vec3(-3.0, 0.0, 0.0), false));
+    scene.add(Plane(glm::vec3(0.75, 0.75, 0.75), glm::vec3(0.0, -1.0, 0.0), glm::vec3(0.0, 2.5, 0.0), false));
+    scene.add(Plane(glm::vec3(0.75, 0.75, 0.75), glm::vec3(0.0, 0.0, -1.0), glm::vec3(0.0, 0.0, 2.0), false));
+    scene.commit();
+}
+
+// Text scene format, one statement per line, '#' starts a comment:
+//   resolution <width> <height>
+//   camera <eye xyz> <up xyz> <w xyz> <fov> [<focal length>]
+//   lens <aperture radius> <focus distance>
+//   light <xyz> [intensity <rgb>] [range <distance>]
+//   arealight <corner xyz> <edge xyz> <edge xyz> [intensity <rgb>] [range <distance>]
+//   background <rgb>
+//   texture <name> checker <rgb> <rgb> [scale <s>]   (squares of 1/s texture units)
+//   texture <name> image <PPM file, relative to the scene file> [scale <s>]   (repeats every 1/s units)
+//   material <name> <rgb> [reflective] [ambient <a>] [specular <exponent>] [texture <texture>]
+//            (specular 0: no highlight; the texture color multiplies rgb)
+//   sphere <material> <radius> <center xyz>
+//   plane <material> <normal xyz> <point xyz>
+//   mesh <material> <OBJ file, relative to the scene file>
+//   prototype <name>   (the sphere and mesh statements up to the next 'end' define geometry that is
+//   end                 only placed by instance statements, however often)
+//   instance <prototype> [material <material>] [scale <s> | scale <xyz>] [rotate <axis xyz> <degrees>]
+//            [translate <xyz>]   (transforms apply in the order given; material replaces all of the
+//                                 prototype's materials)
+// textures are mapped in world units on planes and triangles and once around a sphere (see
+// Scene::surfaceUV). materials and textures have to be declared before they are used. the first light statement replaces the
+// default assignment light, further ones add lights (see Light for intensity and range). on error a message with the line number is
+// printed to std::cerr and false is returned.
+inline bool parseScene(std::istream& in, SceneDescription& desc, const std::string& name = "scene") {
+    std::map<std::string, uint32_t> materials;
+    std::map<std::string, uint32_t> textures;
+    std::map<std::string, uint32_t> prototypes;
+    std::filesystem::path dir = std::filesystem::path(name).parent_path();
+    bool lightsDeclared = false;
+    std::string line;
+    int lineNo = 0;
+    auto fail = [&](const std::string& msg) {
+        std::cerr << name << ":" << lineNo << ": " << msg << std::endl;
+        return false;
+    };
+
+    while (std::getline(in, line)) {
+        lineNo++;
+        size_t hash = line.find('#');
+        if (hash != std::string::npos) line.erase(hash);
+        std::istringstream ls(line);
+        std::string keyword;
+        if (!(ls >> keyword)) continue;
+
+        auto vec = [&](glm::vec3& v) { return bool(ls >> v.x >> v.y >> v.z); };
+        auto material = [&](uint32_t& id) {
+            std::string matName;
+            if (!(ls >> matName)) return false;
+            auto it = materials.find(matName);
+            if (it == materials.end()) return false;
+            id = it->second;
+            return true;
+        };
+
+        if (keyword == "resolution") {
+            if (!(ls >> desc.width >> desc.height) || desc.width < 2 || desc.height < 2) return fail("bad resolution");
+        } else if (keyword == "camera") {
+            CameraDesc& cam = desc.camera;
+            if (!vec(cam.eye) || !vec(cam.up) || !vec(cam.w) || !(ls >> cam.fov)) return fail("bad camera");
+            if (!(ls >> cam.focal)) cam.focal = 1.0f;
+        } else if (keyword == "lens") {
+            if (!(ls >> desc.camera.aperture >> desc.camera.focusDistance) || desc.camera.aperture < 0.0f ||
+                desc.camera.focusDistance <= 0.0f) return fail("bad lens");
+        } else if (keyword == "light" || keyword == "arealight") {
+            glm::vec3 position;
+            glm::vec3 edgeU(0.0f);
+            glm::vec3 edgeV(0.0f);
+            glm::vec3 intensity(1.0f);
+            float range = std::numeric_limits<float>::infinity();
+            if (!vec(position) || (keyword == "arealight" && (!vec(edgeU) || !vec(edgeV)))) return fail("bad " + keyword);
+            std::string option;
+            while (ls >> option) {
+                if (option == "intensity" && vec(intensity)) continue;
+                else if (option == "range" && ls >> range && range > 0.0f) continue;
+                else return fail("bad " + keyword + " option '" + option + "'");
+            }
+            if (!lightsDeclared) desc.lights.clear();
+            lightsDeclared = true;
+            desc.lights.addArea(position, edgeU, edgeV, intensity, range);
+        } else if (keyword == "background") {
+            if (!vec(desc.background)) return fail("bad background");
+        } else if (keyword == "texture") {
+            std::string texName;
+            std::string kind;
+            Texture tex;
+            std::string file;
+            if (!(ls >> texName >> kind)) return fail("bad texture");
+            if (kind == "checker") {
+                if (!vec(tex.colorA) || !vec(tex.colorB)) return fail("bad checker texture");
+            } else if (kind == "image") {
+                if (!(ls >> file)) return fail("bad image texture");
+            } else {
+                return fail("unknown texture kind '" + kind + "'");
+            }
+            std::string option;
+            while (ls >> option) {
+                if (option == "scale" && ls >> tex.scale && tex.scale > 0.0f) continue;
+                else return fail("bad texture option '" + option + "'");
+            }
+            uint32_t index;
+            if (kind == "image") {
+                // absolute, so that a cached scene finds the image from anywhere
+                std::string path = std::filesystem::absolute(dir / file).string();
+                index = desc.scene.addImageTexture(path, tex.scale);
+                if (index == NoTexture) return fail("cannot load texture image '" + file + "'");
+                desc.addSource(path);
+            } else {
+                index = desc.scene.addTexture(tex);
+            }
+            textures[texName] = index;
+        } else if (keyword == "material") {
+            std::string matName;
+            Material mat;
+            if (!(ls >> matName) || !vec(mat.color)) return fail("bad material");
+            std::string option;
+            while (ls >> option) {
+                std::string texName;
+                if (option == "reflective") mat.reflect = true;
+                else if (option == "ambient" && ls >> mat.ambient) continue;
+                else if (option == "specular" && ls >> mat.specularEx) continue;
+                else if (option == "texture" && ls >> texName) {
+                    auto it = textures.find(texName);
+                    if (it == textures.end()) return fail("material uses an undeclared texture");
+                    mat.texture = it->second;
+                } else return fail("unknown material option '" + option + "'");
+            }
+            materials[matName] = desc.scene.addMaterial(mat);
+        } else if (keyword == "sphere") {
+            uint32_t mat;
+            float radius;
+            glm::vec3 center;
+            if (!material(mat)) return fail("sphere uses an undeclared material");
+            if (!(ls >> radius) || !vec(center)) return fail("bad sphere");
+            desc.scene.addSphere(center, radius, mat);
+        } else if (keyword == "plane") {
+            if (desc.scene.PrototypeOpen()) return fail("planes cannot be part of a prototype");
+            uint32_t mat;
+            glm::vec3 normal;
+            glm::vec3 point;
+            if (!material(mat)) return fail("plane uses an undeclared material");
+            if (!vec(normal) || !vec(point)) return fail("bad plane");
+            desc.scene.addPlane(normal, point, mat);
+        } else if (keyword == "mesh") {
+            uint32_t mat;
+            std::string file;
+            if (!material(mat)) return fail("mesh uses an undeclared material");
+            if (!(ls >> file)) return fail("bad mesh");
+            TriangleMesh mesh(glm::vec3(1.0f, 1.0f, 1.0f));
+            if (!mesh.loadOBJ((dir / file).string())) return fail("cannot load mesh '" + file + "'");
+            desc.addSource((dir / file).string());
+            desc.scene.add(mesh, mat);
+        } else if (keyword == "prototype") {
+            std::string protoName;
+            if (!(ls >> protoName)) return fail("bad prototype");
+            if (desc.scene.PrototypeOpen()) return fail("prototypes cannot be nested");
+            if (prototypes.count(protoName)) return fail("prototype '" + protoName + "' is already defined");
+            prototypes[protoName] = desc.scene.beginPrototype();
+        } else if (keyword == "end") {
+            if (!desc.scene.PrototypeOpen()) return fail("'end' without a prototype");
+            desc.scene.endPrototype();
+        } else if (keyword == "instance") {
+            std::string protoName;
+            if (desc.scene.PrototypeOpen()) return fail("instances cannot be part of a prototype");
+            if (!(ls >> protoName)) return fail("bad instance");
+            auto proto = prototypes.find(protoName);
+            if (proto == prototypes.end()) return fail("instance of an undefined prototype");
+            uint32_t mat = NoMaterial;
+            glm::mat4 transform(1.0f);
+            std::string option;
+            while (ls >> option) {
+                glm::vec3 v;
+                float degrees;
+                if (option == "material" && material(mat)) continue;
+                else if (option == "translate" && vec(v)) transform = glm::translate(glm::mat4(1.0f), v) * transform;
+                else if (option == "rotate" && vec(v) && ls >> degrees && v != glm::vec3(0.0f)) {
+                    transform = glm::rotate(glm::mat4(1.0f), glm::radians(degrees), v) * transform;
+                } else if (option == "scale" && ls >> v.x) {
+                    // one factor or three
+                    std::streampos pos = ls.tellg();
+                    if (!(ls >> v.y >> v.z)) {
+                        ls.clear();
+                        ls.seekg(pos);
+                        v.y = v.z = v.x;
+                    }
+                    if (v.x == 0.0f || v.y == 0.0f || v.z == 0.0f) return fail("instance scaled to nothing");
+                    transform = glm::scale(glm::mat4(1.0f), v) * transform;
+                } else {
+                    return fail("bad instance option '" + option + "'");
+                }
+            }
+            if (desc.scene.addInstance(proto->second, transform, mat) == NoHit) return fail("too many instanced primitives");
+        } else {
+            return fail("unknown statement '" + keyword + "'");
+        }
+    }
+    if (desc.scene.PrototypeOpen()) return fail("prototype without 'end'");
+    desc.scene.commit();
+    desc.lights.commit();
+    return true;
+}
+
+inline bool loadSceneText(const std::string& path, SceneDescription& desc) {
+    std::ifstream in(path);
+    if (in.fail()) {
+        std::cerr << "cannot open scene " << path << std::endl;
+        return false;
+    }
+    desc.addSource(path);
+    return parseScene(in, desc, path);
+}
+
+// Binary scene cache: a header with the non-array settings, a table of sections and the raw scene
+// arrays (materials, textures, primitive SoA arrays, prototypes and instances, BVH nodes and leaf
+// order, lights and light tree, source file paths), each aligned to 64 bytes. image textures are
+// referenced by path, their tiles stay in the files of the texture cache.
+// loading maps the file and points the scene arrays straight at it, nothing is parsed or rebuilt.
+// the layout is that of the writing build (element sizes are checked), it is a cache, not an
+// interchange format. every index in it is checked before anything is rendered, so a truncated or
+// corrupt cache is rejected instead of read out of bounds.
+struct SceneCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sectionCount;
+    int32_t width;
+    int32_t height;
+    float camera[13]; // eye, up, w, fov, focal, aperture, focus distance
+    float background[3];
+    uint64_t sourceStamp; // sourceStamp() of the source files when the cache was written
+};
+
+struct SceneCacheSection {
+    uint64_t offset;
+    uint64_t count;
+    uint64_t elementSize;
+};
+
+static const char SceneCacheMagic[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', 0};
+static const uint32_t SceneCacheVersion = 7;
+
+// the cache contents, handed to write(bytes, count) piece by piece; also the serialized form the
+// distributed renderer sends to its workers
+template<typename Write>
+void writeSceneCache(SceneDescription& desc, Write&& write) {
+    SceneCacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, SceneCacheMagic, 8);
+    header.version = SceneCacheVersion;
+    header.width = desc.width;
+    header.height = desc.height;
+    const CameraDesc& cam = desc.camera;
+    float camera[13] = {cam.eye.x, cam.eye.y, cam.eye.z, cam.up.x, cam.up.y, cam.up.z, cam.w.x, cam.w.y, cam.w.z,
+                        cam.fov, cam.focal, cam.aperture, cam.focusDistance};
+    std::memcpy(header.camera, camera, sizeof(camera));
+    for (int i = 0; i < 3; ++i) header.background[i] = desc.background[i];
+    header.sourceStamp = sourceStamp(desc.Sources());
+
+    std::vector<SceneCacheSection> sections;
+    std::vector<std::pair<const void*, size_t>> blobs;
+    desc.visitArrays([&](auto& array) {
+        typedef typename std::decay_t<decltype(array)>::value_type T;
+        sections.push_back({0, array.size(), sizeof(T)});
+        blobs.push_back({array.data(), array.size() * sizeof(T)});
+    });
+    header.sectionCount = uint32_t(sections.size());
+
+    uint64_t offset = sizeof(header) + sections.size() * sizeof(SceneCacheSection);
+    for (SceneCacheSection& section : sections) {
+        offset = (offset + 63) & ~uint64_t(63);
+        section.offset = offset;
+        offset += section.count * section.elementSize;
+    }
+
+    write(&header, sizeof(header));
+    write(sections.data(), sections.size() * sizeof(SceneCacheSection));
+    uint64_t pos = sizeof(header) + sections.size() * sizeof(SceneCacheSection);
+    static const char zeros[64] = {0};
+    for (size_t i = 0; i < sections.size(); ++i) {
+        write(zeros, size_t(sections[i].offset - pos));
+        write(blobs[i].first, blobs[i].second);
+        pos = sections[i].offset + blobs[i].second;
+    }
+}
+
+inline bool saveSceneCache(const std::string& path, SceneDescription& desc) {
+    std::ofstream ofs(path, std::ios_base::out | std::ios_base::binary);
+    if (ofs.fail()) return false;
+    writeSceneCache(desc, [&](const void* bytes, size_t count) {
+        ofs.write(static_cast<const char*>(bytes), std::streamsize(count));
+    });
+    return !ofs.fail();
+}
+
+// read-only file contents, memory-mapped where possible
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+#ifdef RAYTRACER_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                mapped = p;
+                bytes = static_cast<const uint8_t*>(p);
+                length = size_t(st.st_size);
+            }
+        }
+        ::close(fd);
+#else
+        std::ifstream in(path, std::ios_base::in | std::ios_base::binary);
+        buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        bytes = reinterpret_cast<const uint8_t*>(buffer.data());
+        length = buffer.size();
+#endif
+    };
+    ~MappedFile() {
+#ifdef RAYTRACER_MMAP
+        if (mapped) munmap(mapped, length);
+#endif
+    };
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* data() const { return bytes; };
+    size_t size() const { return length; };
+
+private:
+    void* mapped = nullptr;
+    std::vector<char> buffer;
+    const uint8_t* bytes = nullptr;
+    size_t length = 0;
+};
+
+// points desc at cache contents in memory (size bytes, 16-byte aligned or better), kept alive by owner;
+// stamp receives the source stamp the cache was written with
+inline bool loadSceneCache(const uint8_t* data, size_t size, std::shared_ptr<const void> owner, SceneDescription& desc,
+                           uint64_t* stamp = nullptr) {
+    if (size < sizeof(SceneCacheHeader)) return false;
+    SceneCacheHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, SceneCacheMagic, 8) != 0 || header.version != SceneCacheVersion) return false;
+    if (size < sizeof(header) + header.sectionCount * sizeof(SceneCacheSection)) return false;
+    const SceneCacheSection* sections = reinterpret_cast<const SceneCacheSection*>(data + sizeof(header));
+
+    // validate everything before touching the scene
+    uint32_t index = 0;
+    bool valid = true;
+    desc.visitArrays([&](auto& array) {
+        typedef typename std::decay_t<decltype(array)>::value_type T;
+        if (index >= header.sectionCount) { valid = false; return; }
+        const SceneCacheSection& s = sections[index++];
+        if (s.elementSize != sizeof(T) || s.offset % alignof(T) != 0 || s.offset > size ||
+            s.count > (size - s.offset) / sizeof(T)) valid = false;
+    });
+    if (!valid || index != header.sectionCount) return false;
+
+    index = 0;
+    desc.visitArrays([&](auto& array) {
+        typedef typename std::decay_t<decltype(array)>::value_type T;
+        const SceneCacheSection& s = sections[index++];
+        array.view(reinterpret_cast<const T*>(data + s.offset), size_t(s.count), owner);
+    });
+    if (!desc.scene.valid() || !desc.lights.valid() || header.width <= 0 || header.height <= 0) return false;
+    if (!desc.scene.bindTextures()) return false;
+
+    desc.width = header.width;
+    desc.height = header.height;
+    const float* c = header.camera;
+    desc.camera.eye = glm::vec3(c[0], c[1], c[2]);
+    desc.camera.up = glm::vec3(c[3], c[4], c[5]);
+    desc.camera.w = glm::vec3(c[6], c[7], c[8]);
+    desc.camera.fov = c[9];
+    desc.camera.focal = c[10];
+    desc.camera.aperture = c[11];
+    desc.camera.focusDistance = c[12];
+    desc.background = glm::vec3(header.background[0], header.background[1], header.background[2]);
+    if (stamp) *stamp = header.sourceStamp;
+    return true;
+}
+
+inline bool loadSceneCache(const std::string& path, SceneDescription& desc, uint64_t* stamp = nullptr) {
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(path);
+    return loadSceneCache(file->data(), file->size(), file, desc, stamp);
+}
+
+// load a text scene through its binary cache <path>.bin: the cache is used while the files the scene
+// was read from (the scene file, its meshes and texture images) keep their size and modification
+// time, otherwise the text is parsed and the cache (re)written
+inline bool loadScene(const std::string& path, SceneDescription& desc, bool useCache = true) {
+    std::string cachePath = path + ".bin";
+    if (useCache) {
+        uint64_t stamp = 0;
+        if (loadSceneCache(cachePath, desc, &stamp) && stamp != 0 && stamp == sourceStamp(desc.Sources())) return true;
+    }
+    desc = SceneDescription();
+    if (!loadSceneText(path, desc)) return false;
+    if (useCache && !saveSceneCache(cachePath, desc)) std::cerr << "cannot write scene cache " << cachePath << std::endl;
+    return true;
+}
+
+#endif
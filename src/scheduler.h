@@ -0,0 +1,246 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// rectangular block of pixels in image space (row 0 is the top row of the image)
+struct Tile {
+    int id;
+    int x0, y0; // inclusive
+    int x1, y1; // exclusive
+};
+
+// splits a frame into tiles and renders them on a work-stealing thread pool.
+// every worker owns a deque of spatially contiguous tiles: it pops from the front of its own deque
+// and, once that runs dry, steals from the back of the other deques. expensive regions (e.g. the
+// reflective sphere) are therefore picked up by whichever threads finished their cheap tiles first.
+// the pool threads are started by the first run and wait on a condition variable between runs, so a
+// pass costs no thread creation and per-thread state (thread_local caches and counters) lives on
+// from pass to pass; the calling thread works as worker 0.
+class TileScheduler {
+public:
+    // threadCount <= 0 uses all hardware threads
+    TileScheduler(int dimx, int dimy, int tileEdge = 32, int threadCount = 0) {
+        width = dimx;
+        height = dimy;
+        tileSize = std::max(1, tileEdge);
+        threads = threadCount > 0 ? threadCount : int(std::thread::hardware_concurrency());
+        threads = std::max(1, threads);
+
+        for (int y = 0; y < height; y += tileSize) {
+            for (int x = 0; x < width; x += tileSize) {
+                tiles.push_back({int(tiles.size()), x, y, std::min(x + tileSize, width), std::min(y + tileSize, height)});
+            }
+        }
+        threads = std::min(threads, std::max(1, int(tiles.size())));
+        queues = std::vector<WorkQueue>(threads);
+    };
+    ~TileScheduler() {
+        {
+            std::lock_guard<std::mutex> lock(poolMutex);
+            quit = true;
+        }
+        wake.notify_all();
+        for (std::thread& th : pool) th.join();
+    }
+    TileScheduler(const TileScheduler&) = delete;
+    TileScheduler& operator=(const TileScheduler&) = delete;
+
+    // render all tiles; renderTile(tile, worker) is called concurrently from several threads but never
+    // twice for the same tile. worker (0 to ThreadCount() - 1) identifies the calling thread, which is
+    // the same thread for a worker in every run, so callers can keep per-thread state that outlives
+    // the run. with a region only the tiles overlapping it are rendered, clipped to it. runs of one
+    // scheduler must not overlap
+    void run(const std::function<void(const Tile&, int)>& renderTile, const Tile* region = nullptr) {
+        tileMs.assign(tiles.size(), 0.0);
+        tileThread.assign(tiles.size(), -1);
+        threadStats.assign(threads, ThreadStats());
+        clip = region ? *region : Tile{0, 0, 0, width, height};
+
+        // contiguous ranges per thread keep neighbouring tiles (and their cache lines) on one core
+        selected.clear();
+        for (const Tile& tile : tiles) {
+            if (tile.x0 < clip.x1 && clip.x0 < tile.x1 && tile.y0 < clip.y1 && clip.y0 < tile.y1) selected.push_back(tile.id);
+        }
+        int n = int(selected.size());
+        for (int t = 0; t < threads; ++t) {
+            queues[t].tiles.clear();
+            for (int i = t * n / threads; i < (t + 1) * n / threads; ++i) queues[t].tiles.push_back(selected[i]);
+        }
+
+        auto start = Clock::now();
+        if (threads > 1) {
+            {
+                std::lock_guard<std::mutex> lock(poolMutex);
+                job = &renderTile;
+                busy = threads - 1;
+                generation++;
+            }
+            for (int t = int(pool.size()) + 1; t < threads; ++t) pool.emplace_back(&TileScheduler::poolThread, this, t);
+            wake.notify_all();
+        }
+        worker(0, renderTile);
+        if (threads > 1) {
+            std::unique_lock<std::mutex> lock(poolMutex);
+            finished.wait(lock, [&] { return busy == 0; });
+            job = nullptr;
+        }
+        wallMs = msSince(start);
+    };
+
+    // print per-thread load and per-tile cost of the last run (of the tiles it rendered)
+    void report(std::ostream& os, const std::string& label, bool perTile = false) const {
+        std::vector<double> sorted;
+        for (int id : selected) sorted.push_back(tileMs[id]);
+        std::sort(sorted.begin(), sorted.end());
+        os << label << ": " << wallMs << " ms, " << threads << " threads, " << selected.size() << " tiles";
+        if (!sorted.empty()) {
+            os << " (tile min " << sorted.front() << " / median " << sorted[sorted.size() / 2]
+               << " / max " << sorted.back() << " ms)";
+        }
+        os << std::endl;
+        for (int t = 0; t < threads; ++t) {
+            const ThreadStats& s = threadStats[t];
+            os << "  thread " << t << ": " << s.tiles << " tiles (" << s.stolen << " stolen), busy "
+               << s.busyMs << " ms" << std::endl;
+        }
+        if (perTile) {
+            for (int id : selected) {
+                const Tile& tile = tiles[id];
+                os << "  tile " << tile.id << " [" << tile.x0 << "," << tile.y0 << " - " << tile.x1 << "," << tile.y1
+                   << "] thread " << tileThread[tile.id] << ": " << tileMs[tile.id] << " ms" << std::endl;
+            }
+        }
+    };
+
+    // stops the current run: the workers finish the tiles they are on and start no new ones. may be
+    // called from any thread; runs that start later are stopped as well until clearCancel(), which
+    // the caller does once at the start of a request however many runs it takes
+    void cancel() { cancelled = true; };
+    void clearCancel() { cancelled = false; };
+    bool Cancelled() const { return cancelled; };
+
+    int ThreadCount() const { return threads; };
+    const std::vector<Tile>& Tiles() const { return tiles; };
+    double WallMs() const { return wallMs; };
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct WorkQueue {
+        std::mutex m;
+        std::deque<int> tiles;
+    };
+    // padded to a cache line so the workers do not false-share their counters
+    struct alignas(64) ThreadStats {
+        int tiles = 0;
+        int stolen = 0;
+        double busyMs = 0.0;
+    };
+
+    static double msSince(Clock::time_point t) {
+        return std::chrono::duration<double, std::milli>(Clock::now() - t).count();
+    };
+
+    bool popOwn(int t, int& tile) {
+        std::lock_guard<std::mutex> lock(queues[t].m);
+        if (queues[t].tiles.empty()) return false;
+        tile = queues[t].tiles.front();
+        queues[t].tiles.pop_front();
+        return true;
+    };
+
+    bool steal(int t, int& tile) {
+        // visit the victims in a rotating order so thieves do not all pile onto thread 0
+        for (int i = 1; i < threads; ++i) {
+            WorkQueue& victim = queues[(t + i) % threads];
+            std::lock_guard<std::mutex> lock(victim.m);
+            if (victim.tiles.empty()) continue;
+            tile = victim.tiles.back();
+            victim.tiles.pop_back();
+            return true;
+        }
+        return false;
+    };
+
+    // pool thread of worker t: takes part in every run until the scheduler is destroyed
+    void poolThread(int t) {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(poolMutex);
+        while (true) {
+            wake.wait(lock, [&] { return quit || generation != seen; });
+            if (quit) return;
+            seen = generation;
+            const std::function<void(const Tile&, int)>* renderTile = job;
+            lock.unlock();
+            worker(t, *renderTile);
+            lock.lock();
+            if (--busy == 0) finished.notify_one();
+        }
+    };
+
+    void worker(int t, const std::function<void(const Tile&, int)>& renderTile) {
+        ThreadStats& stats = threadStats[t];
+        int tile;
+        while (!cancelled) {
+            bool stolen = false;
+            if (!popOwn(t, tile)) {
+                // no tiles are ever added during a run, so an unsuccessful steal means the frame is done
+                if (!steal(t, tile)) break;
+                stolen = true;
+            }
+            Tile clipped = tiles[tile];
+            clipped.x0 = std::max(clipped.x0, clip.x0);
+            clipped.y0 = std::max(clipped.y0, clip.y0);
+            clipped.x1 = std::min(clipped.x1, clip.x1);
+            clipped.y1 = std::min(clipped.y1, clip.y1);
+            auto start = Clock::now();
+            renderTile(clipped, t);
+            double ms = msSince(start);
+
+            tileMs[tile] = ms;
+            tileThread[tile] = t;
+            stats.tiles++;
+            stats.stolen += stolen ? 1 : 0;
+            stats.busyMs += ms;
+        }
+    };
+
+    int width;
+    int height;
+    int tileSize;
+    int threads;
+    std::vector<Tile> tiles;
+    std::vector<WorkQueue> queues;
+    Tile clip;                     // region of the current run
+    std::vector<int> selected;     // the tiles of the current run
+    std::atomic<bool> cancelled{false};
+
+    // the parked pool threads (workers 1 to threads - 1); a run hands them job and counts down busy
+    std::vector<std::thread> pool;
+    std::mutex poolMutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    const std::function<void(const Tile&, int)>* job = nullptr;
+    uint64_t generation = 0;
+    int busy = 0;
+    bool quit = false;
+
+    // timing of the last run
+    std::vector<double> tileMs;
+    std::vector<int> tileThread;
+    std::vector<ThreadStats> threadStats;
+    double wallMs = 0.0;
+};
+
+#endif
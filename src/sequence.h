@@ -0,0 +1,308 @@
+#ifndef SEQUENCE_H_
+#define SEQUENCE_H_
+
+#include <glm/glm.hpp>
+#include <glm/vec3.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "camera.h"
+#include "image.h"
+#include "render.h"
+#include "sceneio.h"
+#include "session.h"
+
+// animation of a scene: keyed camera and sphere transforms over a number of frames
+struct CameraKey {
+    int frame;
+    CameraDesc camera;
+};
+
+struct SphereKey {
+    int frame;
+    glm::vec3 center;
+    float radius;
+};
+
+// the camera turns around the axis along its up direction through center, by degrees over the frames
+struct Orbit {
+    int first;
+    int last;
+    glm::vec3 center;
+    float degrees;
+};
+
+struct SequenceDescription {
+    int frames = 1;
+    std::vector<CameraKey> cameraKeys;                  // by frame
+    std::map<uint32_t, std::vector<SphereKey>> sphereKeys; // by sphere index, each by frame
+    std::vector<Orbit> orbits;
+
+    // the camera of a frame, base without camera keys
+    CameraDesc camera(int frame, const CameraDesc& base) const {
+        CameraDesc cam = base;
+        if (!cameraKeys.empty()) {
+            keyed(cameraKeys, frame, [&](const CameraKey& a, const CameraKey& b, float t) {
+                cam = a.camera;
+                if (t == 0.0f) return;
+                cam.eye = glm::mix(a.camera.eye, b.camera.eye, t);
+                cam.up = glm::normalize(glm::mix(a.camera.up, b.camera.up, t));
+                cam.w = glm::normalize(glm::mix(a.camera.w, b.camera.w, t));
+                cam.fov = glm::mix(a.camera.fov, b.camera.fov, t);
+                cam.focal = glm::mix(a.camera.focal, b.camera.focal, t);
+            });
+        }
+        for (const Orbit& orbit : orbits) {
+            float t = float(glm::clamp(frame, orbit.first, orbit.last) - orbit.first) / float(std::max(1, orbit.last - orbit.first));
+            if (t == 0.0f) continue;
+            float angle = glm::radians(orbit.degrees) * t;
+            glm::vec3 axis = glm::normalize(cam.up);
+            cam.eye = orbit.center + rotate(cam.eye - orbit.center, axis, angle);
+            cam.w = rotate(cam.w, axis, angle);
+        }
+        return cam;
+    };
+
+    // center and radius of a keyed sphere in a frame
+    void sphere(const std::vector<SphereKey>& keys, int frame, glm::vec3& center, float& radius) const {
+        keyed(keys, frame, [&](const SphereKey& a, const SphereKey& b, float t) {
+            center = t == 0.0f ? a.center : glm::mix(a.center, b.center, t);
+            radius = t == 0.0f ? a.radius : glm::mix(a.radius, b.radius, t);
+        });
+    };
+
+private:
+    // calls lerp(a, b, t) with the keys around frame; held (t = 0) before the first and after the last
+    template<typename Key, typename Lerp>
+    static void keyed(const std::vector<Key>& keys, int frame, Lerp&& lerp) {
+        auto next = std::upper_bound(keys.begin(), keys.end(), frame, [](int f, const Key& k) { return f < k.frame; });
+        if (next == keys.begin()) return lerp(keys.front(), keys.front(), 0.0f);
+        if (next == keys.end()) return lerp(keys.back(), keys.back(), 0.0f);
+        const Key& a = *(next - 1);
+        lerp(a, *next, float(frame - a.frame) / float(next->frame - a.frame));
+    };
+
+    // v rotated by angle (radians) around the unit axis
+    static glm::vec3 rotate(const glm::vec3& v, const glm::vec3& axis, float angle) {
+        float c = std::cos(angle);
+        float s = std::sin(angle);
+        return v*c + glm::cross(axis, v)*s + axis*glm::dot(axis, v)*(1.0f - c);
+    };
+};
+
+// Sequence format, one statement per line, '#' starts a comment; frames count from 0:
+//   frames <count>
+//   camera <frame> <eye xyz> <up xyz> <w xyz> <fov> [<focal length>]
+//   sphere <frame> <sphere index> <center xyz> <radius>
+//   orbit <first frame> <last frame> <center xyz> <degrees>
+// camera and sphere statements are keys: in between keys the values are interpolated linearly,
+// before the first and after the last key of the camera or a sphere they are held. the camera of
+// the scene is used without camera keys, spheres without keys stay where the scene has them.
+// orbits turn the (keyed) camera around the axis along its up direction. only spheres of the scene
+// itself can be keyed, not those of prototypes. on error a message with
+// the line number is printed to std::cerr and false is returned
+inline bool parseSequence(std::istream& in, SequenceDescription& seq, const Scene& scene, const std::string& name = "sequence") {
+    std::string line;
+    int lineNo = 0;
+    auto fail = [&](const std::string& msg) {
+        std::cerr << name << ":" << lineNo << ": " << msg << std::endl;
+        return false;
+    };
+
+    while (std::getline(in, line)) {
+        lineNo++;
+        size_t hash = line.find('#');
+        if (hash != std::string::npos) line.erase(hash);
+        std::istringstream ls(line);
+        std::string keyword;
+        if (!(ls >> keyword)) continue;
+
+        auto vec = [&](glm::vec3& v) { return bool(ls >> v.x >> v.y >> v.z); };
+
+        if (keyword == "frames") {
+            if (!(ls >> seq.frames) || seq.frames < 1) return fail("bad frame count");
+        } else if (keyword == "camera") {
+            CameraKey key;
+            CameraDesc& cam = key.camera;
+            if (!(ls >> key.frame) || key.frame < 0 || !vec(cam.eye) || !vec(cam.up) || !vec(cam.w) || !(ls >> cam.fov)) {
+                return fail("bad camera key");
+            }
+            if (!(ls >> cam.focal)) cam.focal = 1.0f;
+            seq.cameraKeys.push_back(key);
+        } else if (keyword == "sphere") {
+            SphereKey key;
+            uint32_t index;
+            if (!(ls >> key.frame >> index) || key.frame < 0 || !vec(key.center) || !(ls >> key.radius) || key.radius <= 0.0f) {
+                return fail("bad sphere key");
+            }
+            if (index >= scene.SphereCount()) return fail("the scene has no sphere " + std::to_string(index));
+            if (!scene.isWorldSphere(index)) return fail("sphere " + std::to_string(index) + " is part of a prototype");
+            seq.sphereKeys[index].push_back(key);
+        } else if (keyword == "orbit") {
+            Orbit orbit;
+            if (!(ls >> orbit.first >> orbit.last) || orbit.first < 0 || orbit.last < orbit.first || !vec(orbit.center) ||
+                !(ls >> orbit.degrees)) {
+                return fail("bad orbit");
+            }
+            seq.orbits.push_back(orbit);
+        } else {
+            return fail("unknown statement '" + keyword + "'");
+        }
+    }
+
+    // keys may be given in any order; a later key of the same frame wins
+    auto byFrame = [](const auto& a, const auto& b) { return a.frame < b.frame; };
+    auto sameFrame = [](const auto& a, const auto& b) { return a.frame == b.frame; };
+    std::stable_sort(seq.cameraKeys.begin(), seq.cameraKeys.end(), byFrame);
+    std::reverse(seq.cameraKeys.begin(), seq.cameraKeys.end());
+    seq.cameraKeys.erase(std::unique(seq.cameraKeys.begin(), seq.cameraKeys.end(), sameFrame), seq.cameraKeys.end());
+    std::reverse(seq.cameraKeys.begin(), seq.cameraKeys.end());
+    for (auto& sphere : seq.sphereKeys) {
+        std::vector<SphereKey>& keys = sphere.second;
+        std::stable_sort(keys.begin(), keys.end(), byFrame);
+        std::reverse(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end(), sameFrame), keys.end());
+        std::reverse(keys.begin(), keys.end());
+    }
+    return true;
+}
+
+inline bool loadSequence(const std::string& path, SequenceDescription& seq, const Scene& scene) {
+    std::ifstream in(path);
+    if (in.fail()) {
+        std::cerr << "cannot open sequence " << path << std::endl;
+        return false;
+    }
+    return parseSequence(in, seq, scene, path);
+}
+
+// writes finished frames on its own thread, so that the next frame renders while one is encoded
+// and written. write() hands a copy of the frame over and only waits if the frame before is still
+// waiting for the writer
+class FrameWriter {
+public:
+    explicit FrameWriter(const std::string& imageFormat) : format(imageFormat), thread([this] { run(); }) {}
+    ~FrameWriter() { finish(); }
+    FrameWriter(const FrameWriter&) = delete;
+    FrameWriter& operator=(const FrameWriter&) = delete;
+
+    void write(const std::string& filename, const std::vector<glm::u8vec3>& frame, int width, int height) {
+        std::unique_lock<std::mutex> lock(mutex);
+        taken.wait(lock, [&] { return !pending; });
+        next.filename = filename;
+        next.pixels.assign(frame.begin(), frame.end());
+        next.width = width;
+        next.height = height;
+        pending = true;
+        ready.notify_one();
+    };
+
+    // writes the last frame and stops the thread; false if any frame could not be written
+    bool finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+        }
+        ready.notify_one();
+        if (thread.joinable()) thread.join();
+        return ok;
+    };
+
+private:
+    struct Frame {
+        std::string filename;
+        std::vector<glm::u8vec3> pixels;
+        int width = 0;
+        int height = 0;
+    };
+
+    void run() {
+        Frame frame;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [&] { return pending || done; });
+                if (!pending) return;
+                std::swap(frame, next);
+                pending = false;
+            }
+            taken.notify_one();
+            if (!makeImageSink(format, frame.filename)->write(frame.pixels.data(), frame.width, frame.height)) {
+                std::cerr << "cannot write " << frame.filename << std::endl;
+                ok = false;
+            }
+        }
+    };
+
+    std::string format;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable taken;
+    Frame next;
+    bool pending = false;
+    bool done = false;
+    bool ok = true; // only changed by the writer thread, read after joining it
+    std::thread thread;
+};
+
+// renders every frame of the sequence into <prefix>_<frame number>.<format>. the scene, its BVH and
+// the renderer stay resident: a frame only refits the BVH above the spheres that moved, and with
+// an unchanged camera only the pixels the moves can have changed are shaded again (RenderSession).
+// frames are written by a FrameWriter while the next one renders
+inline bool renderSequence(SceneDescription& desc, const SequenceDescription& seq, ShadeMode mode,
+                           const RenderSettings& settings, const std::string& format, const std::string& prefix) {
+    auto start = std::chrono::steady_clock::now();
+    CameraDesc base = desc.camera;
+    RenderSession session(desc, mode, settings);
+    FrameWriter writer(format);
+    CameraDesc camera = base;
+    std::map<uint32_t, std::pair<glm::vec3, float>> spheres; // the keyed spheres as last rendered
+    size_t shaded = 0;
+    for (int frame = 0; frame < seq.frames; ++frame) {
+        CameraDesc next = seq.camera(frame, base);
+        if (frame == 0 || std::memcmp(&next, &camera, sizeof(camera)) != 0) {
+            camera = next;
+            session.setCamera(camera);
+        }
+        for (const auto& keys : seq.sphereKeys) {
+            glm::vec3 center;
+            float radius;
+            seq.sphere(keys.second, frame, center, radius);
+            auto it = spheres.find(keys.first);
+            if (it != spheres.end() && it->second.first == center && it->second.second == radius) continue;
+            spheres[keys.first] = std::make_pair(center, radius);
+            if (!session.moveSphere(keys.first, center, radius)) {
+                std::cerr << "sphere " << keys.first << " cannot be moved" << std::endl;
+                return false;
+            }
+        }
+
+        char number[16];
+        std::snprintf(number, sizeof(number), "_%04d", frame);
+        PassStats stats = session.render(prefix + number, nullptr);
+        if (stats.cancelled) return false;
+        shaded += session.LastShaded();
+        writer.write(prefix + number, session.Image(), desc.width, desc.height);
+    }
+    bool ok = writer.finish();
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    double pixels = double(seq.frames) * double(desc.width) * double(desc.height);
+    std::cout << seq.frames << " frames in " << ms << " ms (" << ms / double(seq.frames) << " ms per frame), "
+              << 100.0 * double(shaded) / pixels << "% of the pixels shaded" << std::endl;
+    return ok;
+}
+
+#endif
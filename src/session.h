@@ -0,0 +1,147 @@
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#include <glm/glm.hpp>
+#include <glm/vec3.hpp>
+#include <cfloat>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "aabb.h"
+#include "camera.h"
+#include "footprint.h"
+#include "image.h"
+#include "lights.h"
+#include "render.h"
+#include "scene.h"
+#include "sceneio.h"
+
+// interactive rendering of a changing scene. the session keeps the renderer (threads, tiles, frame
+// buffers), the scene with its BVH and a footprint of every pixel between frames:
+// - a camera change (or invalidate() after any other edit) re-renders the whole frame, without
+//   rebuilding anything;
+// - moving a sphere refits the BVH nodes above it and re-renders only the pixels the sphere can
+//   have changed: those whose footprint has it (primary hit, reflection hit or shadow blocker
+//   before the move), whose primary rays or primary shadow rays pass through its new bounds, or
+//   whose reflection segments overlap them.
+// incremental frames are identical to full renders of the edited scene. adaptive sampling is not
+// used, every pixel gets RenderSettings::samples
+class RenderSession {
+public:
+    RenderSession(SceneDescription& description, ShadeMode shadeMode, const RenderSettings& config)
+        : desc(description), mode(shadeMode), settings(fixedSampling(config)),
+          renderer(desc.width, desc.height, desc.camera, settings) {
+        size_t pixels = size_t(desc.width) * desc.height;
+        samples = std::max(1, settings.samples);
+        footprints.resize(pixels);
+        hitDistances.resize(pixels * samples);
+        dirty.resize(pixels);
+    };
+
+    void setCamera(const CameraDesc& camera) {
+        desc.camera = camera;
+        renderer.setCamera(camera);
+        full = true;
+    };
+
+    // moves and resizes sphere index of the scene; false if it is not a world sphere (see
+    // Scene::setSphere), which leaves the scene and the next frame unchanged
+    bool moveSphere(uint32_t index, const glm::vec3& center, float radius) {
+        uint32_t id = makePrimId(SpherePrim, index);
+        if (!desc.scene.setSphere(index, center, radius)) return false;
+        edits.push_back(Edit{id, desc.scene.primBounds(id)});
+        return true;
+    };
+
+    // the description was changed in a way the session does not track: render the whole next frame
+    void invalidate() { full = true; };
+
+    // renders the pixels affected by the changes since the last frame (all of them the first time)
+    PassStats render(const std::string& label, ImageSink* sink) {
+        PixelSelection pixels;
+        pixels.footprints = footprints.data();
+        pixels.hitDistances = hitDistances.data();
+        shaded = dirty.size();
+        auto start = std::chrono::steady_clock::now();
+        if (!full) {
+            shaded = markDirty();
+            pixels.mask = dirty.data();
+        }
+        auto marked = std::chrono::steady_clock::now();
+        PassStats stats = renderer.render(desc, mode, label, sink, nullptr, pixels);
+        // the wall time includes finding the pixels to render
+        stats.wallMs += std::chrono::duration<double, std::milli>(marked - start).count();
+        if (settings.showStats) {
+            std::cout << label << ": " << shaded << " of " << dirty.size() << " pixels shaded" << std::endl;
+        }
+        full = false;
+        edits.clear();
+        return stats;
+    };
+
+    // pixels rendered by the last frame
+    size_t LastShaded() const { return shaded; };
+    const std::vector<glm::u8vec3>& Image() const { return renderer.Image(); };
+
+private:
+    struct Edit {
+        uint32_t primId;
+        AABB bounds; // after the edit
+    };
+
+    static RenderSettings fixedSampling(RenderSettings config) {
+        config.adaptiveThreshold = 0.0f;
+        config.timeBudgetMs = 0.0;
+        return config;
+    };
+
+    // flags the pixels the edits may have changed, returns their number
+    size_t markDirty() {
+        LightSampler lights(desc.lights, settings.lightSamples);
+        // the primary hits of flat and phong shading cast no shadow rays
+        bool shadows = mode == ShadeMode::Shadows || mode == ShadeMode::Reflections;
+        const Camera& camera = renderer.ViewCamera();
+        return renderer.countPixels([&](int i, int j, size_t k) {
+            bool changed = false;
+            for (size_t e = 0; e < edits.size() && !changed; ++e) {
+                const Edit& edit = edits[e];
+                changed = (footprints[k].touched & footprintBit(edit.primId)) != 0 ||
+                          footprints[k].secondary.overlaps(edit.bounds);
+                for (int s = 0; s < samples && !changed; ++s) {
+                    Ray ray = camera.generateRay(i, j, uint32_t(s));
+                    float t = hitDistances[k * samples + s];
+                    changed = edit.bounds.intersects(ray.origin(), ray.direction(), 0.0f, t);
+                    if (changed || !shadows || t == FLT_MAX) continue;
+                    // the shadow rays of the hit go to the same lights again: the selection only
+                    // depends on the position, computed as in Scene::attributes()
+                    glm::vec3 pos = ray.origin() + ray.direction()*t;
+                    LightSelection selection;
+                    lights.select(pos, selection);
+                    for (int l = 0; l < selection.count && !changed; ++l) {
+                        if (selection.intensity[l] == glm::vec3(0.0f)) continue;
+                        changed = edit.bounds.intersects(pos, selection.position[l] - pos, 0.0f, 1.0f);
+                    }
+                }
+            }
+            dirty[k] = changed;
+            return changed;
+        });
+    };
+
+    SceneDescription& desc;
+    ShadeMode mode;
+    RenderSettings settings;
+    Renderer renderer;
+    int samples;
+
+    std::vector<PixelFootprint> footprints;
+    std::vector<float> hitDistances;
+    std::vector<uint8_t> dirty;
+    std::vector<Edit> edits;
+    bool full = true;
+    size_t shaded = 0;
+};
+
+#endif
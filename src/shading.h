@@ -0,0 +1,203 @@
+#ifndef SHADING_H_
+#define SHADING_H_
+
+#include <glm/glm.hpp>
+#include <glm/vec3.hpp>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+#include "math.h"
+#include "footprint.h"
+#include "lights.h"
+#include "material.h"
+#include "ray.h"
+#include "scene.h"
+#include "stats.h"
+
+// color of the surface at a hit in the 0-255 range: the object color, times the color of its texture
+// if the material has one. footprint is the width of the pixel's ray cone at the hit in world units,
+// the area the texture is filtered over
+inline glm::vec3 surfaceColor(const Scene& scene, const Material& mat, uint32_t primId, const glm::vec3& intersectPos,
+                              float footprint) {
+    if (mat.texture == NoTexture) return mat.color*255.0f;
+    return mat.color*scene.textureColor(mat.texture, primId, intersectPos, footprint)*255.0f;
+}
+
+// features of a material the shading kernels are compiled for, so that a kernel only contains the
+// terms its material needs. a material with specularEx <= 0 has no highlight
+enum MaterialFeature : uint32_t {
+    AmbientFeature = 1,          // ambient != 0
+    SpecularFeature = 2,         // specularEx > 0
+    IntegerExponentFeature = 4,  // specularEx is a whole number up to MaxIntegerExponent
+    ReflectiveFeature = 8,       // mirror
+};
+static const uint32_t MaterialClassCount = 16;
+static const float MaxIntegerExponent = 1024.0f;
+
+inline uint32_t materialFeatures(const Material& mat) {
+    uint32_t features = 0;
+    if (mat.ambient != 0.0f) features |= AmbientFeature;
+    if (mat.specularEx > 0.0f) {
+        features |= SpecularFeature;
+        if (mat.specularEx <= MaxIntegerExponent && mat.specularEx == std::floor(mat.specularEx)) {
+            features |= IntegerExponentFeature;
+        }
+    }
+    if (mat.reflect) features |= ReflectiveFeature;
+    return features;
+}
+
+// calls kernel(std::integral_constant<uint32_t, features>()), the features as a compile time constant
+template<typename Kernel>
+inline decltype(auto) withMaterialFeatures(uint32_t features, Kernel&& kernel) {
+    switch (features & (MaterialClassCount - 1)) {
+        case 0: return kernel(std::integral_constant<uint32_t, 0>());
+        case 1: return kernel(std::integral_constant<uint32_t, 1>());
+        case 2: return kernel(std::integral_constant<uint32_t, 2>());
+        case 3: return kernel(std::integral_constant<uint32_t, 3>());
+        case 4: return kernel(std::integral_constant<uint32_t, 4>());
+        case 5: return kernel(std::integral_constant<uint32_t, 5>());
+        case 6: return kernel(std::integral_constant<uint32_t, 6>());
+        case 7: return kernel(std::integral_constant<uint32_t, 7>());
+        case 8: return kernel(std::integral_constant<uint32_t, 8>());
+        case 9: return kernel(std::integral_constant<uint32_t, 9>());
+        case 10: return kernel(std::integral_constant<uint32_t, 10>());
+        case 11: return kernel(std::integral_constant<uint32_t, 11>());
+        case 12: return kernel(std::integral_constant<uint32_t, 12>());
+        case 13: return kernel(std::integral_constant<uint32_t, 13>());
+        case 14: return kernel(std::integral_constant<uint32_t, 14>());
+        default: return kernel(std::integral_constant<uint32_t, 15>());
+    }
+}
+
+// rv^n of the specular term. whole exponents are raised by squaring in double precision, which
+// rounds to the same float as pow() for all practical purposes at a fraction of its cost
+template<uint32_t Features>
+inline float specularPower(float rv, float n) {
+    if constexpr ((Features & IntegerExponentFeature) != 0) {
+        double base = rv;
+        double result = 1.0;
+        for (uint32_t e = uint32_t(n); e > 0; e >>= 1) {
+            if (e & 1) result *= base;
+            base *= base;
+        }
+        return float(result);
+    } else {
+        return float(pow(rv, n));
+    }
+}
+
+// the light dependent part of Phong illumination from the selected lights: the diffuse cosines and
+// specular terms of every visible light, summed with the intensity arriving from it. shading is
+// then linear in the surface color, so the reflection integrator can light a bounce before it
+// knows the color behind it
+struct PhongLighting {
+    glm::vec3 diffuse;
+    glm::vec3 specular;
+};
+
+// for a material with the given features; with Shadowed only the lights traceShadows() found
+// visible contribute
+template<uint32_t Features, bool Shadowed>
+inline PhongLighting phongLighting(const Material& mat, const glm::vec3& intersectPos, const glm::vec3& normal, const Ray& ray,
+                                   const LightSelection& lights){
+    constexpr bool specular = (Features & SpecularFeature) != 0;
+    PhongLighting res;
+    res.diffuse = glm::vec3(0.0f, 0.0f, 0.0f);
+    res.specular = glm::vec3(0.0f, 0.0f, 0.0f);
+    float n = mat.specularEx; // specular exponent/Phong exponent
+    glm::vec3 k_s(1.0f, 1.0f, 1.0f); // specular coefficient
+    k_s *= 255.0f;
+    glm::vec3 v;
+    if constexpr (specular) v = glm::normalize(ray.orig - intersectPos); // direction to camera
+
+    for (int i = 0; i < lights.count; ++i) {
+        if (Shadowed && !lights.visible[i]) continue;
+        glm::vec3 I_i = lights.intensity[i]; // light intensity
+        glm::vec3 l = glm::normalize(lights.position[i] - intersectPos); // direction to light
+
+        // Diffuse Component
+        float ln = glm::clamp(glm::dot(l,normal), .0f, 1.0f); // cosine
+        res.diffuse += I_i*ln;
+
+        // Specular Reflection
+        if constexpr (specular) {
+            glm::vec3 r = glm::normalize(2*ln*normal - l); // reflection ray
+            float rv = glm::clamp(glm::dot(v, r), 0.0f, 1.0f);
+            res.specular += I_i*k_s*specularPower<Features>(rv, n);
+        }
+    }
+    return res;
+}
+
+inline PhongLighting phongLighting(const Material& mat, const glm::vec3& intersectPos, const glm::vec3& normal, const Ray& ray,
+                                   const LightSelection& lights){
+    return withMaterialFeatures(materialFeatures(mat), [&](auto features) {
+        return phongLighting<decltype(features)::value, true>(mat, intersectPos, normal, ray, lights);
+    });
+}
+
+// Phong illumination with the lighting of the point, for ambient and diffuse coefficients k_a, k_d.
+// with the single assignment light this is the assignment's model: ambient, plus diffuse and a white
+// highlight of a light of intensity 1
+template<uint32_t Features>
+inline glm::vec3 phongShading(const Material& mat, const PhongLighting& lighting, glm::vec3 k_a, glm::vec3 k_d){
+    glm::vec3 res(0.0f, 0.0f, 0.0f);
+    float I_a = mat.ambient; // ambient intensity
+    if constexpr ((Features & AmbientFeature) != 0) res += I_a*k_a;
+    res += lighting.diffuse*k_d;
+    if constexpr ((Features & SpecularFeature) != 0) res += lighting.specular;
+    return glm::clamp(res, 0.0f, 255.0f);
+}
+
+inline glm::vec3 phongShading(const Material& mat, const PhongLighting& lighting, glm::vec3 k_a, glm::vec3 k_d){
+    return withMaterialFeatures(materialFeatures(mat), [&](auto features) {
+        return phongShading<decltype(features)::value>(mat, lighting, k_a, k_d);
+    });
+}
+
+inline glm::vec3 phongShading(const Material& mat, const glm::vec3& intersectPos, const glm::vec3& normal, const Ray& ray,
+                              const LightSelection& lights, glm::vec3 k_a, glm::vec3 k_d){
+    return phongShading(mat, phongLighting(mat, intersectPos, normal, ray, lights), k_a, k_d);
+}
+
+// generate the correct RGB vector for shadow color
+inline glm::vec3 phongShadows(const Material& mat, glm::vec3 k_a){
+    glm::vec3 res(0.0f, 0.0f, 0.0f);
+    float I_a = mat.ambient; // ambient intensity
+//    glm::vec3 k_a = obj->Color()*255.0f; // ambient coefficients
+
+    // Ambient Component
+    res += I_a*k_a;
+
+    return glm::clamp(res, 0.0f, 255.0f);
+}
+
+// check whether there is an object intersected by the ray starting from the light to a point
+inline bool isIntersected(const Scene& scene, uint32_t primId,
+                          const glm::vec3& intersectPosOnObj, const glm::vec3& light){
+    float distObjToLight = glm::distance(light, intersectPosOnObj);
+    glm::vec3 lightToObj = glm::normalize( intersectPosOnObj - light);
+
+    // check whether any other object is intersected in the middle by checking the distance
+    threadRayCounts().shadow++;
+    FootprintRecorder& footprint = threadFootprint();
+    if (!footprint.active) return scene.occluded(light, lightToObj, distObjToLight, primId);
+    uint32_t blocker = NoHit;
+    bool hit = scene.occluded(light, lightToObj, distObjToLight, primId, &blocker);
+    if (hit) footprint.touch(blocker);
+    return hit;
+}
+
+// shadow test of every selected light that sends any light; returns whether any light is visible
+inline bool traceShadows(const Scene& scene, uint32_t primId, const glm::vec3& intersectPosOnObj, LightSelection& lights){
+    bool lit = false;
+    for (int i = 0; i < lights.count; ++i) {
+        if (lights.intensity[i] == glm::vec3(0.0f)) lights.visible[i] = false;
+        else lights.visible[i] = !isIntersected(scene, primId, intersectPosOnObj, lights.position[i]);
+        lit = lit || lights.visible[i];
+    }
+    return lit;
+}
+
+#endif
@@ -41,6 +41,9 @@ public:
         return dist_;
     };
 
+    const glm::vec3& Center() const { return center; };
+    float Radius() const { return radius; };
+
 private:
     float radius;
     glm::vec3 center;
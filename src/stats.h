@@ -0,0 +1,86 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <cstdint>
+
+// number of rays traced, by type
+struct RayCounts {
+    uint64_t primary = 0;
+    uint64_t shadow = 0;
+    uint64_t reflection = 0;
+
+    uint64_t total() const { return primary + shadow + reflection; };
+    RayCounts& operator+=(const RayCounts& o) {
+        primary += o.primary;
+        shadow += o.shadow;
+        reflection += o.reflection;
+        return *this;
+    };
+};
+
+// counters of the calling thread; the renderer collects them after every tile with takeRayCounts(),
+// so counting a ray is a plain increment without any sharing between threads
+inline RayCounts& threadRayCounts() {
+    thread_local RayCounts counts;
+    return counts;
+}
+
+inline RayCounts takeRayCounts() {
+    RayCounts counts = threadRayCounts();
+    threadRayCounts() = RayCounts();
+    return counts;
+}
+
+// hot path instrumentation, compiled in with -DRAYTRACER_PROFILE=ON (cmake option). without it the
+// counting code is discarded at compile time and ProfileCounts stay zero
+#ifdef RAYTRACER_PROFILE
+static const bool ProfileCounters = true;
+#else
+static const bool ProfileCounters = false;
+#endif
+
+static const int MaxProfiledDepth = 32; // at least MaxReflectionDepth, asserted in integrator.h
+
+struct ProfileCounts {
+    uint64_t nodeVisits = 0;    // BVH nodes whose box was tested (once per packet for primary packets)
+    uint64_t primTests = 0;     // ray-primitive intersection tests, per lane for packets
+    uint64_t shadowBlocked = 0; // shadow rays that stopped at the first blocker
+    uint64_t shadowCached = 0;  // of those, blocked by the previous blocker of the thread without traversal
+    uint64_t depths[MaxProfiledDepth + 1] = {}; // reflection paths that reached bounce d (0: the primary hit)
+
+    // traversal steps and intersection tests, the cost measure of the heatmap
+    uint64_t work() const { return nodeVisits + primTests; };
+    ProfileCounts& operator+=(const ProfileCounts& o) {
+        nodeVisits += o.nodeVisits;
+        primTests += o.primTests;
+        shadowBlocked += o.shadowBlocked;
+        shadowCached += o.shadowCached;
+        for (int d = 0; d <= MaxProfiledDepth; ++d) depths[d] += o.depths[d];
+        return *this;
+    };
+};
+
+// per-thread like the ray counts, collected by the renderer after every tile
+inline ProfileCounts& threadProfileCounts() {
+    thread_local ProfileCounts counts;
+    return counts;
+}
+
+inline ProfileCounts takeProfileCounts() {
+    ProfileCounts counts = threadProfileCounts();
+    threadProfileCounts() = ProfileCounts();
+    return counts;
+}
+
+// adds to a counter of the calling thread, if instrumentation is compiled in:
+// profileCount(&ProfileCounts::primTests, n)
+inline void profileCount(uint64_t ProfileCounts::*counter, uint64_t n = 1) {
+    if constexpr (ProfileCounters) threadProfileCounts().*counter += n;
+}
+
+// a reflection path reached bounce depth (0: the primary hit)
+inline void profileDepth(int depth) {
+    if constexpr (ProfileCounters) threadProfileCounts().depths[depth < MaxProfiledDepth ? depth : MaxProfiledDepth]++;
+}
+
+#endif
@@ -0,0 +1,386 @@
+#ifndef TEXTURE_H_
+#define TEXTURE_H_
+
+#include <glm/glm.hpp>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "image.h"
+#include "material.h"
+
+// surface textures: the color of a material's texture at the texture coordinates of a hit multiplies
+// the material color. a texture is procedural (a checker of two colors) or an image.
+// image textures are converted once into a tiled mip pyramid next to the image (<image>.tiles,
+// rebuilt when older than the image) and read from there on demand: only the tiles that shading
+// touches are loaded, into a process-wide cache of fixed size (TextureCache). the mip level follows
+// the width of the pixel's ray cone at the hit, so a distant surface reads a few texels of a coarse
+// level instead of texels scattered over the full resolution image, which keeps the texture working
+// set near one texel per pixel however large the images are
+enum TextureKind : uint32_t { CheckerTexture = 0, ImageTexture = 1 };
+
+// entry of the scene's texture table (plain data, part of the scene cache)
+struct Texture {
+    uint32_t kind = CheckerTexture;
+    float scale = 1.0f;                          // texture coordinates are multiplied by this
+    glm::vec3 colorA = glm::vec3(1.0f, 1.0f, 1.0f); // checker colors
+    glm::vec3 colorB = glm::vec3(0.0f, 0.0f, 0.0f);
+    uint32_t pathBegin = 0;                      // image file: a range of the scene's texture paths
+    uint32_t pathEnd = 0;
+};
+
+// integral from 0 to x of the square wave that is 0 on [0, 1) and 1 on [1, 2)
+inline float squareWaveIntegral(float x) {
+    float h = std::floor(x * 0.5f);
+    return h + std::max(x - 2.0f*h - 1.0f, 0.0f);
+}
+
+// share of colorB at p in a checker of unit squares, box filtered over width (a point below 1e-4),
+// so that squares smaller than a pixel fade to the average instead of aliasing
+inline float checkerWeight(const glm::vec2& p, float width) {
+    float fx, fy;
+    if (width < 1e-4f) {
+        fx = float(int64_t(std::floor(p.x)) & 1);
+        fy = float(int64_t(std::floor(p.y)) & 1);
+    } else {
+        float h = 0.5f * width;
+        fx = (squareWaveIntegral(p.x + h) - squareWaveIntegral(p.x - h)) / width;
+        fy = (squareWaveIntegral(p.y + h) - squareWaveIntegral(p.y - h)) / width;
+    }
+    return fx + fy - 2.0f*fx*fy;
+}
+
+// tiled mip pyramid file: a header with the layout of every level, then the tiles of all levels in
+// order, each level row by row. a tile is TextureTileSize^2 RGBA texels (alpha unused), 4 KB, and
+// tiles on the image border are filled up with the border texels
+static const int TextureTileSize = 32;
+static const size_t TextureTileBytes = size_t(TextureTileSize) * TextureTileSize * 4;
+static const int MaxTextureLevels = 24;
+static const uint32_t MaxTextureSize = uint32_t(1) << 27; // texels per side, so tile keys fit 22 bits of column
+
+struct TiledLevel {
+    uint32_t width, height;
+    uint32_t tilesX, tilesY;
+    uint64_t offset; // of the first tile
+};
+
+struct TiledImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t levelCount;
+    TiledLevel levels[MaxTextureLevels];
+};
+
+static const char TiledImageMagic[8] = {'R', 'T', 'T', 'I', 'L', 'E', 'S', 0};
+static const uint32_t TiledImageVersion = 1;
+
+// writes image (row 0 at the top) as tiled pyramid; every level halves the one before (rounded up),
+// averaging 2x2 texels, down to 1x1
+inline bool writeTiledImage(const std::vector<glm::u8vec3>& image, uint32_t width, uint32_t height, const std::string& path) {
+    TiledImageHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, TiledImageMagic, 8);
+    header.version = TiledImageVersion;
+    uint64_t offset = (sizeof(header) + TextureTileBytes - 1) / TextureTileBytes * TextureTileBytes;
+    for (uint32_t w = width, h = height; header.levelCount < uint32_t(MaxTextureLevels); w = (w + 1) / 2, h = (h + 1) / 2) {
+        TiledLevel& l = header.levels[header.levelCount++];
+        l.width = w;
+        l.height = h;
+        l.tilesX = (w + TextureTileSize - 1) / TextureTileSize;
+        l.tilesY = (h + TextureTileSize - 1) / TextureTileSize;
+        l.offset = offset;
+        offset += uint64_t(l.tilesX) * l.tilesY * TextureTileBytes;
+        if (w == 1 && h == 1) break;
+    }
+
+    std::ofstream ofs(path, std::ios_base::out | std::ios_base::binary);
+    if (ofs.fail()) return false;
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    std::vector<char> zeros(size_t(header.levels[0].offset - sizeof(header)), 0);
+    ofs.write(zeros.data(), std::streamsize(zeros.size()));
+
+    std::vector<glm::u8vec3> level = image;
+    std::vector<uint8_t> tile(TextureTileBytes);
+    for (uint32_t n = 0; n < header.levelCount; ++n) {
+        const TiledLevel& l = header.levels[n];
+        for (uint32_t ty = 0; ty < l.tilesY; ++ty) {
+            for (uint32_t tx = 0; tx < l.tilesX; ++tx) {
+                for (int j = 0; j < TextureTileSize; ++j) {
+                    uint32_t y = std::min(ty * TextureTileSize + j, l.height - 1);
+                    for (int i = 0; i < TextureTileSize; ++i) {
+                        uint32_t x = std::min(tx * TextureTileSize + i, l.width - 1);
+                        const glm::u8vec3& c = level[size_t(y) * l.width + x];
+                        uint8_t* t = &tile[size_t(j * TextureTileSize + i) * 4];
+                        t[0] = c.x;
+                        t[1] = c.y;
+                        t[2] = c.z;
+                        t[3] = 255;
+                    }
+                }
+                ofs.write(reinterpret_cast<const char*>(tile.data()), std::streamsize(tile.size()));
+            }
+        }
+        if (n + 1 == header.levelCount) break;
+
+        // next level
+        const TiledLevel& next = header.levels[n + 1];
+        std::vector<glm::u8vec3> smaller(size_t(next.width) * next.height);
+        for (uint32_t y = 0; y < next.height; ++y) {
+            for (uint32_t x = 0; x < next.width; ++x) {
+                glm::uvec3 sum(0, 0, 0);
+                for (uint32_t k = 0; k < 4; ++k) {
+                    uint32_t sx = std::min(2*x + (k & 1), l.width - 1);
+                    uint32_t sy = std::min(2*y + (k >> 1), l.height - 1);
+                    sum += glm::uvec3(level[size_t(sy) * l.width + sx]);
+                }
+                smaller[size_t(y) * next.width + x] = glm::u8vec3((sum + 2u) / 4u);
+            }
+        }
+        level.swap(smaller);
+    }
+    return !ofs.fail();
+}
+
+// converts a PPM image to its tiled pyramid
+inline bool convertToTiledImage(const std::string& image, const std::string& path) {
+    unsigned width, height;
+    std::vector<glm::u8vec3> pixels;
+    return readP6PPM(image, width, height, pixels) && writeTiledImage(pixels, width, height, path);
+}
+
+static const size_t DefaultTextureCacheBytes = size_t(64) << 20;
+static const uint32_t MaxTextureFiles = 4096;
+
+// tiles of the opened image textures, with a fixed memory budget. the cache is split into shards by
+// tile, each with its own lock and its share of the budget. a full shard replaces its tiles in clock
+// order, skipping the ones used since the hand last passed them. tile memory is allocated on first use, so
+// a small scene never takes the whole budget.
+// sample() may be called from all render threads at once; open() and setBudget() are for scene
+// loading and must not run during a render that samples
+class TextureCache {
+public:
+    struct Stats {
+        uint64_t lookups = 0;   // tile lookups, at most one per texel
+        uint64_t misses = 0;    // tiles read from disk
+        uint64_t evictions = 0; // tiles dropped to make room
+        size_t residentBytes = 0;
+        size_t budgetBytes = 0;
+    };
+
+    explicit TextureCache(size_t budgetBytes = DefaultTextureCacheBytes) : files(MaxTextureFiles) { setBudget(budgetBytes); }
+
+    // drops every cached tile
+    void setBudget(size_t bytes) {
+        size_t perShard = std::max<size_t>(bytes / TextureTileBytes / ShardCount, 4);
+        for (Shard& s : shards) {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.capacity = uint32_t(std::min<size_t>(perShard, UINT32_MAX));
+            s.tiles.clear();
+            s.keys.clear();
+            s.referenced.clear();
+            s.slots.clear();
+            s.hand = 0;
+        }
+    };
+
+    // the tiled pyramid of a PPM image, converted first if it is missing or older than the image;
+    // returns the index for sample(), or NoTexture if neither can be read
+    uint32_t open(const std::string& image) {
+        std::lock_guard<std::mutex> lock(filesMutex);
+        auto known = fileIndex.find(image);
+        if (known != fileIndex.end()) return known->second;
+        if (fileCount == MaxTextureFiles) return NoTexture;
+
+        std::string path = image + ".tiles";
+        std::error_code ec1, ec2;
+        auto imageTime = std::filesystem::last_write_time(image, ec1);
+        auto tilesTime = std::filesystem::last_write_time(path, ec2);
+        std::unique_ptr<File> file(new File);
+        bool current = !ec2 && (ec1 || tilesTime >= imageTime) && file->open(path);
+        if (!current && !(convertToTiledImage(image, path) && file->open(path))) return NoTexture;
+        files[fileCount] = std::move(file);
+        fileIndex[image] = fileCount;
+        return fileCount++;
+    };
+
+    // color (0-1) of texture file at uv, wrapping around, trilinearly filtered over width units of uv
+    glm::vec3 sample(uint32_t file, const glm::vec2& uv, float width) {
+        File& f = *files[file];
+        int last = int(f.header.levelCount) - 1;
+        float texels = float(std::max(f.header.levels[0].width, f.header.levels[0].height));
+        float lod = width > 0.0f ? std::log2(width * texels) : 0.0f;
+        if (!(lod > 0.0f)) return bilinear(file, f, 0, uv);
+        if (lod >= float(last)) return bilinear(file, f, last, uv);
+        int level = int(lod);
+        return glm::mix(bilinear(file, f, level, uv), bilinear(file, f, level + 1, uv), lod - float(level));
+    };
+
+    Stats stats() {
+        Stats total;
+        for (Shard& s : shards) {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            total.lookups += s.lookups;
+            total.misses += s.misses;
+            total.evictions += s.evictions;
+            total.residentBytes += s.tiles.size() * TextureTileBytes;
+            total.budgetBytes += size_t(s.capacity) * TextureTileBytes;
+        }
+        return total;
+    };
+
+    uint32_t FileCount() const { return fileCount; };
+
+private:
+    static const uint32_t ShardCount = 16;
+
+    struct File {
+        TiledImageHeader header;
+        std::ifstream in;
+        std::mutex mutex;
+
+        // false unless path holds a pyramid as writeTiledImage() lays it out, with every tile inside the file
+        bool open(const std::string& path) {
+            in.close();
+            in.clear();
+            in.open(path, std::ios_base::in | std::ios_base::binary);
+            if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+            if (std::memcmp(header.magic, TiledImageMagic, 8) != 0 || header.version != TiledImageVersion ||
+                header.levelCount == 0 || header.levelCount > uint32_t(MaxTextureLevels)) return false;
+            in.seekg(0, std::ios_base::end);
+            std::streamoff end = in.tellg();
+            if (end < 0) return false;
+            uint64_t size = uint64_t(end);
+            for (uint32_t n = 0; n < header.levelCount; ++n) {
+                const TiledLevel& l = header.levels[n];
+                if (l.width == 0 || l.height == 0 || l.width > MaxTextureSize || l.height > MaxTextureSize) return false;
+                if (n > 0 && (l.width != (header.levels[n - 1].width + 1) / 2 || l.height != (header.levels[n - 1].height + 1) / 2)) return false;
+                if (l.tilesX != (l.width + TextureTileSize - 1) / TextureTileSize ||
+                    l.tilesY != (l.height + TextureTileSize - 1) / TextureTileSize) return false;
+                uint64_t bytes = uint64_t(l.tilesX) * l.tilesY * TextureTileBytes;
+                if (l.offset < sizeof(header) || l.offset > size || bytes > size - l.offset) return false;
+            }
+            return true;
+        };
+        // a tile at offset; black if the file cannot be read
+        void read(uint64_t offset, uint8_t* tile) {
+            std::lock_guard<std::mutex> lock(mutex);
+            in.clear();
+            in.seekg(std::streamoff(offset));
+            if (!in.read(reinterpret_cast<char*>(tile), std::streamsize(TextureTileBytes))) std::memset(tile, 0, TextureTileBytes);
+        };
+    };
+
+    struct alignas(64) Tile {
+        uint8_t texels[TextureTileBytes];
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        uint32_t capacity = 0;
+        std::vector<std::unique_ptr<Tile>> tiles;
+        std::vector<uint64_t> keys;       // of every slot
+        std::vector<uint8_t> referenced;  // used since the clock hand last passed
+        std::unordered_map<uint64_t, uint32_t> slots;
+        uint32_t hand = 0;
+        uint64_t lookups = 0, misses = 0, evictions = 0;
+    };
+
+    static uint64_t tileKey(uint32_t file, int level, uint32_t tx, uint32_t ty) {
+        return (uint64_t(file) << 50) | (uint64_t(level) << 45) | (uint64_t(ty) << 22) | uint64_t(tx);
+    };
+
+    // the tile with key in shard s, read from file f if it is not cached; s must be locked
+    const uint8_t* residentTile(Shard& s, uint64_t key, File& f, const TiledLevel& l, uint32_t tx, uint32_t ty) {
+        s.lookups++;
+        auto it = s.slots.find(key);
+        if (it != s.slots.end()) {
+            s.referenced[it->second] = 1;
+            return s.tiles[it->second]->texels;
+        }
+        s.misses++;
+        uint32_t slot;
+        if (s.tiles.size() < s.capacity) {
+            slot = uint32_t(s.tiles.size());
+            s.tiles.emplace_back(new Tile);
+            s.keys.push_back(key);
+            s.referenced.push_back(1);
+        } else {
+            while (s.referenced[s.hand]) {
+                s.referenced[s.hand] = 0;
+                s.hand = (s.hand + 1) % s.capacity;
+            }
+            slot = s.hand;
+            s.hand = (s.hand + 1) % s.capacity;
+            s.slots.erase(s.keys[slot]);
+            s.evictions++;
+            s.keys[slot] = key;
+            s.referenced[slot] = 1;
+        }
+        s.slots[key] = slot;
+        f.read(l.offset + (uint64_t(ty) * l.tilesX + tx) * TextureTileBytes, s.tiles[slot]->texels);
+        return s.tiles[slot]->texels;
+    };
+
+    // bilinear lookup in one level; the four texels are read under one lock when they share a tile
+    glm::vec3 bilinear(uint32_t file, File& f, int level, const glm::vec2& uv) {
+        const TiledLevel& l = f.header.levels[level];
+        float x = (uv.x - std::floor(uv.x)) * float(l.width) - 0.5f;
+        float y = (uv.y - std::floor(uv.y)) * float(l.height) - 0.5f;
+        float x0 = std::floor(x);
+        float y0 = std::floor(y);
+        float fx = x - x0;
+        float fy = y - y0;
+        auto wrap = [](int v, uint32_t n) { return uint32_t((v % int(n) + int(n)) % int(n)); };
+        uint32_t xa = wrap(int(x0), l.width), xb = wrap(int(x0) + 1, l.width);
+        uint32_t ya = wrap(int(y0), l.height), yb = wrap(int(y0) + 1, l.height);
+        uint32_t xs[4] = {xa, xb, xa, xb};
+        uint32_t ys[4] = {ya, ya, yb, yb};
+        glm::vec3 texel[4];
+        for (int i = 0; i < 4;) {
+            uint32_t tx = xs[i] / TextureTileSize;
+            uint32_t ty = ys[i] / TextureTileSize;
+            uint64_t key = tileKey(file, level, tx, ty);
+            Shard& s = shards[(key * 0x9e3779b97f4a7c15ull) >> 60];
+            std::lock_guard<std::mutex> lock(s.mutex);
+            const uint8_t* tile = residentTile(s, key, f, l, tx, ty);
+            // this and the following texels of the same tile
+            do {
+                const uint8_t* t = tile + size_t((ys[i] % TextureTileSize) * TextureTileSize + xs[i] % TextureTileSize) * 4;
+                texel[i] = glm::vec3(t[0], t[1], t[2]);
+                i++;
+            } while (i < 4 && xs[i] / TextureTileSize == tx && ys[i] / TextureTileSize == ty);
+        }
+        glm::vec3 top = glm::mix(texel[0], texel[1], fx);
+        glm::vec3 bottom = glm::mix(texel[2], texel[3], fx);
+        return glm::mix(top, bottom, fy) / 255.0f;
+    };
+
+    Shard shards[ShardCount];
+    std::vector<std::unique_ptr<File>> files; // MaxTextureFiles entries, never resized
+    uint32_t fileCount = 0;
+    std::unordered_map<std::string, uint32_t> fileIndex;
+    std::mutex filesMutex;
+};
+
+inline void printTextureCacheStats(std::ostream& os, const TextureCache::Stats& s) {
+    os << "texture cache: " << s.lookups << " tile lookups, " << s.misses << " tiles read, " << s.evictions
+       << " evicted, " << (s.residentBytes >> 10) << " of " << (s.budgetBytes >> 10) << " KB in use" << std::endl;
+}
+
+// the cache shared by all scenes of the process
+inline TextureCache& textureCache() {
+    static TextureCache cache;
+    return cache;
+}
+
+#endif
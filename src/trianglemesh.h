@@ -0,0 +1,157 @@
+#ifndef TRIANGLEMESH_H_
+#define TRIANGLEMESH_H_
+
+#include <glm/glm.hpp>
+#include <glm/vec3.hpp>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "object.h"
+#include "packet.h"
+
+// indexed triangle mesh: shared vertex positions, optional per-vertex normals (a zero normal means
+// "use the face normal") and three vertex indices per triangle. the whole mesh is one object with
+// one material; the scene copies its triangles into flat arrays and puts every triangle into its BVH.
+class TriangleMesh : public Object {
+public:
+    TriangleMesh(glm::vec3 col, bool reflecting = false, float ambientFactor = 0.2f, float specExponent = 50.0f)
+        : Object(col, reflecting, ambientFactor, specExponent) {}
+
+    uint32_t addVertex(const glm::vec3& position, const glm::vec3& normal = glm::vec3(0.0f, 0.0f, 0.0f)) {
+        positions.push_back(position);
+        normals.push_back(normal);
+        return uint32_t(positions.size() - 1);
+    };
+    void addTriangle(uint32_t a, uint32_t b, uint32_t c) {
+        indices.push_back(a);
+        indices.push_back(b);
+        indices.push_back(c);
+    };
+
+    // Wavefront OBJ: v, vn and f statements are read (polygons are triangulated as fans, negative
+    // indices count from the end), everything else is ignored. a vertex is created per distinct
+    // position/normal pair used by the faces. returns false and reports the line on errors.
+    bool loadOBJ(const std::string& path) {
+        std::ifstream in(path);
+        if (in.fail()) {
+            std::cerr << "cannot open mesh " << path << std::endl;
+            return false;
+        }
+        std::vector<glm::vec3> filePositions;
+        std::vector<glm::vec3> fileNormals;
+        std::unordered_map<uint64_t, uint32_t> vertexOf; // (position, normal) index pair -> mesh vertex
+        std::vector<uint32_t> face;
+        std::string line;
+        int lineNo = 0;
+        auto fail = [&](const char* msg) {
+            std::cerr << path << ":" << lineNo << ": " << msg << std::endl;
+            return false;
+        };
+
+        while (std::getline(in, line)) {
+            lineNo++;
+            const char* s = line.c_str();
+            while (*s == ' ' || *s == '\t') s++;
+            if (s[0] == 'v' && (s[1] == ' ' || s[1] == '\t')) {
+                glm::vec3 p;
+                if (!parseFloats(s + 2, p)) return fail("bad vertex");
+                filePositions.push_back(p);
+            } else if (s[0] == 'v' && s[1] == 'n' && (s[2] == ' ' || s[2] == '\t')) {
+                glm::vec3 n;
+                if (!parseFloats(s + 3, n)) return fail("bad normal");
+                // a zero (or overflowing) normal is kept as zero, which shades with the face normal
+                float length = glm::length(n);
+                fileNormals.push_back(length > 0.0f && std::isfinite(length) ? n / length : glm::vec3(0.0f));
+            } else if (s[0] == 'f' && (s[1] == ' ' || s[1] == '\t')) {
+                face.clear();
+                s += 2;
+                while (true) {
+                    while (*s == ' ' || *s == '\t' || *s == '\r') s++;
+                    if (*s == 0) break;
+                    // v, v/vt, v//vn or v/vt/vn
+                    char* end;
+                    long pi = std::strtol(s, &end, 10);
+                    if (end == s) return fail("bad face");
+                    s = end;
+                    long ni = 0;
+                    if (*s == '/') {
+                        s++;
+                        if (*s != '/') {
+                            std::strtol(s, &end, 10); // texture coordinate, unused
+                            s = end;
+                        }
+                        if (*s == '/') {
+                            s++;
+                            ni = std::strtol(s, &end, 10);
+                            s = end;
+                        }
+                    }
+                    long p = resolve(pi, filePositions.size());
+                    long n = ni == 0 ? -1 : resolve(ni, fileNormals.size());
+                    if (p < 0 || (ni != 0 && n < 0)) return fail("face index out of range");
+
+                    uint64_t key = (uint64_t(p) << 32) | uint32_t(n);
+                    auto it = vertexOf.find(key);
+                    if (it == vertexOf.end()) {
+                        uint32_t v = addVertex(filePositions[p], n < 0 ? glm::vec3(0.0f) : fileNormals[n]);
+                        it = vertexOf.emplace(key, v).first;
+                    }
+                    face.push_back(it->second);
+                }
+                if (face.size() < 3) return fail("face with less than three vertices");
+                for (size_t i = 2; i < face.size(); ++i) addTriangle(face[0], face[i - 1], face[i]);
+            }
+        }
+        return true;
+    };
+
+    // brute force over all triangles, for single authoring-time queries (the scene uses its BVH)
+    float intersect(const glm::vec3& rayOrigin, const glm::vec3& rayDir, glm::vec3& intersectPos, glm::vec3& normal) {
+        float best = -1.0f;
+        for (size_t t = 0; t < TriangleCount(); ++t) {
+            const glm::vec3& v0 = positions[indices[3*t]];
+            const glm::vec3& v1 = positions[indices[3*t + 1]];
+            const glm::vec3& v2 = positions[indices[3*t + 2]];
+            float dist_ = triangleDistance(rayOrigin, rayDir, v0, v1, v2);
+            if (dist_ >= 0.0f && (best < 0.0f || dist_ < best)) {
+                best = dist_;
+                normal = glm::normalize(glm::cross(v1 - v0, v2 - v0));
+            }
+        }
+        if (best >= 0.0f) intersectPos = rayOrigin + rayDir*best;
+        return best;
+    };
+
+    const std::vector<glm::vec3>& Positions() const { return positions; };
+    const std::vector<glm::vec3>& Normals() const { return normals; };
+    const std::vector<uint32_t>& Indices() const { return indices; };
+    size_t TriangleCount() const { return indices.size() / 3; };
+
+private:
+    static bool parseFloats(const char* s, glm::vec3& v) {
+        for (int i = 0; i < 3; ++i) {
+            char* end;
+            v[i] = std::strtof(s, &end);
+            if (end == s) return false;
+            s = end;
+        }
+        return true;
+    };
+
+    // 1-based OBJ index (negative: relative to the end) to a 0-based index, -1 if out of range
+    static long resolve(long index, size_t count) {
+        long i = index > 0 ? index - 1 : long(count) + index;
+        return (i >= 0 && i < long(count)) ? i : -1;
+    };
+
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    std::vector<uint32_t> indices;
+};
+
+#endif
@@ -0,0 +1,252 @@
+#ifndef WAVEFRONT_H_
+#define WAVEFRONT_H_
+
+#include <glm/glm.hpp>
+#include <glm/vec3.hpp>
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include "arena.h"
+#include "integrator.h"
+#include "lights.h"
+#include "material.h"
+#include "ray.h"
+#include "scene.h"
+#include "shading.h"
+#include "stats.h"
+
+// Phong shading with mirror reflections for a batch of primary hits (the pixels of a tile), in
+// wavefront order: instead of following one path to its end before starting the next, all paths
+// advance one bounce at a time through stages that each run over the whole batch: light selection,
+// shadow rays, direct lighting and reflection rays. the shadow and reflection rays of a stage are
+// queued, sorted by direction octant and origin cell and traced in that order, so that consecutive
+// rays visit the same BVH nodes even after the mirrors have scattered them. once every path has
+// ended, the bounces are shaded back to front level by level.
+// the colors are those of ReflectionIntegrator::shade(); footprints are not recorded
+class WavefrontIntegrator {
+public:
+    WavefrontIntegrator(const Scene& scn, const LightSampler& lightSampler, const ReflectionSettings& config = ReflectionSettings(),
+                        float spreadAngle = 0.0f)
+        : scene(scn), lights(lightSampler), settings(config), pixelSpread(spreadAngle) {
+        settings.maxDepth = glm::clamp(settings.maxDepth, 0, MaxReflectionDepth);
+    };
+
+    // colors of count primary rays and their closest hits (background for misses); the queues and
+    // path states are taken from arena and released on return
+    void shade(const Ray* rays, const Hit* hits, int count, const glm::vec3& background, glm::vec3* colors,
+               ScratchArena& arena) const {
+        ScratchArena::Scope scope(arena);
+        float* throughput = arena.alloc<float>(size_t(count));
+        uint8_t* valid = arena.alloc<uint8_t>(size_t(count)); // the radiance behind the bounce is known
+
+        // the bounces of every level, level 0 holds the primary hits
+        Vertex* levels[MaxReflectionDepth + 1];
+        int levelSize[MaxReflectionDepth + 1];
+        Vertex* primary = arena.alloc<Vertex>(size_t(count));
+        int n = 0;
+        for (int i = 0; i < count; ++i) {
+            throughput[i] = 1.0f;
+            valid[i] = 0;
+            // the radiance behind a truncated path is black
+            colors[i] = hits[i].primId == NoHit ? background : glm::vec3(0.0f, 0.0f, 0.0f);
+            if (hits[i].primId == NoHit) continue;
+            Vertex& v = primary[n++];
+            v.path = uint32_t(i);
+            v.primId = hits[i].primId;
+            scene.attributes(rays[i].origin(), rays[i].direction(), hits[i], v.pos, v.normal);
+            v.dir = rays[i].direction();
+            v.origin = rays[i].origin();
+            v.eye = rays[i].origin();
+            v.distance = hits[i].t;
+        }
+        levels[0] = primary;
+        levelSize[0] = n;
+
+        int depth = 0;
+        while (true) {
+            Vertex* level = levels[depth];
+            int size = levelSize[depth];
+            LightSelection* selections = arena.alloc<LightSelection>(size_t(size));
+            for (int v = 0; v < size; ++v) {
+                level[v].mat = &scene.material(level[v].primId);
+                level[v].features = materialFeatures(*level[v].mat);
+                lights.select(level[v].pos, selections[v]);
+            }
+            shadowStage(level, selections, size, depth, arena);
+            for (int v = 0; v < size; ++v) {
+                Vertex& b = level[v];
+                b.lighting = withMaterialFeatures(b.features, [&](auto features) {
+                    return phongLighting<decltype(features)::value, true>(*b.mat, b.pos, b.normal, Ray(b.eye, b.dir), selections[v]);
+                });
+            }
+            if (depth == settings.maxDepth) break;
+            levels[depth + 1] = arena.alloc<Vertex>(size_t(size));
+            levelSize[depth + 1] = reflectionStage(level, size, depth, levels[depth + 1], throughput, valid, arena);
+            if (levelSize[depth + 1] == 0) break;
+            depth++;
+        }
+
+        // shade back to front: a reflecting bounce takes the radiance behind it as its color, or its
+        // own color if its path left the scene or exceeded the depth limit there
+        for (int d = depth; d >= 0; --d) {
+            for (int v = 0; v < levelSize[d]; ++v) {
+                const Vertex& b = levels[d][v];
+                profileDepth(d);
+                glm::vec3 k = (b.mat->reflect && valid[b.path]) ? colors[b.path] : surfaceColor(scene, *b.mat, b.primId, b.pos, pixelSpread * b.distance);
+                colors[b.path] = withMaterialFeatures(b.features, [&](auto features) {
+                    return phongShading<decltype(features)::value>(*b.mat, b.lighting, k, k);
+                });
+                valid[b.path] = 1;
+            }
+        }
+    };
+
+private:
+    struct Vertex {
+        uint32_t path;
+        uint32_t primId;
+        uint32_t features; // of mat
+        const Material* mat;
+        glm::vec3 pos;
+        glm::vec3 normal;
+        glm::vec3 dir;    // direction of the ray that hit pos
+        glm::vec3 origin; // and its origin
+        glm::vec3 eye;    // view point of the specular term
+        float distance;   // length of the path from the camera to pos
+        PhongLighting lighting;
+    };
+
+    struct QueuedRay {
+        glm::vec3 origin;
+        glm::vec3 dir;
+        float tMax;
+        uint32_t vertex;
+        uint32_t light;
+    };
+
+    // spreads the low 5 bits of v to every third bit
+    static uint32_t spread(uint32_t v) {
+        v &= 0x1f;
+        v = (v | (v << 8)) & 0x0000f00f;
+        v = (v | (v << 4)) & 0x000c30c3;
+        v = (v | (v << 2)) & 0x00249249;
+        return v;
+    };
+
+    // the trace order of a ray queue: by direction octant, then by the Morton code of the origin on a
+    // 32^3 grid over the origins of the queue. a stable two pass radix sort of the 18 bit keys, so
+    // rays with the same key stay in queue order. the rays of level 0 start from the primary hits in
+    // pixel order, which is as coherent as it gets, and keep that order
+    const uint32_t* sortRays(const QueuedRay* queue, int count, int depth, ScratchArena& arena) const {
+        uint32_t* order = arena.alloc<uint32_t>(size_t(count));
+        for (int r = 0; r < count; ++r) order[r] = uint32_t(r);
+        if (depth == 0) return order;
+
+        uint32_t* keys = arena.alloc<uint32_t>(size_t(count));
+        glm::vec3 lo(FLT_MAX);
+        glm::vec3 hi(-FLT_MAX);
+        for (int r = 0; r < count; ++r) {
+            lo = glm::min(lo, queue[r].origin);
+            hi = glm::max(hi, queue[r].origin);
+        }
+        glm::vec3 scale = 31.0f / glm::max(hi - lo, glm::vec3(FLT_MIN));
+        for (int r = 0; r < count; ++r) {
+            const QueuedRay& ray = queue[r];
+            uint32_t octant = (ray.dir.x < 0.0f ? 1u : 0u) | (ray.dir.y < 0.0f ? 2u : 0u) | (ray.dir.z < 0.0f ? 4u : 0u);
+            glm::vec3 cell = glm::clamp((ray.origin - lo) * scale, 0.0f, 31.0f);
+            keys[r] = (octant << 15) | spread(uint32_t(cell.x)) | (spread(uint32_t(cell.y)) << 1) | (spread(uint32_t(cell.z)) << 2);
+        }
+        uint32_t* sorted = arena.alloc<uint32_t>(size_t(count));
+        for (int shift = 0; shift < 18; shift += 9) {
+            uint32_t start[513] = {};
+            for (int r = 0; r < count; ++r) start[((keys[order[r]] >> shift) & 511) + 1]++;
+            for (int b = 0; b < 512; ++b) start[b + 1] += start[b];
+            for (int r = 0; r < count; ++r) sorted[start[(keys[order[r]] >> shift) & 511]++] = order[r];
+            std::swap(order, sorted);
+        }
+        return order;
+    };
+
+    // shadow stage: one ray per selected light that sends any light, from the light to the point as
+    // in isIntersected(); sets the visibility of the selections
+    void shadowStage(const Vertex* level, LightSelection* selections, int size, int depth, ScratchArena& arena) const {
+        ScratchArena::Scope scope(arena);
+        int capacity = 0;
+        for (int v = 0; v < size; ++v) capacity += selections[v].count;
+        QueuedRay* queue = arena.alloc<QueuedRay>(size_t(capacity));
+        int count = 0;
+        for (int v = 0; v < size; ++v) {
+            LightSelection& selection = selections[v];
+            for (int l = 0; l < selection.count; ++l) {
+                selection.visible[l] = false;
+                if (selection.intensity[l] == glm::vec3(0.0f)) continue;
+                QueuedRay& ray = queue[count++];
+                ray.origin = selection.position[l];
+                ray.dir = glm::normalize(level[v].pos - selection.position[l]);
+                ray.tMax = glm::distance(selection.position[l], level[v].pos);
+                ray.vertex = uint32_t(v);
+                ray.light = uint32_t(l);
+            }
+        }
+        const uint32_t* order = sortRays(queue, count, depth, arena);
+        for (int r = 0; r < count; ++r) {
+            const QueuedRay& ray = queue[order[r]];
+            selections[ray.vertex].visible[ray.light] = !scene.occluded(ray.origin, ray.dir, ray.tMax, level[ray.vertex].primId);
+        }
+        threadRayCounts().shadow += uint64_t(count);
+    };
+
+    // reflection stage: the mirror bounces of the level that are within the throughput limit are
+    // traced, their hits become the next level; returns its size
+    int reflectionStage(const Vertex* level, int size, int depth, Vertex* next, float* throughput, uint8_t* valid,
+                         ScratchArena& arena) const {
+        ScratchArena::Scope scope(arena);
+        QueuedRay* queue = arena.alloc<QueuedRay>(size_t(size));
+        int count = 0;
+        for (int v = 0; v < size; ++v) {
+            const Vertex& b = level[v];
+            if (!b.mat->reflect) continue;
+            throughput[b.path] *= b.mat->ambient + diffuseFactor(b);
+            if (throughput[b.path] < settings.minThroughput) {
+                // truncated: the radiance behind is taken as black
+                valid[b.path] = 1;
+                continue;
+            }
+            QueuedRay& ray = queue[count++];
+            ray.origin = b.pos;
+            ray.dir = glm::normalize(glm::reflect(b.dir, b.normal));
+            ray.vertex = uint32_t(v);
+        }
+        const uint32_t* order = sortRays(queue, count, depth, arena);
+        int n = 0;
+        for (int r = 0; r < count; ++r) {
+            const QueuedRay& ray = queue[order[r]];
+            const Vertex& b = level[ray.vertex];
+            Hit hit = scene.intersect(ray.origin, ray.dir, -FLT_EPSILON, b.primId);
+            if (hit.primId == NoHit) continue;
+            Vertex& c = next[n++];
+            c.path = b.path;
+            c.primId = hit.primId;
+            scene.attributes(ray.origin, ray.dir, hit, c.pos, c.normal);
+            c.dir = ray.dir;
+            c.origin = ray.origin;
+            // the view point of a bounce is the origin of the ray that led to its parent
+            c.eye = b.origin;
+            c.distance = b.distance + hit.t;
+        }
+        threadRayCounts().reflection += uint64_t(count);
+        return n;
+    };
+
+    // diffuse factor of the visible lights, in the strongest channel
+    static float diffuseFactor(const Vertex& b) {
+        return std::max(std::max(b.lighting.diffuse.x, b.lighting.diffuse.y), b.lighting.diffuse.z);
+    };
+
+    const Scene& scene;
+    const LightSampler& lights;
+    ReflectionSettings settings;
+    float pixelSpread; // widening of the ray cone per unit of path length
+};
+
+#endif
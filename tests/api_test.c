@@ -0,0 +1,147 @@
+/* checks of the C interface (src/raytracer_api.h) as a C program: a region rendered into a padded
+   buffer equals that part of the full frame, bad arguments are rejected and a cancel from another
+   thread is reported. exits with the number of failed checks */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "raytracer_api.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                        \
+    do {                                                                   \
+        if (!(cond)) {                                                     \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                    \
+        }                                                                  \
+    } while (0)
+
+/* the spheres and planes of the assignment scene */
+static rt_scene* assignmentScene(int width, int height) {
+    static const float sphereColors[4][3] = {{1.0f, 0.5f, 0.0f}, {0.0f, 1.0f, 0.5f}, {0.0f, 0.5f, 1.0f}, {1.0f, 0.5f, 0.5f}};
+    static const float centers[4][3] = {{0.0f, 0.0f, -5.0f}, {1.0f, 0.0f, -5.5f}, {-1.0f, 0.5f, -3.0f}, {-0.5f, -0.5f, -2.5f}};
+    static const float radii[4] = {0.75f, 0.5f, 0.2f, 0.2f};
+    static const float normals[6][3] = {{0, 1, 0}, {-1, 0, 0}, {0, 0, 1}, {1, 0, 0}, {0, -1, 0}, {0, 0, -1}};
+    static const float points[6][3] = {{0, -1, 0}, {2, 0, 0}, {0, 0, -10}, {-3, 0, 0}, {0, 2.5f, 0}, {0, 0, 2}};
+    static const float wall[3] = {0.75f, 0.75f, 0.75f};
+    rt_scene* scene = NULL;
+    uint32_t material;
+    int i;
+
+    CHECK(rt_scene_create(&scene) == RT_OK);
+    CHECK(rt_scene_set_resolution(scene, width, height) == RT_OK);
+    for (i = 0; i < 4; ++i) {
+        CHECK(rt_scene_add_material(scene, sphereColors[i], i == 0, 0.2f, 50.0f, &material) == RT_OK);
+        CHECK(rt_scene_add_sphere(scene, material, centers[i], radii[i]) == RT_OK);
+    }
+    for (i = 0; i < 6; ++i) {
+        CHECK(rt_scene_add_material(scene, wall, i == 0, 0.2f, 50.0f, &material) == RT_OK);
+        CHECK(rt_scene_add_plane(scene, material, normals[i], points[i]) == RT_OK);
+    }
+    return scene;
+}
+
+static void testRegion(void) {
+    enum { Width = 96, Height = 64, X = 21, Y = 13, W = 40, H = 30, Pad = 5 };
+    static uint8_t full[Width * Height * 3];
+    static uint8_t region[H * (W * 3 + Pad)];
+    size_t stride = W * 3 + Pad;
+    rt_scene* scene = assignmentScene(Width, Height);
+    rt_renderer* renderer = NULL;
+    rt_renderer* other = NULL;
+    int y, equal = 1, padding = 1;
+    size_t i;
+
+    CHECK(rt_renderer_create(Width, Height, 2, 16, &renderer) == RT_OK);
+    CHECK(rt_render(renderer, scene, RT_SHADE_REFLECTIONS, 0, 0, Width, Height, full, Width * 3) == RT_ERROR_NOT_COMMITTED);
+    CHECK(rt_scene_commit(scene) == RT_OK);
+    CHECK(rt_render(renderer, scene, RT_SHADE_REFLECTIONS, 0, 0, Width, Height, full, Width * 3) == RT_OK);
+
+    memset(region, 0xab, sizeof(region));
+    CHECK(rt_render(renderer, scene, RT_SHADE_REFLECTIONS, X, Y, W, H, region, stride) == RT_OK);
+    for (y = 0; y < H; ++y) {
+        equal = equal && memcmp(&region[y * stride], &full[((Y + y) * Width + X) * 3], W * 3) == 0;
+        for (i = W * 3; i < stride; ++i) padding = padding && region[y * stride + i] == 0xab;
+    }
+    CHECK(equal);
+    CHECK(padding);
+
+    /* regions outside the frame, a short stride, another resolution */
+    CHECK(rt_render(renderer, scene, RT_SHADE_REFLECTIONS, Width - W + 1, Y, W, H, region, stride) == RT_ERROR_ARGUMENT);
+    CHECK(rt_render(renderer, scene, RT_SHADE_REFLECTIONS, -1, Y, W, H, region, stride) == RT_ERROR_ARGUMENT);
+    CHECK(rt_render(renderer, scene, RT_SHADE_REFLECTIONS, X, Y, 0x7fffffff, H, region, stride) == RT_ERROR_ARGUMENT);
+    CHECK(rt_render(renderer, scene, RT_SHADE_REFLECTIONS, X, Y, W, H, region, W * 3 - 1) == RT_ERROR_ARGUMENT);
+    CHECK(rt_renderer_create(Width / 2, Height / 2, 1, 16, &other) == RT_OK);
+    CHECK(rt_render(other, scene, RT_SHADE_REFLECTIONS, 0, 0, 8, 8, region, stride) == RT_ERROR_ARGUMENT);
+
+    rt_renderer_destroy(other);
+    rt_renderer_destroy(renderer);
+    rt_scene_destroy(scene);
+}
+
+struct CancelJob {
+    rt_renderer* renderer;
+    rt_scene* scene;
+    uint8_t* rgb;
+    int width, height;
+    rt_status status;
+    volatile int done;
+};
+
+static void* renderJob(void* arg) {
+    struct CancelJob* job = (struct CancelJob*)arg;
+    job->status = rt_render(job->renderer, job->scene, RT_SHADE_REFLECTIONS, 0, 0, job->width, job->height, job->rgb,
+                            (size_t)job->width * 3);
+    __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void testCancel(void) {
+    /* enough samples that the render outlasts the first cancels by far */
+    struct CancelJob job;
+    struct timespec pause = {0, 1000000};
+    size_t bytes, i, untouched = 0;
+    pthread_t thread;
+
+    job.width = 256;
+    job.height = 256;
+    job.scene = assignmentScene(job.width, job.height);
+    CHECK(rt_scene_commit(job.scene) == RT_OK);
+    CHECK(rt_renderer_create(job.width, job.height, 2, 16, &job.renderer) == RT_OK);
+    CHECK(rt_renderer_set(job.renderer, RT_SETTING_SAMPLES, 64) == RT_OK);
+    bytes = (size_t)job.width * job.height * 3;
+    job.rgb = (uint8_t*)malloc(bytes);
+    memset(job.rgb, 0xab, bytes);
+    job.done = 0;
+
+    /* a cancel before the render starts has no effect on it, so cancel until it has stopped */
+    CHECK(pthread_create(&thread, NULL, renderJob, &job) == 0);
+    while (!__atomic_load_n(&job.done, __ATOMIC_ACQUIRE)) {
+        rt_renderer_cancel(job.renderer);
+        nanosleep(&pause, NULL);
+    }
+    pthread_join(thread, NULL);
+    CHECK(job.status == RT_CANCELLED);
+    for (i = 0; i < bytes; ++i) untouched += job.rgb[i] == 0xab;
+    CHECK(untouched > bytes / 2);
+
+    /* the next render is not affected */
+    CHECK(rt_renderer_set(job.renderer, RT_SETTING_SAMPLES, 1) == RT_OK);
+    CHECK(rt_render(job.renderer, job.scene, RT_SHADE_FLAT, 0, 0, job.width, job.height, job.rgb, (size_t)job.width * 3) == RT_OK);
+
+    free(job.rgb);
+    rt_renderer_destroy(job.renderer);
+    rt_scene_destroy(job.scene);
+}
+
+int main(void) {
+    CHECK(rt_api_version() == RT_API_VERSION);
+    testRegion();
+    testCancel();
+    if (failures == 0) printf("api test passed\n");
+    return failures;
+}